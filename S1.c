@@ -1,8 +1,11 @@
 // S1.c
 // Acts as the main server in the distributed file system.
 // Handles commands: uploadf, downlf, dispfnames, removef, downltar.
-// Routes files based on extension: .c (S1), .pdf (S2), .txt (S3), .zip (S4).
+// Keeps .c files itself and routes every other extension to the storage
+// nodes holding it (see dfs_route.h); by default .pdf (S2), .txt (S3),
+// .zip (S4).
 
+#define _GNU_SOURCE  // splice(), pipe2()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,297 +15,811 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "dfs_proto.h"
+#include "dfs_index.h"
+#include "dfs_reactor.h"
+#include "dfs_tar.h"
+#include "dfs_list.h"
+#include "dfs_delta.h"
+#include "dfs_cache.h"
+#include "dfs_sync.h"
+#include "dfs_route.h"
 
 // ----------------------------
 // Configuration Constants
 // ----------------------------
 #define PORT 6500
 #define BUFFER_SIZE 2048
+#define CLIENT_STALL_SECS 60       // A client may stall this long mid-command (reactor mode)
+#define DISPFNAMES_TIMEOUT_MS 5000 // How long dispfnames waits for the storage nodes
+#define REMOVE_BATCH_MAX 256       // Paths one removef may name
+#define CACHE_MB 256               // Default size of the hot-file cache (-m)
 
-// Port assignments for S2, S3, S4
-#define S2_PORT 6501
-#define S3_PORT 6502
-#define S4_PORT 6503
+#define NODES_FILE ".dfs_nodes" // Routing table in ~/S1 (-c names another)
 
-// Localhost IPs
-#define S2_IP "127.0.0.1"
-#define S3_IP "127.0.0.1"
-#define S4_IP "127.0.0.1"
+// The storage nodes: where each server id recorded in the index lives and
+// which of them take which extension (id 1 is S1 itself)
+struct dfs_routes routes;
 
 // ----------------------------
-// File mapping structure
-// Used to track uploaded file names and their paths
-// so that S1 knows where they are stored across S2/S3/S4
+// File index
+// Persistent map from logical path (e.g. "reports/q1.pdf") to the server
+// holding the file, shared by every client session (see dfs_index.h)
 // ----------------------------
-struct FileMap {
-    char filename[256];            // Only the name of the file
-    char relative_path[512];       // Full relative path to retrieve later
+struct dfs_index file_index;
+
+// In-memory listing of the .c files under ~/S1 (see dfs_list.h)
+struct dfs_list c_files;
+
+// Recently downloaded files of the storage nodes, served without asking them again
+// (see dfs_cache.h); off in fork mode, where it would only serve one client
+struct dfs_cache file_cache;
+
+// Makes .c uploads durable, batching their fsyncs (see dfs_sync.h); in fork
+// mode each client's process starts its own flusher
+struct dfs_sync syncer;
+
+// ----------------------------
+// Pipelined client sessions (reactor mode)
+// A client may send many commands without waiting for their replies. The
+// reactor worker reads one command at a time; uploads run right there (the
+// file body follows the command on the same stream), everything else is
+// handed to the command pool and the connection is re-armed at once, so
+// the next command is read while earlier ones are still running. Replies
+// carry the command's request id and go out in whatever order the
+// commands finish. Each reply is written whole under the session's write
+// lock so frames from different commands never interleave.
+// ----------------------------
+#define COMMAND_THREADS_PER_WORKER 4  // Command pool size per reactor worker
+#define COMMAND_QUEUE 4096            // Queued commands, all sessions together
+#define SESSION_MAX_INFLIGHT 64       // Commands one session may have running
+
+struct session {
+    pthread_mutex_t write_lock;     // Held while one reply is written
+    pthread_mutex_t lock;           // Guards the fields below
+    int inflight;                   // Commands handed to the command pool
+    int reading;                    // 0 once the client hung up
+    int paused;                     // Reading stopped until inflight drops
 };
 
-struct FileMap file_map[100];      // Static array to store 100 files max
-int file_map_count = 0;            // Number of currently stored file mappings
+struct dfs_reactor reactor;
+struct dfs_pool command_pool;
+struct session** sessions;          // Indexed by fd; NULL in fork mode
+int max_sessions;
 
-// Save uploaded file path for lookup later
-void save_file_path(const char* filename, const char* dest) {
-    strcpy(file_map[file_map_count].filename, filename);
-    // dest + 4 skips the "~S2", "~S3" prefix and starts after it (e.g., folder1/file.txt)
-    snprintf(file_map[file_map_count].relative_path, sizeof(file_map[file_map_count].relative_path),
-             "%s/%s", dest + 4, filename);
-    file_map_count++;
+// The session `fd` belongs to, or NULL (fork mode)
+struct session* session_of(int fd) {
+    return sessions && fd < max_sessions ? sessions[fd] : NULL;
 }
 
-// Search for a file's relative path in the mapping
-const char* get_relative_path(const char* filename) {
-    for (int i = 0; i < file_map_count; i++) {
-        if (strcmp(file_map[i].filename, filename) == 0)
-            return file_map[i].relative_path;
+// Create the session for `fd` on its first command
+struct session* session_open(int fd) {
+    if (!sessions || fd >= max_sessions) return NULL;
+    if (!sessions[fd]) {
+        struct session* s = calloc(1, sizeof(*s));
+        if (!s) return NULL;
+        pthread_mutex_init(&s->write_lock, NULL);
+        pthread_mutex_init(&s->lock, NULL);
+        s->reading = 1;
+        sessions[fd] = s;
     }
-    return NULL;
+    return sessions[fd];
+}
+
+// Drop the session once neither the reader nor any command uses it
+void session_close(int fd) {
+    struct session* s = sessions[fd];
+    sessions[fd] = NULL;
+    pthread_mutex_destroy(&s->write_lock);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+    close(fd);
+}
+
+// Every reply to a client goes out between reply_begin and reply_end
+// (no-ops outside a pipelined session)
+void reply_begin(int client_sock) {
+    struct session* s = session_of(client_sock);
+    if (s) pthread_mutex_lock(&s->write_lock);
+}
+
+void reply_end(int client_sock) {
+    struct session* s = session_of(client_sock);
+    if (s) pthread_mutex_unlock(&s->write_lock);
+}
+
+int reply_frame(int client_sock, int opcode, int flags, uint32_t id, const void* payload, size_t len) {
+    reply_begin(client_sock);
+    int rc = dfs_send_frame(client_sock, opcode, flags, id, payload, len);
+    reply_end(client_sock);
+    return rc;
+}
+
+int reply_text(int client_sock, int opcode, uint32_t id, const char* text) {
+    return reply_frame(client_sock, opcode, 0, id, text, strlen(text));
 }
 
 // ----------------------------
-// Send a file to secondary server (S2/S3/S4)
-// Used when user uploads a .pdf/.txt/.zip file
+// Connections to the storage nodes
+// S1 keeps idle connections to each secondary open and reuses them, so a
+// forwarded command costs no TCP handshake. A connection carries one request
+// at a time; concurrent sessions simply take different connections. Each
+// request gets an id of its own and the reply must echo it, so a connection
+// that has fallen out of step is caught and closed instead of reused.
 // ----------------------------
-void send_to_secondary_server(const char* ip, int port, const char* filepath, const char* filename, const char* dest) {
-    int sockfd;
-    struct sockaddr_in addr;
-    char buffer[BUFFER_SIZE];
+#define POOL_IDLE_MAX 32           // Idle connections kept per secondary
 
-    FILE* fp = fopen(filepath, "rb");
-    if (!fp) return;  // File failed to open
+struct conn_pool {
+    pthread_mutex_t lock;
+    int idle[POOL_IDLE_MAX];
+    int nidle;
+} conn_pools[DFS_ROUTE_IDS] = { [0 ... DFS_ROUTE_IDS - 1] = { PTHREAD_MUTEX_INITIALIZER, {0}, 0 } };
 
-    // Create socket and prepare connection details
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    inet_pton(AF_INET, ip, &addr.sin_addr);
+uint32_t pool_next_id(void) {
+    static uint32_t next = 0;
+    return __atomic_add_fetch(&next, 1, __ATOMIC_RELAXED);
+}
 
-    // Connect to target server
-    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        fclose(fp);
-        return;
+// Open a fresh connection to a secondary (-1 if it is down or not in the
+// routing table)
+int pool_connect(int server) {
+    const struct dfs_node* node = dfs_route_node(&routes, server);
+    if (!node) return -1;
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) return -1;
+
+    if (connect(sockfd, (const struct sockaddr*)&node->addr, sizeof(node->addr)) < 0) {
+        close(sockfd);
+        return -1;
     }
+    int one = 1;  // Requests are single small frames; send them at once
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sockfd;
+}
 
-    // Send upload command to S2/S3/S4
-    snprintf(buffer, sizeof(buffer), "uploadf %s %s", filename, dest);
-    send(sockfd, buffer, strlen(buffer), 0);
-    recv(sockfd, buffer, sizeof(buffer), 0);  // Wait for "OK"
+// Take a connection to `server`, reusing an idle one when possible.
+// *reused tells the caller whether it may have gone stale while idle.
+int pool_get(int server, int* reused) {
+    struct conn_pool* p = &conn_pools[server];
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        int fd = p->nidle > 0 ? p->idle[--p->nidle] : -1;
+        pthread_mutex_unlock(&p->lock);
+        if (fd < 0) break;
+
+        // An idle connection has nothing to read; if it does, the secondary
+        // closed it (e.g. it restarted)
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) == 0) {
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+    }
+    *reused = 0;
+    return pool_connect(server);
+}
 
-    // Send file contents in chunks
-    int bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0)
-        send(sockfd, buffer, bytes, 0);
+// Whether connection `fd`, on which a request was just sent, still looks
+// usable: nothing to read yet and no error pending. A node that closed or
+// reset it shows up here as EOF or an error, which the send did not report.
+int pool_alive(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
 
-    // Signal end of file
-    send(sockfd, "EOF", 3, 0);
-    fclose(fp);
-    close(sockfd);
+// Give a connection back. Only connections whose last exchange completed
+// cleanly are kept; anything else may have unread bytes in flight.
+void pool_put(int server, int fd, int reusable) {
+    struct conn_pool* p = &conn_pools[server];
+    if (reusable) {
+        pthread_mutex_lock(&p->lock);
+        if (p->nidle < POOL_IDLE_MAX) {
+            p->idle[p->nidle++] = fd;
+            fd = -1;
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (fd >= 0) close(fd);
+}
 
-    // Remove local file after forwarding
-    remove(filepath);
+// Take a connection and send `opcode arg` on it (with frame flags `flags`)
+// under a new request id (stored in *rid). Returns the connection, or -1
+// if the server is down.
+int pool_send(int server, int opcode, int flags, const char* arg, uint32_t* rid, int* reused) {
+    int sockfd = pool_get(server, reused);
+    if (sockfd < 0) return -1;
+
+    *rid = pool_next_id();
+    if (dfs_send_frame(sockfd, opcode, flags, *rid, arg, strlen(arg)) < 0) {
+        close(sockfd);
+        return *reused ? pool_send(server, opcode, flags, arg, rid, reused) : -1;
+    }
+    return sockfd;
+}
+
+// Send `opcode arg` to a secondary and read the reply header. A reused
+// connection that turns out to be dead is replaced by a fresh one once.
+// Returns the connection with the reply payload still unread (the caller
+// gives it back with pool_put), or -1.
+int pool_request(int server, int opcode, int flags, const char* arg, struct dfs_hdr* reply) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused;
+        uint32_t rid;
+        int sockfd = pool_send(server, opcode, flags, arg, &rid, &reused);
+        if (sockfd < 0) return -1;
+
+        if (dfs_recv_hdr(sockfd, reply) == 0 && reply->request_id == rid)
+            return sockfd;
+        close(sockfd);
+        if (!reused) break;
+    }
+    return -1;
 }
 
 // ----------------------------
-// Requesting file back from S2/S3/S4 (.pdf/.txt/.zip)
-// Used in both downlf and downltar
+// Stream an upload straight from the client to its storage node
+// Used when user uploads anything but a .c file
+// The secondary is connected before any file data is read, and the bytes are
+// relayed as they arrive (cut-through), so nothing is stored on S1's disk.
+// A resumed upload (offset > 0) carries only the bytes from `offset` on; a
+// delta upload names the file's size (`total`, 0 otherwise) and carries only
+// changed chunks, which the secondary completes from its stored copy. A
+// compressed upload (also sized by `total`) is relayed frame by frame as is.
+// Returns 0 on success (with the size of the data stored in *size), -1 if
+// the upload failed but the client stream is still usable, -2 if the client
+// connection is broken.
 // ----------------------------
-void request_file_from_secondary(const char* ip, int port, const char* rel_path, const char* save_as) {
-    int sockfd;
-    struct sockaddr_in addr;
+int send_to_secondary_server(int server, int client_sock, const char* filename,
+                             const char* dest, uint64_t offset, uint64_t total, uint64_t* size) {
     char buffer[BUFFER_SIZE];
+    struct dfs_hdr data, reply;
+
+    // Take a connection to the target server and announce the upload
+    int reused;
+    uint32_t rid = pool_next_id();
+    if (total)
+        snprintf(buffer, sizeof(buffer), "%s %s %llu %llu", filename, dest, (unsigned long long)offset,
+                 (unsigned long long)total);
+    else
+        snprintf(buffer, sizeof(buffer), "%s %s %llu", filename, dest, (unsigned long long)offset);
+    int sockfd = pool_get(server, &reused);
+    int connected = sockfd >= 0 && dfs_send_text(sockfd, DFS_OP_UPLOADF, rid, buffer) == 0;
+
+    // Now take the file's DATA frame off the client connection
+    if (dfs_recv_hdr(client_sock, &data) < 0 || data.opcode != DFS_OP_DATA) {
+        if (sockfd >= 0) close(sockfd);
+        return -2;
+    }
 
-    FILE* fp = fopen(save_as, "wb");
-    if (!fp) return;
+    // Once its body is read the upload cannot be sent again, so a reused
+    // connection the node dropped while it sat idle is swapped for a fresh
+    // one now, while nothing but the header has been taken from the client
+    if (reused && !(connected && pool_alive(sockfd))) {
+        close(sockfd);
+        sockfd = pool_connect(server);
+        connected = sockfd >= 0 && dfs_send_text(sockfd, DFS_OP_UPLOADF, rid, buffer) == 0;
+    }
+    if (!connected) {
+        if (sockfd >= 0) close(sockfd);
+        return dfs_drain_data(client_sock, &data) < 0 ? -2 : -1;
+    }
+    *size = data.flags & (DFS_FLAG_DELTA | DFS_FLAG_LZ4) ? total - offset : dfs_body_len(&data);
+
+    // Pipe the client's bytes through to the node, checksum trailer and all;
+    // the secondary verifies it
+    int rc = 0, in_sync = 0;
+    for (;;) {
+        uint8_t flags = data.flags & (DFS_FLAG_MORE | DFS_FLAG_CSUM | DFS_FLAG_DELTA | DFS_FLAG_LZ4);
+        if (rc == 0 && dfs_send_hdr(sockfd, DFS_OP_DATA, flags, rid, data.length) == 0)
+            rc = dfs_relay(client_sock, sockfd, data.length, 1);
+        else
+            rc = dfs_drain(client_sock, data.length) < 0 ? -2 : -1;
+        if (rc == -2 || !(data.flags & DFS_FLAG_MORE)) break;
+        if (dfs_recv_hdr(client_sock, &data) < 0 || data.opcode != DFS_OP_DATA) rc = -2;
+        if (rc == -2) break;
+    }
+    if (rc == 0) {
+        in_sync = dfs_recv_hdr(sockfd, &reply) == 0 && reply.request_id == rid &&
+                  dfs_recv_text(sockfd, &reply, buffer, sizeof(buffer)) == 0;
+        if (!(in_sync && reply.opcode == DFS_OP_OK))
+            rc = -1;  // Secondary could not store it
+    }
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    inet_pton(AF_INET, ip, &addr.sin_addr);
+    pool_put(server, sockfd, in_sync);
+    return rc;
+}
 
-    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        fclose(fp);
-        return;
+// ----------------------------
+// Pass a secondary's reply, whose header `*reply` is already read from
+// pooled connection `sockfd`, through to the client under id `id`, then
+// give the connection back
+// Returns -1 if the client connection is out of sync and must be closed
+// ----------------------------
+int relay_reply(int server, int sockfd, struct dfs_hdr* reply, int client_sock, uint32_t id) {
+    // If the client drops, the rest is drained so the connection stays usable
+    int rc = 0;
+    reply_begin(client_sock);
+    for (;;) {
+        if (rc == 0 && dfs_send_hdr(client_sock, reply->opcode, reply->flags, id, reply->length) == 0)
+            rc = dfs_relay(sockfd, client_sock, reply->length, 1);
+        else
+            rc = dfs_drain(sockfd, reply->length) < 0 ? -2 : -1;
+        if (rc == -2 || !(reply->opcode == DFS_OP_DATA && (reply->flags & DFS_FLAG_MORE))) break;
+        if (dfs_recv_hdr(sockfd, reply) < 0 || reply->opcode != DFS_OP_DATA) rc = -2;
+        if (rc == -2) break;
+    }
+    reply_end(client_sock);
+    pool_put(server, sockfd, rc != -2);
+    return rc < 0 ? -1 : 0;
+}
+
+// ----------------------------
+// Requesting file back from a storage node (.pdf/.txt/.zip/...)
+// Sends `opcode arg` (with frame flags `flags`) and passes the reply frames
+// (DATA or an error) straight through to the client under the client's
+// request id; a compressed file is a run of frames and all of them go
+// Used in both downlf and downltar
+// Returns -1 if the client connection is out of sync and must be closed
+// ----------------------------
+int relay_from_secondary(int server, int opcode, int flags, const char* arg, int client_sock, uint32_t id) {
+    struct dfs_hdr reply;
+    int sockfd = pool_request(server, opcode, flags, arg, &reply);
+    if (sockfd < 0) {
+        reply_text(client_sock, DFS_OP_ERR, id, "NOTFOUND");
+        return 0;
+    }
+    return relay_reply(server, sockfd, &reply, client_sock, id);
+}
+
+// ----------------------------
+// Serve downlf of a file a storage node holds from the hot-file cache
+// On a miss the whole file is fetched from its server into a new cache
+// entry first (anything but a plain DATA reply is passed on as it is);
+// the requested range then goes out from the entry, compressed if `lz4`.
+// A miss while another download fetches the same file waits for it, and
+// is relayed uncached if that fetch left no copy behind
+// Returns -1 if the client connection is out of sync and must be closed
+// ----------------------------
+int send_cached(const char* key, const struct dfs_meta* meta, uint64_t offset, uint64_t length, int lz4,
+                int client_sock, uint32_t id) {
+    int fill;
+    struct dfs_cached* e = dfs_cache_claim(&file_cache, key, meta->gen, &fill);
+    if (!e && !fill) {
+        char request[600];
+        snprintf(request, sizeof(request), "%s %llu %llu", key, (unsigned long long)offset,
+                 (unsigned long long)length);
+        return relay_from_secondary(meta->server, DFS_OP_DOWNLF, lz4 ? DFS_FLAG_LZ4 : 0, request, client_sock, id);
     }
+    if (!e) {
+        char request[600];
+        struct dfs_hdr reply;
+        snprintf(request, sizeof(request), "%s 0 0", key);
+        int sockfd = pool_request(meta->server, DFS_OP_DOWNLF, 0, request, &reply);
+        if (sockfd < 0) {
+            dfs_cache_filled(&file_cache, key);
+            reply_text(client_sock, DFS_OP_ERR, id, "NOTFOUND");
+            return 0;
+        }
+        // A file grown past the size in the index is not ours to cache
+        if (reply.opcode != DFS_OP_DATA || (reply.flags & DFS_FLAG_LZ4) || dfs_body_len(&reply) > meta->size ||
+            (e = dfs_cache_new(key, meta->gen)) == NULL) {
+            dfs_cache_filled(&file_cache, key);
+            return relay_reply(meta->server, sockfd, &reply, client_sock, id);
+        }
 
-    // Request the file
-    snprintf(buffer, sizeof(buffer), "downlf %s", rel_path);
-    send(sockfd, buffer, strlen(buffer), 0);
+        // Fill the entry, checking the server's checksum on the way
+        uint32_t crc = 0;
+        e->size = dfs_body_len(&reply);
+        int rc = dfs_recv_to_fd_csum(sockfd, e->fd, e->size, &crc, NULL);
+        int have = rc == -2 ? -1 : dfs_recv_csum(sockfd, &reply, &e->crc);
+        pool_put(meta->server, sockfd, have >= 0);
+        if (rc < 0 || have < 0) {
+            dfs_cache_filled(&file_cache, key);
+            dfs_cache_release(&file_cache, e);
+            reply_text(client_sock, DFS_OP_ERR, id, "NOTFOUND");
+            return 0;
+        }
+        e->have_crc = have;
 
-    // Receive file contents and write to local
-    int bytes;
-    while ((bytes = recv(sockfd, buffer, sizeof(buffer), 0)) > 0) {
-        if (bytes == 3 && strncmp(buffer, "EOF", 3) == 0) break;
-        fwrite(buffer, 1, bytes, fp);
+        // A copy that does not match is still sent (the client will reject
+        // it, as it would have without the cache) but not kept
+        if (!have || e->crc == crc) dfs_cache_insert(&file_cache, e);
+        dfs_cache_filled(&file_cache, key);
     }
 
-    fclose(fp);
-    close(sockfd);
+    dfs_clip_range(e->size, &offset, &length);
+    uint32_t crc = e->crc;
+    reply_begin(client_sock);
+    int rc = lz4 ? dfs_send_lz4(client_sock, id, e->fd, offset, length, e->have_crc ? &crc : NULL, 0) :
+                   dfs_send_range(client_sock, id, e->fd, offset, length, e->have_crc ? &crc : NULL);
+    reply_end(client_sock);
+    dfs_cache_release(&file_cache, e);
+    return rc < 0 ? -1 : 0;
+}
+// ----------------------------
+// Send bytes [offset, offset + length) of a file on S1's disk to the client
+// as a DATA frame (length 0 = to the end of the file), or compressed
+// (`lz4`) as a run of them
+// Replies NOTFOUND if it cannot be opened
+// Returns -1 if the client connection broke mid-reply
+// ----------------------------
+int send_file_data(int client_sock, uint32_t id, const char* path, uint64_t offset, uint64_t length, int lz4) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return reply_text(client_sock, DFS_OP_ERR, id, "NOTFOUND");
+    }
+
+    dfs_clip_range(st.st_size, &offset, &length);
+    reply_begin(client_sock);
+    int rc = lz4 ? dfs_send_stored_lz4(client_sock, id, fd, offset, length) :
+                   dfs_send_stored(client_sock, id, fd, offset, length);
+    reply_end(client_sock);
+    close(fd);
+    return rc < 0 ? -1 : 0;
 }
 
 // ----------------------------
 // Send a local .c file directly from ~/S1 to client
 // ----------------------------
-void send_local_file(int client_sock, const char* filename) {
+int send_local_file(int client_sock, uint32_t id, const char* key, uint64_t offset, uint64_t length, int lz4) {
     char path[BUFFER_SIZE];
-    const char* rel_path = get_relative_path(filename);
-    if (!rel_path) {
-    send(client_sock, "NOTFOUND", 8, 0);
-    return;
-}
-snprintf(path, sizeof(path), "%s/S1/%s", getenv("HOME"), rel_path);
+    snprintf(path, sizeof(path), "%s/S1/%s", getenv("HOME"), key);
 
+    return send_file_data(client_sock, id, path, offset, length, lz4);
+}
 
-    FILE* fp = fopen(path, "rb");
-    if (!fp) {
-        send(client_sock, "NOTFOUND", 8, 0);
-        return;
-    }
+// ----------------------------
+// Is `server` (from the index) S1 or a node in the routing table?
+// ----------------------------
+int server_known(int server) {
+    return server == 1 || dfs_route_node(&routes, server) != NULL;
+}
 
-    char buffer[BUFFER_SIZE];
-    int bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0)
-        send(client_sock, buffer, bytes, 0);
+// ----------------------------
+// Which server stores the file with logical path `key` and extension
+// `ext` (e.g. ".pdf"). A file already stored stays on its node, so a
+// re-upload replaces it in place (and a delta finds its old copy); a new
+// one goes where the hash of its path says among the extension's nodes.
+// .c and anything no node takes stay on S1.
+// ----------------------------
+int server_for(const char* key, const char* ext) {
+    const struct dfs_route* r = dfs_route_find(&routes, ext);
+    if (!r) return 1;
+
+    struct dfs_meta meta;
+    if (dfs_index_get(&file_index, key, &meta) == 0 && dfs_route_has(r, meta.server))
+        return meta.server;
+    return dfs_route_pick(r, key);
+}
 
-    send(client_sock, "EOF", 3, 0);
-    fclose(fp);
+// ----------------------------
+// Split an upload's "<filename> <dest>" into the bare file name, the
+// destination directory's logical path and the file's logical path
+// (the client's local directories are dropped). Returns the server that
+// stores it, or -1 with a message for the client in *err.
+// ----------------------------
+int upload_target(const char* args, char* filename, char* dir, char* key, const char** err) {
+    char name[256], dest[512], logical[BUFFER_SIZE];
+    if (sscanf(args, "%255s %511s", name, dest) != 2) {
+        *err = "Usage: uploadf <filename> <destination>";
+        return -1;
+    }
+    const char* base = strrchr(name, '/');
+    strcpy(filename, base ? base + 1 : name);
+
+    char* ext = strrchr(filename, '.');
+    snprintf(logical, sizeof(logical), "%s/%s", dest, filename);
+    if (!ext || dfs_logical_path(dest, dir, 512) < 0 || dfs_logical_path(logical, key, 512) < 0) {
+        *err = ext ? "Invalid destination" : "Invalid extension";
+        return -1;
+    }
+    return server_for(key, ext);
 }
 
 // ----------------------------
-// Send list of all files from S1, S2, S3, S4
-// Sends back consolidated list to client
+// Send list of all files from S1 and the storage nodes
+// All nodes are asked at the same time and S1 lists its own files while
+// they work, so the listing takes as long as the slowest server. The .c
+// files come first, then one group per extension in routing-table order
+// (.pdf, .txt, .zip by default); the listings of several nodes holding one
+// extension are merged into one sorted group. Each group goes to the
+// client as soon as it and the groups before it are in, as OK frames
+// flagged DFS_FLAG_MORE; an empty OK frame ends the list.
+// A node that does not answer within DISPFNAMES_TIMEOUT_MS is left out.
+// Prefix filters go to every server; the page (-o/-n) is cut from the
+// combined listing here, so each server is asked for offset + limit names.
 // ----------------------------
-void handle_dispfnames(int client_sock, const char* pathname) {
-    char msg[BUFFER_SIZE * 8] = "";
-    char buffer[BUFFER_SIZE];
 
-    // Collect .c files from ~/S1/pathname
-    snprintf(buffer, sizeof(buffer), "find %s/S1/%s -type f -name \"*.c\" -printf \"%%f\\n\" | sort", getenv("HOME"), pathname);
-    FILE* fp = popen(buffer, "r");
-    if (fp) {
-        while (fgets(buffer, sizeof(buffer), fp)) {
-            strcat(msg, buffer);
-        }
-        pclose(fp);
+// Send the lines of `list` that fall inside the requested page
+int send_listing_page(int client_sock, uint32_t id, const char* list, uint64_t* skip, uint64_t* left) {
+    const char* start = list;
+    for (; *start && *skip > 0; (*skip)--) {
+        const char* nl = strchr(start, '\n');
+        start = nl ? nl + 1 : start + strlen(start);
     }
+    const char* end = start;
+    for (; *end && *left > 0; (*left)--) {
+        const char* nl = strchr(end, '\n');
+        end = nl ? nl + 1 : end + strlen(end);
+    }
+    if (end == start) return 0;
+    return reply_frame(client_sock, DFS_OP_OK, DFS_FLAG_MORE, id, start, end - start);
+}
 
-    // Define secondary servers and file extensions
+void handle_dispfnames(int client_sock, uint32_t id, const char* args) {
+    struct dfs_list_query q;
+    if (dfs_list_parse(args, &q) < 0) {
+        reply_text(client_sock, DFS_OP_ERR, id, "Usage: dispfnames <pathname> [-p prefix] [-o offset] [-n limit]");
+        return;
+    }
+
+    // Every server returns its first offset + limit matches; the page is cut below
+    char dir[BUFFER_SIZE];
+    struct dfs_list_query shard_q = q;
+    uint64_t skip = q.offset, left = q.limit ? q.limit : UINT64_MAX;
+    shard_q.offset = 0;
+    shard_q.limit = q.limit ? q.offset + q.limit : 0;
+    dfs_list_format(&shard_q, dir, sizeof(dir));
+
+    // One slot per node, indexed by its id
     struct {
-        char* ip;
-        int port;
-        char* ext;
-    } servers[] = {
-        {S2_IP, S2_PORT, ".pdf"},
-        {S3_IP, S3_PORT, ".txt"},
-        {S4_IP, S4_PORT, ".zip"}
-    };
-
-    // For each of S2/S3/S4, connect and request dispfnames <pathname>
-    for (int i = 0; i < 3; i++) {
-        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        struct sockaddr_in addr;
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(servers[i].port);
-        inet_pton(AF_INET, servers[i].ip, &addr.sin_addr);
-
-        if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
-            // Send the correct dispfnames request to secondary server
-            char cmd[BUFFER_SIZE];
-            snprintf(cmd, sizeof(cmd), "dispfnames %s", pathname);
-            send(sockfd, cmd, strlen(cmd), 0);
-
-            // Append each line received to final msg
-            while (1) {
-                int bytes = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-                if (bytes <= 0) break;
-                buffer[bytes] = '\0';
-                if (strncmp(buffer, "EOF", 3) == 0) break;
-                strcat(msg, buffer);
+        int fd;                     // Connection awaiting a reply, -1 once settled
+        uint32_t rid;
+        int reused;
+        int done;
+        char* list;
+    } shard[DFS_ROUTE_IDS] = {{0}};
+
+    // Send every node its request before doing anything else
+    for (int i = 0; i < routes.nnodes; i++) {
+        int node = routes.ids[i];
+        shard[node].fd = pool_send(node, DFS_OP_DISPFNAMES, 0, dir, &shard[node].rid, &shard[node].reused);
+        shard[node].done = shard[node].fd < 0;
+    }
+
+    // List the .c files under ~/S1/dir from memory; they come first
+    size_t local_len;
+    char* local = dfs_list_query(&c_files, &shard_q, &local_len);
+    int client_ok = !local || send_listing_page(client_sock, id, local, &skip, &left) == 0;
+    free(local);
+
+    // Gather replies in whatever order they come, flushing the finished prefix
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int next = 0;
+    while (1) {
+        // An extension's group is finished once all its nodes are; their
+        // listings are merged into one
+        for (; next < routes.nroutes; next++) {
+            const struct dfs_route* r = &routes.route[next];
+            char* lists[DFS_ROUTE_IDS];
+            int nlists = 0, finished = 1;
+            for (int i = 0; i < r->n; i++) {
+                finished &= shard[r->nodes[i]].done;
+                if (shard[r->nodes[i]].list) lists[nlists++] = shard[r->nodes[i]].list;
             }
+            if (!finished) break;
+
+            size_t len;
+            char* merged = nlists > 1 ? dfs_list_merge(lists, nlists, &len) : NULL;
+            char* list = nlists > 1 ? merged : nlists ? lists[0] : NULL;
+            if (client_ok && list && send_listing_page(client_sock, id, list, &skip, &left) < 0)
+                client_ok = 0;
+            free(merged);
+        }
+        if (next == routes.nroutes) break;
+
+        struct pollfd pfd[DFS_ROUTE_IDS];
+        int which[DFS_ROUTE_IDS], n = 0;
+        for (int i = 0; i < routes.nnodes; i++) {
+            int node = routes.ids[i];
+            if (shard[node].done) continue;
+            pfd[n].fd = shard[node].fd;
+            pfd[n].events = POLLIN;
+            which[n++] = node;
+        }
 
-            close(sockfd);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        int ready = waited < DISPFNAMES_TIMEOUT_MS ? poll(pfd, n, DISPFNAMES_TIMEOUT_MS - waited) : 0;
+        if (ready < 0 && errno == EINTR) continue;
+
+        for (int i = 0; i < n; i++) {
+            int node = which[i];
+            if (ready <= 0) {
+                // Out of time: give up on it; its late reply would desync the connection
+                printf("[S1] Node %d did not answer dispfnames in time\n", node);
+                close(shard[node].fd);
+                shard[node].done = 1;
+                continue;
+            }
+            if (!pfd[i].revents) continue;
+
+            // The reply has started to arrive; read it whole
+            struct dfs_hdr reply;
+            char* list = NULL;
+            int ok = dfs_recv_hdr(shard[node].fd, &reply) == 0 && reply.request_id == shard[node].rid &&
+                     (list = dfs_recv_text_alloc(shard[node].fd, &reply)) != NULL;
+            if (ok) {
+                pool_put(node, shard[node].fd, 1);
+                if (reply.opcode == DFS_OP_OK) shard[node].list = list;
+                else free(list);
+            } else {
+                // A reused connection may have died while idle; ask again on a fresh one
+                close(shard[node].fd);
+                int fd = -1;
+                if (shard[node].reused && (fd = pool_request(node, DFS_OP_DISPFNAMES, 0, dir, &reply)) >= 0) {
+                    list = dfs_recv_text_alloc(fd, &reply);
+                    pool_put(node, fd, list != NULL);
+                    if (list && reply.opcode == DFS_OP_OK) shard[node].list = list;
+                    else free(list);
+                }
+            }
+            shard[node].done = 1;
         }
     }
 
-    // Send combined list to the client
-    send(client_sock, msg, strlen(msg), 0);
+    // Empty final frame: the listing is complete
+    if (client_ok) reply_frame(client_sock, DFS_OP_OK, 0, id, NULL, 0);
+    for (int i = 0; i < routes.nnodes; i++) free(shard[routes.ids[i]].list);
 }
 
 
 // ----------------------------
 // Handle removef command from client
-// Deletes a file from the appropriate server based on file extension
+// Takes one or more paths. Each is looked up in the index and deleted from
+// the server holding it. All paths held by one secondary go to it as a
+// single request, the secondaries work at the same time as S1 deletes its
+// own files, and the index drops every removed entry in one durable write.
 // ----------------------------
-void forward_removef_to_secondary(const char* ip, int port, const char* filename, int client_sock) {
-    int sockfd;
-    struct sockaddr_in addr;
-    char buffer[BUFFER_SIZE];
-
-    // Create a socket and set up connection parameters
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    inet_pton(AF_INET, ip, &addr.sin_addr);
+struct remove_item {
+    const char* path;               // As the client typed it
+    char key[512];
+    int server;                     // Holder per the index, 0 if unknown
+    int answered;                   // The holder replied, so the file is gone either way
+    int removed;
+    const char* result;             // Message for the client
+};
 
-    // Try connecting to the appropriate secondary server
-    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        // If connection fails, tell the client the file was not found
-        send(client_sock, "NOTFOUND", 8, 0);
+void handle_removef(char* args, int client_sock, uint32_t id) {
+    struct remove_item* items = calloc(REMOVE_BATCH_MAX, sizeof(*items));
+    if (!items) {
+        reply_text(client_sock, DFS_OP_ERR, id, "Out of memory");
         return;
     }
 
-    // Send removef command to the server
-    snprintf(buffer, sizeof(buffer), "removef %s", filename);
-    send(sockfd, buffer, strlen(buffer), 0);
-
-    // Wait for confirmation message (success or error)
-    int bytes = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytes > 0) {
-        buffer[bytes] = '\0';
-        send(client_sock, buffer, bytes, 0);  // Forward message to client
-    } else {
-        send(client_sock, "NOTFOUND", 8, 0);  // File not found or error
+    int n = 0;
+    char* save = NULL;
+    for (char* p = strtok_r(args, " \n", &save); p; p = strtok_r(NULL, " \n", &save)) {
+        if (n == REMOVE_BATCH_MAX) {
+            reply_text(client_sock, DFS_OP_ERR, id, "Too many paths for one removef");
+            free(items);
+            return;
+        }
+        struct remove_item* it = &items[n++];
+        struct dfs_meta meta;
+        it->path = p;
+        it->result = "NOTFOUND";
+        if (dfs_logical_path(p, it->key, sizeof(it->key)) == 0 &&
+            dfs_index_get(&file_index, it->key, &meta) == 0 && server_known(meta.server))
+            it->server = meta.server;
+    }
+    if (n == 0) {
+        reply_text(client_sock, DFS_OP_ERR, id, "Usage: removef <pathname>...");
+        free(items);
+        return;
     }
 
-    close(sockfd);  // Close connection to secondary server
-}
-
-// Check file extension and decide which server handles the deletion
-void handle_removef(const char* filename, int client_sock) {
-    char* ext = strrchr(filename, '.');  // Extract file extension
-    if (!ext) {
-        send(client_sock, "NOTFOUND", 8, 0);
+    // Send each secondary its share before waiting on any of them
+    struct {
+        char keys[BUFFER_SIZE];
+        int fd, reused;
+        uint32_t rid;
+    }* share = calloc(routes.nnodes, sizeof(*share));
+    if (!share) {
+        reply_text(client_sock, DFS_OP_ERR, id, "Out of memory");
+        free(items);
         return;
     }
+    for (int s = 0; s < routes.nnodes; s++) {
+        int server = routes.ids[s];
+        size_t len = 0;
+        share[s].fd = -1;
+        for (int i = 0; i < n && len < sizeof(share[s].keys); i++) {
+            if (items[i].server == server)
+                len += snprintf(share[s].keys + len, sizeof(share[s].keys) - len, "%s%s", len ? " " : "",
+                                items[i].key);
+        }
+        if (len > 0 && len < sizeof(share[s].keys))
+            share[s].fd = pool_send(server, DFS_OP_REMOVEF, 0, share[s].keys, &share[s].rid, &share[s].reused);
+    }
 
-    // Handle .c file deletion locally (S1)
-    if (strcmp(ext, ".c") == 0) {
+    // Handle .c file deletion locally (S1) while they work
+    for (int i = 0; i < n; i++) {
+        if (items[i].server != 1) continue;
         char path[BUFFER_SIZE];
-        const char* rel_path = get_relative_path(filename);
-    if (!rel_path) {
-    send(client_sock, "File not found in S1.", 22, 0);
-    return;
+        snprintf(path, sizeof(path), "%s/S1/%s", getenv("HOME"), items[i].key);
+
+        int rc = remove(path);
+        if (rc == 0 || errno == ENOENT) {
+            items[i].answered = 1;
+            dfs_list_remove(&c_files, items[i].key);
+        }
+        items[i].removed = rc == 0;
+        items[i].result = rc == 0 ? "File removed from S1." : "File not found in S1.";
     }
-snprintf(path, sizeof(path), "%s/S1/%s", getenv("HOME"), rel_path);
 
-        if (remove(path) == 0)
-            send(client_sock, "File removed from S1.", 22, 0);
-        else
-            send(client_sock, "File not found in S1.", 22, 0);
-    }
-    // Forward .pdf deletion to S2
-    else if (strcmp(ext, ".pdf") == 0)
-        forward_removef_to_secondary(S2_IP, S2_PORT, filename, client_sock);
-    // Forward .txt deletion to S3
-    else if (strcmp(ext, ".txt") == 0)
-        forward_removef_to_secondary(S3_IP, S3_PORT, filename, client_sock);
-    // Forward .zip deletion to S4
-    else if (strcmp(ext, ".zip") == 0)
-        forward_removef_to_secondary(S4_IP, S4_PORT, filename, client_sock);
-    else
-        send(client_sock, "Unsupported file type.", 23, 0);
+    // Collect the verdicts: one line per path, in the order they were sent
+    for (int s = 0; s < routes.nnodes; s++) {
+        if (share[s].fd < 0) continue;
+        int server = routes.ids[s];
+        struct dfs_hdr reply;
+        char* text = NULL;
+        int fd = share[s].fd;
+        int ok = dfs_recv_hdr(fd, &reply) == 0 && reply.request_id == share[s].rid &&
+                 (text = dfs_recv_text_alloc(fd, &reply)) != NULL;
+        if (!ok && share[s].reused) {
+            // The pooled connection died while idle; ask again on a fresh one
+            close(fd);
+            fd = pool_request(server, DFS_OP_REMOVEF, 0, share[s].keys, &reply);
+            ok = fd >= 0 && (text = dfs_recv_text_alloc(fd, &reply)) != NULL;
+        }
+        if (fd >= 0) pool_put(server, fd, ok);
+        if (!ok) continue;  // Unreachable: its entries stay in the index
+
+        char* line_save = NULL;
+        char* line = strtok_r(text, "\n", &line_save);
+        for (int i = 0; i < n && line; i++) {
+            if (items[i].server != server) continue;
+            items[i].answered = 1;
+            items[i].removed = strcmp(line, "REMOVED") == 0;
+            items[i].result = items[i].removed ? "REMOVED" : "NOTFOUND";
+            line = strtok_r(NULL, "\n", &line_save);
+        }
+        free(text);
+    }
+    free(share);
+
+    // Drop every entry whose file is gone with a single index write
+    const char* gone[REMOVE_BATCH_MAX];
+    int ngone = 0, nremoved = 0;
+    for (int i = 0; i < n; i++) {
+        if (items[i].answered) gone[ngone++] = items[i].key;
+        nremoved += items[i].removed;
+    }
+    dfs_index_del_many(&file_index, gone, ngone);
+    for (int i = 0; i < ngone; i++)
+        dfs_cache_drop(&file_cache, gone[i]);
+
+    // One path gets the usual one-line answer; a batch gets a line per path
+    if (n == 1) {
+        reply_text(client_sock, items[0].removed ? DFS_OP_OK : DFS_OP_ERR, id, items[0].result);
+    } else {
+        char* msg = NULL;
+        size_t msg_len = 0;
+        FILE* out = open_memstream(&msg, &msg_len);
+        if (out) {
+            for (int i = 0; i < n; i++)
+                fprintf(out, "%s%s: %s", i ? "\n" : "", items[i].path, items[i].removed ? "removed" : "not found");
+            fclose(out);
+        }
+        reply_frame(client_sock, nremoved == n ? DFS_OP_OK : DFS_OP_ERR, 0, id, msg, msg ? msg_len : 0);
+        free(msg);
+    }
+    free(items);
 }
 
 // Helper function to create intermediate directories like mkdir -p
@@ -321,260 +838,426 @@ void create_directories(const char* path) {
 
 
 // ----------------------------
-// Handling downltar: Create or request tarball based on file type
+// downltar of an extension held by several nodes: each is asked for its
+// members only ("<ext> members") and all of them scan at once. Once every
+// part's size is known, S1 sends one DATA frame holding the parts back to
+// back and ends the archive itself (see dfs_tar.h). If any node is down
+// or refuses, nothing is sent but the error: a tarball silently missing
+// one node's files would look complete.
+// Returns -1 if the client connection must be closed
 // ----------------------------
-void handle_downltar(const char* cmdline, int client_sock) {
-    printf(" handle_downltar called: %s\n", cmdline);
-
-    char ext[16];
-    if (sscanf(cmdline, "downltar %s", ext) != 1) {
-        send(client_sock, "Invalid command format", 23, 0);
-        return;
+int relay_joined_tar(const struct dfs_route* r, const char* ext, int client_sock, uint32_t id) {
+    struct {
+        int fd, reused;
+        uint32_t rid;
+        struct dfs_hdr reply;
+    } part[DFS_ROUTE_IDS];
+    char arg[64];
+    snprintf(arg, sizeof(arg), "%s members", ext);
+
+    for (int i = 0; i < r->n; i++)
+        part[i].fd = pool_send(r->nodes[i], DFS_OP_DOWNLTAR, 0, arg, &part[i].rid, &part[i].reused);
+
+    // Wait for every part's header; the first refusal is passed on as is
+    uint64_t members = 0;
+    int failed = -1, refused = -1;
+    for (int i = 0; i < r->n; i++) {
+        if (part[i].fd >= 0 &&
+            !(dfs_recv_hdr(part[i].fd, &part[i].reply) == 0 && part[i].reply.request_id == part[i].rid)) {
+            // A reused connection may have died while idle; ask again on a fresh one
+            close(part[i].fd);
+            part[i].fd = part[i].reused ? pool_request(r->nodes[i], DFS_OP_DOWNLTAR, 0, arg, &part[i].reply) : -1;
+        }
+        if (part[i].fd < 0 && failed < 0) failed = i;
+        else if (part[i].fd >= 0 && part[i].reply.opcode != DFS_OP_DATA && refused < 0) refused = i;
+        else if (part[i].fd >= 0) members += part[i].reply.length;
     }
-
-    // Handling .c tarball locally
-    if (strcmp(ext, ".c") == 0) {
-        // To Generate list of .c files in ~/S1
-        char find_cmd[BUFFER_SIZE], tar_cmd[BUFFER_SIZE];
-        snprintf(find_cmd, sizeof(find_cmd), "find %s/S1 -type f -name \"*.c\" > files_to_tar.txt", getenv("HOME"));
-        system(find_cmd);  // Save list of .c files to a text file
-
-        printf(" Creating cfiles.tar using list from files_to_tar.txt\n");
-
-        // Using fork-exec to create tar file from file list
-        pid_t pid = fork();
-        if (pid == 0) {
-            execlp("tar", "tar", "-cf", "cfiles.tar", "-T", "files_to_tar.txt", NULL);
-            perror("execlp failed");
-            exit(1);
-        } else if (pid > 0) {
-            int status;
-            waitpid(pid, &status, 0);  // Waiting for tar process
-            if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
-                send(client_sock, "Error creating tarball", 23, 0);
-                return;
-            }
+    if (failed >= 0 || refused >= 0) {
+        int rc = 0;
+        if (failed >= 0) {
+            printf(" Node %d is unreachable; no %s tarball\n", r->nodes[failed], ext);
+            reply_text(client_sock, DFS_OP_ERR, id, "NOTFOUND");
         } else {
-            perror("fork failed");
-            send(client_sock, "Tar process failed", 18, 0);
-            return;
+            rc = relay_reply(r->nodes[refused], part[refused].fd, &part[refused].reply, client_sock, id);
+            part[refused].fd = -1;
         }
+        for (int i = 0; i < r->n; i++)
+            if (part[i].fd >= 0) close(part[i].fd);  // Its reply is unread
+        return rc;
+    }
 
-        // Open and send cfiles.tar to client
-        FILE* fp = fopen("cfiles.tar", "rb");
-        if (!fp) {
-            send(client_sock, "NOTFOUND", 8, 0);
-            return;
-        }
+    // One archive: the parts in table order, then the end-of-archive blocks
+    uint64_t total = dfs_tar_total(members);
+    reply_begin(client_sock);
+    int rc = dfs_send_hdr(client_sock, DFS_OP_DATA, 0, id, total) == 0 ? 0 : -1;
+    for (int i = 0; i < r->n; i++) {
+        // After a client failure the rest is drained so the connections stay usable
+        int prc = rc == 0 ? dfs_relay(part[i].fd, client_sock, part[i].reply.length, 1) :
+                  dfs_drain(part[i].fd, part[i].reply.length) < 0 ? -2 : 0;
+        pool_put(r->nodes[i], part[i].fd, prc != -2);
+        if (prc < 0) rc = -1;
+    }
+    if (rc == 0) rc = dfs_tar_zeros(client_sock, total - members);
+    reply_end(client_sock);
+    return rc;
+}
 
-        char buffer[BUFFER_SIZE];
-        int bytes;
-        while ((bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0)
-            send(client_sock, buffer, bytes, 0);
-        send(client_sock, "EOF", 3, 0);
-        fclose(fp);
+// ----------------------------
+// Handling downltar: Stream or relay a tarball based on file type
+// Returns -1 if the client connection must be closed
+// ----------------------------
+int handle_downltar(const char* args, int client_sock, uint32_t id) {
+    printf(" handle_downltar called: %s\n", args);
 
-        // Clean up temporary files
-        system("rm files_to_tar.txt cfiles.tar");
+    char ext[16];
+    const struct dfs_route* r;
+    if (sscanf(args, "%15s", ext) != 1) {
+        reply_text(client_sock, DFS_OP_ERR, id, "Invalid command format");
+        return 0;
+    }
+
+    // Handling .c tarball locally: cfiles.tar is built while it is sent
+    if (strcmp(ext, ".c") == 0) {
+        char root[BUFFER_SIZE];
+        snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+
+        printf(" Streaming cfiles.tar from %s\n", root);
+        reply_begin(client_sock);
+        int rc = dfs_tar_reply(client_sock, id, root, ".c");
+        reply_end(client_sock);
+        if (rc < 0) return -1;
         printf(" Sent cfiles.tar to client\n");
     }
-    // Handle .pdf tarball: request from S2
-    else if (strcmp(ext, ".pdf") == 0) {
-        printf(" Requesting pdf.tar from S2\n");
-        request_file_from_secondary(S2_IP, S2_PORT, "pdf.tar", "pdf.tar");
+    // Any other extension no node takes is invalid
+    else if (!(r = dfs_route_find(&routes, ext))) {
+        reply_text(client_sock, DFS_OP_ERR, id, "Unsupported extension");
+        printf(" Invalid extension received: %s\n", ext);
+    }
+    // One node holds them all: it streams the tarball and S1 relays the
+    // bytes (or its refusal, e.g. for .zip)
+    else if (r->n == 1) {
+        printf(" Requesting %s tarball from node %d\n", ext, r->nodes[0]);
+        if (relay_from_secondary(r->nodes[0], DFS_OP_DOWNLTAR, 0, ext, client_sock, id) < 0) return -1;
+        printf(" Forwarded %s tarball to client\n", ext);
+    }
+    // Several nodes: their parts are joined into one tarball
+    else {
+        printf(" Joining %s tarball from %d nodes\n", ext, r->n);
+        if (relay_joined_tar(r, ext, client_sock, id) < 0) return -1;
+        printf(" Forwarded %s tarball to client\n", ext);
+    }
+    return 0;
+}
 
-        FILE* fp = fopen("pdf.tar", "rb");
-        if (!fp) {
-            send(client_sock, "NOTFOUND", 8, 0);
-            return;
+// ----------------------------
+// Function: run_command
+// Runs any command other than uploadf and sends its reply
+// Returns -1 if the client connection is out of sync and must be closed
+// ----------------------------
+int run_command(int client_sock, const struct dfs_hdr* hdr, const char* args) {
+    char buffer[BUFFER_SIZE];
+    uint32_t id = hdr->request_id;
+    snprintf(buffer, sizeof(buffer), "%s", args);  // Handlers may split it in place
+
+    // Handle downlf command (download individual file, or a byte range of it)
+    if (hdr->opcode == DFS_OP_DOWNLF) {
+        char pathname[512], key[512];
+        unsigned long long offset = 0, length = 0;
+        struct dfs_meta meta;
+        if (sscanf(buffer, "%511s %llu %llu", pathname, &offset, &length) < 1) {
+            reply_text(client_sock, DFS_OP_ERR, id, "Usage: downlf <pathname> [offset [length]]");
+            return 0;
+        }
+        if (dfs_logical_path(pathname, key, sizeof(key)) < 0 ||
+            dfs_index_get(&file_index, key, &meta) < 0 || !server_known(meta.server)) {
+            reply_text(client_sock, DFS_OP_ERR, id, "NOTFOUND");
+            return 0;
         }
 
-        char buffer[BUFFER_SIZE];
-        int bytes;
-        while ((bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0)
-            send(client_sock, buffer, bytes, 0);
-        send(client_sock, "EOF", 3, 0);
-        fclose(fp);
-        remove("pdf.tar");  // Delete after sending
+        // The client may take it compressed; only worthwhile types are
+        int lz4 = (hdr->flags & DFS_FLAG_LZ4) && dfs_lz4_wanted(key);
+        if (meta.server == 1) {
+            if (send_local_file(client_sock, id, key, offset, length, lz4) < 0) return -1;
+        } else if (dfs_cache_wants(&file_cache, meta.size)) {
+            if (send_cached(key, &meta, offset, length, lz4, client_sock, id) < 0) return -1;
+        } else {
+            // Forward request to the server holding it and stream back result
+            char request[600];
+            snprintf(request, sizeof(request), "%s %llu %llu", key, offset, length);
+            if (relay_from_secondary(meta.server, DFS_OP_DOWNLF, lz4 ? DFS_FLAG_LZ4 : 0, request, client_sock, id) < 0)
+                return -1;  // Client stream is out of sync; drop the session
+        }
+    }
 
-        printf(" Forwarded pdf.tar to client\n");
+    // Handle stat: a file's size, straight from the index (no secondary is asked)
+    else if (hdr->opcode == DFS_OP_STAT) {
+        char pathname[512], key[512], msg[32];
+        struct dfs_meta meta;
+        if (sscanf(buffer, "%511s", pathname) != 1 || dfs_logical_path(pathname, key, sizeof(key)) < 0 ||
+            dfs_index_get(&file_index, key, &meta) < 0 || !server_known(meta.server)) {
+            reply_text(client_sock, DFS_OP_ERR, id, "NOTFOUND");
+            return 0;
+        }
+        snprintf(msg, sizeof(msg), "%llu", (unsigned long long)meta.size);
+        reply_text(client_sock, DFS_OP_OK, id, msg);
     }
-    // Handle .txt tarball: request from S3
-    else if (strcmp(ext, ".txt") == 0) {
-        printf(" Requesting text.tar from S3\n");
-        request_file_from_secondary(S3_IP, S3_PORT, "text.tar", "text.tar");
 
-        FILE* fp = fopen("text.tar", "rb");
-        if (!fp) {
-            send(client_sock, "NOTFOUND", 8, 0);
-            return;
+    // Chunk digests of the stored copy, for a delta upload
+    else if (hdr->opcode == DFS_OP_CHUNKS) {
+        char filename[256], dir[512], key[512], msg[BUFFER_SIZE];
+        const char* err = NULL;
+        int server = upload_target(buffer, filename, dir, key, &err);
+        if (server < 0) {
+            reply_text(client_sock, DFS_OP_ERR, id, err);
+        } else if (server == 1) {
+            char path[BUFFER_SIZE];
+            snprintf(path, sizeof(path), "%s/S1/%s", getenv("HOME"), key);
+            reply_begin(client_sock);
+            int rc = dfs_delta_reply(client_sock, id, path, NULL);
+            reply_end(client_sock);
+            if (rc < 0) return -1;
+        } else {
+            snprintf(msg, sizeof(msg), "%s ~S1/%s", filename, dir);
+            if (relay_from_secondary(server, DFS_OP_CHUNKS, 0, msg, client_sock, id) < 0) return -1;
         }
+    }
 
-        char buffer[BUFFER_SIZE];
-        int bytes;
-        while ((bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0)
-            send(client_sock, buffer, bytes, 0);
-        send(client_sock, "EOF", 3, 0);
-        fclose(fp);
-        remove("text.tar");
+    // Handle resume: how much of an interrupted upload is already stored
+    else if (hdr->opcode == DFS_OP_RESUME) {
+        char filename[256], dir[512], key[512], msg[BUFFER_SIZE];
+        const char* err = NULL;
+        int server = upload_target(buffer, filename, dir, key, &err);
+        if (server < 0) {
+            reply_text(client_sock, DFS_OP_ERR, id, err);
+        } else if (server == 1) {
+            char path[BUFFER_SIZE], part[BUFFER_SIZE];
+            snprintf(path, sizeof(path), "%s/S1/%s", getenv("HOME"), dir);
+            uint64_t offset = dfs_part_path(part, sizeof(part), path, filename) == 0 ? dfs_part_resume(part) : 0;
+            snprintf(msg, sizeof(msg), "%llu", (unsigned long long)offset);
+            reply_text(client_sock, DFS_OP_OK, id, msg);
+        } else {
+            snprintf(msg, sizeof(msg), "%s ~S1/%s", filename, dir);
+            if (relay_from_secondary(server, DFS_OP_RESUME, 0, msg, client_sock, id) < 0) return -1;
+        }
+    }
 
-        printf(" Forwarded text.tar to client\n");
+    // Handle removef
+    else if (hdr->opcode == DFS_OP_REMOVEF) {
+        handle_removef(buffer, client_sock, id);
+    }
+    // Handle dispfnames
+    else if (hdr->opcode == DFS_OP_DISPFNAMES) {
+        handle_dispfnames(client_sock, id, buffer);
     }
-    // Reject .zip filetype for downltar
-    else if (strcmp(ext, ".zip") == 0) {
-        send(client_sock, "Zip files not supported", 24, 0);
-        printf(" Unsupported extension: .zip\n");
+
+    // Handle downltar
+    else if (hdr->opcode == DFS_OP_DOWNLTAR) {
+        if (handle_downltar(buffer, client_sock, id) < 0) return -1;
     }
-    // Any other extension is invalid
     else {
-        send(client_sock, "Unsupported extension", 22, 0);
-        printf(" Invalid extension received: %s\n", ext);
+        reply_text(client_sock, DFS_OP_ERR, id, "Unknown command");
     }
+    return 0;
 }
 
 // ----------------------------
-// Function: prcclient
-// Main handler for individual client (runs in child process)
+// Function: serve_command
+// Reads and executes one command from a client
+// Each command arrives as one frame; its payload holds the arguments
+// Uploads run here, since their file body follows on the same stream;
+// other commands go to the command pool in a pipelined session and are
+// run in place otherwise (fork mode)
+// Returns 0 to keep the session open, -1 once it should be closed
 // ----------------------------
-void prcclient(int client_sock) {
+int serve_command(int client_sock) {
     char buffer[BUFFER_SIZE];
+    struct dfs_hdr hdr;
 
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes = recv(client_sock, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes <= 0) break;
-
-        buffer[bytes] = '\0';
-        printf("[S1] Command received: %s\n", buffer);
-
-        // Handle uploadf command
-        if (strncmp(buffer, "uploadf", 7) == 0) {
-            char filename[256], dest[512];
-            if (sscanf(buffer, "uploadf %s %s", filename, dest) == 2) {
-                char* ext = strrchr(filename, '.');
-                if (!ext) {
-                    send(client_sock, "Invalid extension", 17, 0);
-                    continue;
-                }
-
-                // Save uploaded file temporarily to S1 folder
-                char path[BUFFER_SIZE];
-                snprintf(path, sizeof(path), "%s/S1/%s", getenv("HOME"), dest + 4);  // Skip ~S1
-                create_directories(path);  // Ensure directory structure is made
-
-                char fullpath[BUFFER_SIZE];
-                snprintf(fullpath, sizeof(fullpath), "%s/%s", path, filename);
-
-                FILE* fp = fopen(fullpath, "wb");
-                if (!fp) continue;
-
-
-                send(client_sock, "OK", 2, 0);
+    if (dfs_recv_hdr(client_sock, &hdr) < 0) return -1;
+    uint32_t id = hdr.request_id;
+    if (dfs_recv_text(client_sock, &hdr, buffer, sizeof(buffer)) < 0) {
+        reply_text(client_sock, DFS_OP_ERR, id, "Command too long");
+        return 0;
+    }
+    printf("[S1] Command received: op=%d %s\n", hdr.opcode, buffer);
+
+    // Handle uploadf command
+    if (hdr.opcode == DFS_OP_UPLOADF) {
+        char filename[256], dest[512], dir[512], key[512];
+        unsigned long long offset = 0, total = 0;
+        const char* err = NULL;
+        struct dfs_hdr data;
+
+        // Only the file's name travels; the client's local directories do not
+        int server = upload_target(buffer, filename, dir, key, &err);
+        if (server < 0) {
+            if (dfs_recv_hdr(client_sock, &data) < 0 || dfs_drain_data(client_sock, &data) < 0) return -1;
+            reply_text(client_sock, DFS_OP_ERR, id, err);
+            return 0;
+        }
+        // A resumed upload names its offset, a delta or compressed upload the file's size
+        sscanf(buffer, "%*s %511s %llu %llu", dest, &offset, &total);
+
+        // .pdf/.txt/.zip are piped straight through to their server
+        char msg[BUFFER_SIZE];
+        if (server != 1) {
+            // Secondaries get the normalised destination, e.g. "~S1/reports"
+            uint64_t size = 0;
+            char remote_dest[600];
+            snprintf(remote_dest, sizeof(remote_dest), "~S1/%s", dir);
+            int rc = send_to_secondary_server(server, client_sock, filename, remote_dest, offset, total, &size);
+            if (rc == -2) return -1;  // Client vanished mid-transfer
+            if (rc < 0) {
+                snprintf(msg, sizeof(msg), "File '%s' could not be stored on its server", filename);
+                reply_text(client_sock, DFS_OP_ERR, id, msg);
+                return 0;
+            }
 
-                // Receive file data from client and write to disk
-                while ((bytes = recv(client_sock, buffer, sizeof(buffer), 0)) > 0) {
-                    if (bytes == 3 && strncmp(buffer, "EOF", 3) == 0) break;
-                    fwrite(buffer, 1, bytes, fp);
-                }
-                fclose(fp);
-
-                // Store path mapping for retrieval later
-                save_file_path(filename, dest);
-
-                // Forward to secondary server if it's not a .c file
-                if (strcmp(ext, ".pdf") == 0)
-                    send_to_secondary_server(S2_IP, S2_PORT, fullpath, filename, dest);
-                else if (strcmp(ext, ".txt") == 0)
-                    send_to_secondary_server(S3_IP, S3_PORT, fullpath, filename, dest);
-                else if (strcmp(ext, ".zip") == 0)
-                    send_to_secondary_server(S4_IP, S4_PORT, fullpath, filename, dest);
-
-                char msg[256];
-                snprintf(msg, sizeof(msg), "File '%s' saved at %s", filename, fullpath);
-                send(client_sock, msg, strlen(msg), 0);
+            // Record where it went so any session can find it later
+            dfs_cache_drop(&file_cache, key);
+            if (dfs_index_put(&file_index, key, server, offset + size) < 0) {
+                reply_text(client_sock, DFS_OP_ERR, id, "File stored but the index update failed");
+                return 0;
             }
+            snprintf(msg, sizeof(msg), "File '%s' saved at %s/%s", filename, dest, filename);
+            reply_text(client_sock, DFS_OP_OK, id, msg);
+            return 0;
         }
-        // Handle downlf command (download individual file)
-        else if (strncmp(buffer, "downlf", 6) == 0) {
-            char filename[256];
-            if (sscanf(buffer, "downlf %s", filename) == 1) {
-                char* ext = strrchr(filename, '.');
-                const char* rel_path = get_relative_path(filename);
-                if (!ext || (!rel_path && strcmp(ext, ".c") != 0)) {
-                    send(client_sock, "NOTFOUND", 8, 0);
-                    return;
-                }
 
-                if (strcmp(ext, ".c") == 0) {
-                    send_local_file(client_sock, filename);
-                } else {
-                    // Determine which server to connect to for sending file
-                    const char* ip = NULL;
-                    int port = 0;
-
-                    if (strcmp(ext, ".pdf") == 0) {
-                        ip = S2_IP; port = S2_PORT;
-                    } else if (strcmp(ext, ".txt") == 0) {
-                        ip = S3_IP; port = S3_PORT;
-                    } else if (strcmp(ext, ".zip") == 0) {
-                        ip = S4_IP; port = S4_PORT;
-                    } else {
-                        send(client_sock, "Unsupported file type", 22, 0);
-                        return;
-                    }
-
-                    // Forward request and stream back result
-                    int sockfd;
-                    struct sockaddr_in addr;
-                    char buffer[BUFFER_SIZE];
-
-                    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-                    addr.sin_family = AF_INET;
-                    addr.sin_port = htons(port);
-                    inet_pton(AF_INET, ip, &addr.sin_addr);
-
-                    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-                        send(client_sock, "NOTFOUND", 8, 0);
-                        return;
-                    }
-
-                    snprintf(buffer, sizeof(buffer), "downlf %s", rel_path);
-                    send(sockfd, buffer, strlen(buffer), 0);
-
-                    int bytes;
-                    while ((bytes = recv(sockfd, buffer, sizeof(buffer), 0)) > 0) {
-                        if (bytes == 3 && strncmp(buffer, "EOF", 3) == 0)
-                            break;
-                        send(client_sock, buffer, bytes, 0);
-                    }
-
-                    send(client_sock, "EOF", 3, 0);
-                    close(sockfd);
-                }
-            }
+        // File contents follow the command as a DATA frame (a run of them if compressed)
+        if (dfs_recv_hdr(client_sock, &data) < 0 || data.opcode != DFS_OP_DATA) return -1;
+
+        // Everything else (.c) is stored in the S1 folder
+        char path[BUFFER_SIZE], fullpath[BUFFER_SIZE], partpath[BUFFER_SIZE];
+        if (snprintf(path, sizeof(path), "%s/S1/%s", getenv("HOME"), dir) >= (int)sizeof(path) ||
+            snprintf(fullpath, sizeof(fullpath), "%s/%s", path, filename) >= (int)sizeof(fullpath)) {
+            if (dfs_drain_data(client_sock, &data) < 0) return -1;
+            reply_text(client_sock, DFS_OP_ERR, id, "Path too long");
+            return 0;
+        }
+        create_directories(path);  // Ensure directory structure is made
+
+        // Written to a part file that is renamed into place once complete;
+        // room for the whole file is reserved up front
+        uint64_t stored = data.flags & (DFS_FLAG_DELTA | DFS_FLAG_LZ4) ? total : offset + dfs_body_len(&data);
+        int fd = dfs_part_path(partpath, sizeof(partpath), path, filename) == 0 ?
+                 dfs_part_open(partpath, offset, stored) : -1;
+        if (fd < 0) {
+            int resume_gap = errno == EINVAL, full = errno == ENOSPC;
+            if (dfs_drain_data(client_sock, &data) < 0) return -1;
+            reply_text(client_sock, DFS_OP_ERR, id, resume_gap ? "Nothing stored to resume from" :
+                                                full ? "Not enough space on S1" : "Could not create file on S1");
+            return 0;
         }
 
-        // Handle removef
-        else if (strncmp(buffer, "removef", 7) == 0) {
-            char filename[256];
-            if (sscanf(buffer, "removef %s", filename) == 1)
-                handle_removef(filename, client_sock);
+        // Receive exactly data.length bytes from client and write to disk,
+        // checking them against the client's checksum as they arrive. A
+        // delta upload takes its unchanged chunks from the stored copy; a
+        // compressed one is stored decompressed.
+        uint32_t crc;
+        int rc;
+        if (data.flags & DFS_FLAG_DELTA) {
+            int basis = open(fullpath, O_RDONLY);
+            rc = dfs_recv_delta(client_sock, &data, fd, basis, total, &crc, NULL);
+            if (basis >= 0) close(basis);
+        } else {
+            rc = dfs_recv_summed(client_sock, &data, fd, offset, &crc, NULL);
         }
-        // Handle dispfnames
-        else if (strncmp(buffer, "dispfnames", 10) == 0) {
-            char pathname[512];
-            if (sscanf(buffer, "dispfnames %s", pathname) == 1) {
-                handle_dispfnames(client_sock, pathname);
-            } else {
-                send(client_sock, "Usage: dispfnames <pathname>\n", 30, 0);
-            }
+        if (rc == 0) dfs_csum_store(fd, crc);  // Kept with the file for downloads
+        if (rc == 0 && dfs_sync_file(&syncer, fd) < 0) rc = -1;
+        close(fd);
+        if (rc == -2) return -1;  // Client vanished mid-transfer; the part file is kept for a resume
+        if (rc == -3) {
+            unlink(partpath);  // Corrupted on the way; resuming would keep the bad bytes
+            reply_text(client_sock, DFS_OP_ERR, id, "Checksum mismatch on S1");
+            return 0;
+        }
+        if (rc < 0 || rename(partpath, fullpath) < 0 || dfs_sync_dir(&syncer, path) < 0) {
+            reply_text(client_sock, DFS_OP_ERR, id, "Write failed on S1");
+            return 0;
         }
+        dfs_list_add(&c_files, key);
 
-        // Handle downltar
-        else if (strncmp(buffer, "downltar", 8) == 0) {
-            handle_downltar(buffer, client_sock);
+        // Record where it went so any session can find it later
+        if (dfs_index_put(&file_index, key, 1, stored) < 0) {
+            reply_text(client_sock, DFS_OP_ERR, id, "File stored but the index update failed");
+            return 0;
         }
+
+        if (snprintf(msg, sizeof(msg), "File '%s' saved at %s", filename, fullpath) >= (int)sizeof(msg))
+            snprintf(msg, sizeof(msg), "File '%s' saved", filename);
+        reply_text(client_sock, DFS_OP_OK, id, msg);
     }
+    // Everything else runs on the command pool when the session is pipelined
+    else {
+        struct session* s = session_of(client_sock);
+        if (!s) return run_command(client_sock, &hdr, buffer);
+
+        pthread_mutex_lock(&s->lock);
+        s->inflight++;
+        pthread_mutex_unlock(&s->lock);
+        if (dfs_pool_submit(&command_pool, client_sock, &hdr, buffer) < 0) {
+            pthread_mutex_lock(&s->lock);
+            s->inflight--;
+            pthread_mutex_unlock(&s->lock);
+            reply_text(client_sock, DFS_OP_ERR, id, "BUSY");
+        }
+    }
+    return 0;
+}
+
+// ----------------------------
+// Command pool entry: run one pipelined command, then release it from its
+// session (closing the connection if the client has already hung up, or
+// resuming reads if the session had hit SESSION_MAX_INFLIGHT)
+// ----------------------------
+int run_pipelined(int client_sock, const struct dfs_hdr* hdr, const char* args) {
+    if (run_command(client_sock, hdr, args) < 0)
+        shutdown(client_sock, SHUT_RDWR);  // The reader sees EOF and ends the session
+
+    struct session* s = sessions[client_sock];
+    pthread_mutex_lock(&s->lock);
+    s->inflight--;
+    int last = !s->reading && s->inflight == 0;
+    int resume = s->paused && s->inflight < SESSION_MAX_INFLIGHT;
+    if (resume) s->paused = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    if (last)
+        session_close(client_sock);
+    else if (resume)
+        dfs_reactor_arm(&reactor, client_sock, EPOLL_CTL_MOD);
+    return DFS_SERVE_DEFERRED;
+}
+
+// ----------------------------
+// Reactor entry point: read the connection's next command and start it
+// The connection is re-armed straight away unless the client hung up or
+// already has SESSION_MAX_INFLIGHT commands running
+// ----------------------------
+int serve_session(int client_sock) {
+    struct session* s = session_open(client_sock);
+    if (!s) return serve_command(client_sock);
+
+    int rc = serve_command(client_sock);
+    pthread_mutex_lock(&s->lock);
+    if (rc < 0) s->reading = 0;
+    int last = !s->reading && s->inflight == 0;
+    int pause = s->reading && s->inflight >= SESSION_MAX_INFLIGHT;
+    if (pause) s->paused = 1;
+    pthread_mutex_unlock(&s->lock);
+
+    if (last) session_close(client_sock);
+    return rc < 0 || pause ? DFS_SERVE_DEFERRED : 0;
+}
+
+// ----------------------------
+// Function: prcclient
+// Main handler for individual client (runs in child process in fork mode)
+// ----------------------------
+void prcclient(int client_sock) {
+    while (serve_command(client_sock) == 0)
+        ;
 
     close(client_sock);  // Close client connection
     exit(0);             // Exit child process
@@ -582,32 +1265,132 @@ void prcclient(int client_sock) {
 
 // ----------------------------
 // Main function of S1
+// Usage: S1 [-f] [-w workers] [-m cache-MiB] [-s sync-ms] [-c nodes-file]
+//   -f  fork one process per client (the original model)
+//   -w  number of reactor worker threads (default: one per core, at least 4)
+//   -m  size of the hot-file cache (0 = off)
+//   -s  let .c uploads wait this many ms to share a batch of fsyncs (-1 = no fsync)
+//   -c  routing table of the storage nodes (default ~/S1/.dfs_nodes if it
+//       exists, else S2/S3/S4 on this host; see dfs_route.h)
 // ----------------------------
-int main() {
+int main(int argc, char* argv[]) {
     int server_sock, client_sock;
     struct sockaddr_in addr, cli_addr;
     socklen_t addr_size;
+    int fork_mode = 0;
+    int workers = dfs_reactor_default_workers();
+    long cache_mb = CACHE_MB;
+    int sync_ms = DFS_SYNC_MS;
+    const char* nodes_file = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "fw:m:s:c:")) != -1) {
+        if (opt == 'f')
+            fork_mode = 1;
+        else if (opt == 'w' && atoi(optarg) > 0)
+            workers = atoi(optarg);
+        else if (opt == 'm' && atol(optarg) >= 0)
+            cache_mb = atol(optarg);
+        else if (opt == 's')
+            sync_ms = atoi(optarg);
+        else if (opt == 'c')
+            nodes_file = optarg;
+        else {
+            fprintf(stderr, "Usage: %s [-f] [-w workers] [-m cache-MiB] [-s sync-ms] [-c nodes-file]\n", argv[0]);
+            return 1;
+        }
+    }
 
-    signal(SIGCHLD, SIG_IGN);  // Prevent zombie child processes
+    if (fork_mode)
+        signal(SIGCHLD, SIG_IGN);  // Prevent zombie child processes
+    signal(SIGPIPE, SIG_IGN);  // A vanished peer should fail the send, not kill the server
 
     server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;  // Allow quick restarts while old connections sit in TIME_WAIT
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(PORT);
     addr.sin_addr.s_addr = INADDR_ANY;
 
     bind(server_sock, (struct sockaddr*)&addr, sizeof(addr));
-    listen(server_sock, 10);
+    listen(server_sock, SOMAXCONN);
+
+    // Load the file index (and squeeze out superseded records) before serving
+    char index_path[BUFFER_SIZE];
+    snprintf(index_path, sizeof(index_path), "%s/S1", getenv("HOME"));
+    create_directories(index_path);
+    snprintf(index_path, sizeof(index_path), "%s/S1/.dfs_index", getenv("HOME"));
+    if (dfs_index_open(&file_index, index_path) < 0 || dfs_index_compact(&file_index) < 0) {
+        perror("[S1] Cannot open file index");
+        return 1;
+    }
+    printf("[S1] File index loaded: %zu files\n", file_index.map.count);
+
+    // Find out which storage nodes take which extensions
+    char nodes_path[BUFFER_SIZE];
+    snprintf(nodes_path, sizeof(nodes_path), "%s/S1/%s", getenv("HOME"), NODES_FILE);
+    if (dfs_route_load(&routes, nodes_file ? nodes_file : nodes_path) < 0) {
+        if (nodes_file || errno != ENOENT) {
+            perror("[S1] Cannot load the routing table");
+            return 1;
+        }
+        dfs_route_default(&routes);
+    }
+    for (int i = 0; i < routes.nroutes; i++) {
+        printf("[S1] %s ->", routes.route[i].ext);
+        for (int j = 0; j < routes.route[i].n; j++) {
+            const struct dfs_node* node = &routes.node[routes.route[i].nodes[j]];
+            printf(" %d@%s:%d", node->id, inet_ntoa(node->addr.sin_addr), ntohs(node->addr.sin_port));
+        }
+        printf("\n");
+    }
+
+    // Listings are served from memory, except in fork mode where each
+    // process would only see its own uploads; there every listing walks the disk
+    snprintf(index_path, sizeof(index_path), "%s/S1", getenv("HOME"));
+    if (dfs_list_open(&c_files, index_path, ".c", !fork_mode) < 0) {
+        perror("[S1] Cannot scan ~/S1");
+        return 1;
+    }
+
+    if (dfs_cache_init(&file_cache, fork_mode ? 0 : (uint64_t)cache_mb << 20) < 0) {
+        perror("[S1] Cannot set up the file cache");
+        return 1;
+    }
+    dfs_sync_init(&syncer, sync_ms);
 
     printf("[S1] Server listening on port %d...\n", PORT);
 
+    // Reactor mode: one epoll set and a pool of pinned worker threads; the
+    // commands of pipelined sessions run on the command pool
+    if (!fork_mode) {
+        struct rlimit nofile;
+        max_sessions = 1 << 16;  // One slot per possible fd
+        if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < (rlim_t)max_sessions)
+            max_sessions = nofile.rlim_cur;
+        sessions = calloc(max_sessions, sizeof(*sessions));
+        reactor = (struct dfs_reactor){ "S1", server_sock, -1, serve_session, CLIENT_STALL_SECS };
+        if (!sessions || dfs_pool_start(&command_pool, &reactor, workers * COMMAND_THREADS_PER_WORKER,
+                                        COMMAND_QUEUE, run_pipelined) < 0) {
+            perror("[S1] Cannot start the command pool");
+            return 1;
+        }
+        dfs_reactor_run(&reactor, workers);
+    }
+
     while (1) {
         addr_size = sizeof(cli_addr);
         client_sock = accept(server_sock, (struct sockaddr*)&cli_addr, &addr_size);
         printf("[S1] Connected to client: %s\n", inet_ntoa(cli_addr.sin_addr));
+        int one = 1;  // Replies to pipelined commands must not wait on Nagle
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-        // Handle each client in a separate child process
+        // Handle each client in a separate child process; it starts from the
+        // parent's up-to-date copy of the index and catches up from the log
+        dfs_index_refresh(&file_index);
         if (fork() == 0) {
             close(server_sock);       // Child does not need the server socket
+            dfs_index_reopen(&file_index);
             prcclient(client_sock);   // Handle client request
         } else {
             close(client_sock);       // Parent does not need the client socket
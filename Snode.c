@@ -0,0 +1,514 @@
+// Snode.c
+// A storage node: holds the files of one extension forwarded by S1.
+// S2 (.pdf), S3 (.txt) and S4 (.zip) are the classic three, but any number
+// of nodes may run, several of them for one extension; S1's routing table
+// says which node holds what (see dfs_route.h).
+// It supports:
+// - Receiving and saving uploaded files (uploadf)
+// - Sending a requested file or a tarball (downlf, downltar)
+// - Listing all files stored here (dispfnames)
+// - Removing specific files (removef)
+
+#define _GNU_SOURCE  // splice(), pipe2()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "dfs_proto.h"
+#include "dfs_reactor.h"
+#include "dfs_list.h"
+#include "dfs_tar.h"
+#include "dfs_blob.h"
+#include "dfs_delta.h"
+#include "dfs_sync.h"
+#include "dfs_uring.h"
+
+#define BUFFER_SIZE 2048        // Size for data buffers
+
+#define TRANSFER_QUEUE 256      // Transfers that may wait for a pool thread before BUSY
+#define TAR_QUEUE 8             // Same for tarball builds
+
+// ----------------------------
+// Node configuration (command line)
+// A node started as S2, S3 or S4 (by -n or by the name of the binary)
+// gets that server's port, extension and tarball unless told otherwise.
+// ----------------------------
+struct preset {
+    const char* name;
+    int port;
+    const char* ext;
+    const char* tar;            // NULL: no downltar for this extension
+    long direct_mb;             // Default -d (0 = off)
+};
+
+const struct preset presets[] = {
+    { "S2", 6501, ".pdf", "pdf.tar", 0 },
+    { "S3", 6502, ".txt", "text.tar", 0 },
+    { "S4", 6503, ".zip", NULL, 256 },  // Archives tend to be large; keep them out of the page cache
+};
+
+const char* node_name;          // Log prefix; files live in ~/<name>
+int node_port;
+const char* node_ext;           // The one extension stored here
+const char* node_tar;           // Name of the tarball of all of them, or NULL
+char node_root[BUFFER_SIZE];    // ~/<name>
+
+// Bulk requests run on bounded pools (see dfs_reactor.h) so one large
+// transfer or tarball build cannot hold up listings and removals
+struct dfs_pool transfer_pool, tar_pool;
+
+// Every stored file, kept in memory for dispfnames (see dfs_list.h)
+struct dfs_list listing;
+
+// Group commit of finished uploads: fsyncs are batched across them (see dfs_sync.h)
+struct dfs_sync syncer;
+
+// perror() with this node's name in front
+void node_perror(const char* what) {
+    fprintf(stderr, "[%s] %s: %s\n", node_name, what, strerror(errno));
+}
+
+// --------------------------------------------------
+// Creates folder hierarchy under ~/<name> before saving file
+// e.g., ~/S3/folder1/folder2 will be created as needed
+
+void create_directories(const char* path) {
+    char temp[BUFFER_SIZE];
+    snprintf(temp, sizeof(temp), "%s", path);  // Copy original path to modify
+    char *p = temp + 1;
+
+    // Walk through slashes to create nested folders
+    while ((p = strchr(p, '/')) != NULL) {
+        *p = '\0';              // Temporarily terminate path here
+        mkdir(temp, 0755);      // Try to create this part
+        *p = '/';               // Restore slash
+        p++;                    // Move pointer forward
+    }
+
+    mkdir(temp, 0755);          // Final mkdir for the whole path
+}
+
+// --------------------------------------------------
+// Receives a file from S1 and saves it under ~/<name>/...
+// The dest_path includes folder hierarchy
+// Returns -1 if the connection to S1 is no longer usable
+
+int receive_file(int sockfd, uint32_t id, const char* filename, const char* dest_path, uint64_t offset,
+                 uint64_t total) {
+    char base_path[BUFFER_SIZE];
+
+    // The file contents follow the command as one DATA frame (a run of
+    // them when the client sent it compressed)
+    struct dfs_hdr data;
+    if (dfs_recv_hdr(sockfd, &data) < 0 || data.opcode != DFS_OP_DATA) return -1;
+    if (strlen(dest_path) < 4) {
+        if (dfs_drain_data(sockfd, &data) < 0) return -1;
+        dfs_send_text(sockfd, DFS_OP_ERR, id, "Usage: uploadf <filename> <dest>");
+        return 0;
+    }
+
+    // Skip "~S1/" and append path to the node's directory, then the file name
+    char full_path[BUFFER_SIZE];
+    if (snprintf(base_path, sizeof(base_path), "%s/%s", node_root, dest_path + 4) >= (int)sizeof(base_path) ||
+        snprintf(full_path, sizeof(full_path), "%s/%s", base_path, filename) >= (int)sizeof(full_path)) {
+        if (dfs_drain_data(sockfd, &data) < 0) return -1;
+        dfs_send_text(sockfd, DFS_OP_ERR, id, "Path too long");
+        return 0;
+    }
+    create_directories(base_path);  // Ensure directory exists
+
+    // Write into the part file; it is renamed into place once complete
+    // (the whole file's space is reserved before the first byte lands)
+    char part_path[BUFFER_SIZE];
+    uint64_t size = data.flags & (DFS_FLAG_DELTA | DFS_FLAG_LZ4) ? total : offset + dfs_body_len(&data);
+    int fd = dfs_part_path(part_path, sizeof(part_path), base_path, filename) == 0 ?
+             dfs_part_open(part_path, offset, size) : -1;
+    if (fd < 0) {
+        int resume_gap = errno == EINVAL, full = errno == ENOSPC;
+        node_perror("File open error");
+        if (dfs_drain_data(sockfd, &data) < 0) return -1;  // Keep the stream in sync before replying
+        dfs_send_text(sockfd, DFS_OP_ERR, id, resume_gap ? "Nothing stored to resume from" :
+                                              full ? "Not enough space" : "File open error");
+        return 0;
+    }
+
+    // Read exactly data.length bytes from socket and write to file
+    // while checking it against the checksum S1 relays from the client
+    // (hashing it as well, to find out whether its contents are stored
+    // already, and chunk by chunk for later delta uploads)
+    uint32_t crc;
+    struct dfs_sha256 sha;
+    struct dfs_sha256_pieces chunks;
+    char digest[DFS_SHA256_HEX];
+    dfs_sha256_init(&sha);
+    dfs_sha256_pieces_init(&chunks, &sha, DFS_CHUNK_SIZE, DFS_DELTA_MAX_CHUNKS);
+    int rc;
+    if (data.flags & DFS_FLAG_DELTA) {
+        int basis = open(full_path, O_RDONLY);  // Stored copy the unchanged chunks come from
+        rc = dfs_recv_delta(sockfd, &data, fd, basis, total, &crc, &sha);
+        if (basis >= 0) close(basis);
+    } else {
+        rc = dfs_uring_recv_summed(sockfd, &data, fd, offset, &crc, &sha);  // Blocking unless -u
+    }
+    if (rc == -2 || rc == -3) {
+        close(fd);
+        dfs_sha256_pieces_free(&chunks);
+    }
+    if (rc == -2) return -1;  // S1 went away mid-transfer; the part file is kept for a resume
+    if (rc == -3) {
+        unlink(part_path);  // Corrupted somewhere on the way; resuming would keep the bad bytes
+        dfs_send_text(sockfd, DFS_OP_ERR, id, "Checksum mismatch");
+        return 0;
+    }
+
+    // Store it as a blob, or link the blob already holding these bytes
+    int shared = -1;
+    if (rc == 0) {
+        dfs_csum_store(fd, crc);  // Kept with the file for downloads
+        dfs_sha256_hex(&sha, digest);
+        int tagged = dfs_blob_tag(fd, digest) == 0;  // Both xattrs are flushed with the bytes
+        if (dfs_sync_file(&syncer, fd) == 0)  // On disk before its name points at it
+            shared = dfs_blob_publish(listing.root, fd, part_path, full_path, digest);
+        // New contents of several chunks: keep their digests for delta uploads
+        if (shared == 0 && tagged && chunks.n > 1 && !chunks.overflow)
+            dfs_delta_save(listing.root, digest, chunks.d, chunks.n);
+    }
+    close(fd);
+    dfs_sha256_pieces_free(&chunks);
+    if (shared < 0 || dfs_sync_dir(&syncer, base_path) < 0) {
+        dfs_send_text(sockfd, DFS_OP_ERR, id, "Write failed");
+        return 0;
+    }
+
+    // List it from now on
+    char logical[BUFFER_SIZE], rel[BUFFER_SIZE];
+    snprintf(logical, sizeof(logical), "%s/%s", dest_path, filename);
+    if (dfs_logical_path(logical, rel, sizeof(rel)) == 0)
+        dfs_list_add(&listing, rel);
+
+    dfs_send_text(sockfd, DFS_OP_OK, id, "OK");  // Acknowledge file stored
+    printf("[%s] File '%s' saved at %s%s\n", node_name, filename, full_path,
+           shared ? " (contents already stored)" : "");
+    return 0;
+}
+
+// --------------------------------------------------
+// Replies with the offset an interrupted upload of <filename> into
+// <dest_path> may resume from (0 if there is no part file)
+
+void send_resume_offset(int sockfd, uint32_t id, const char* args) {
+    char filename[256], dest_path[512], base_path[BUFFER_SIZE], part_path[BUFFER_SIZE], msg[32];
+    if (sscanf(args, "%255s %511s", filename, dest_path) != 2 || strlen(dest_path) < 4) {
+        dfs_send_text(sockfd, DFS_OP_ERR, id, "Usage: resume <filename> <dest>");
+        return;
+    }
+    if (snprintf(base_path, sizeof(base_path), "%s/%s", node_root, dest_path + 4) >= (int)sizeof(base_path)) {
+        dfs_send_text(sockfd, DFS_OP_ERR, id, "Path too long");
+        return;
+    }
+    uint64_t offset = dfs_part_path(part_path, sizeof(part_path), base_path, filename) == 0 ?
+                      dfs_part_resume(part_path) : 0;
+    snprintf(msg, sizeof(msg), "%llu", (unsigned long long)offset);
+    dfs_send_text(sockfd, DFS_OP_OK, id, msg);
+}
+
+// Sends S1 the chunk digests of the stored copy an upload would replace,
+// so the client sends only the chunks that changed (see dfs_delta.h)
+// Returns -1 if the connection broke
+int send_chunk_digests(int sockfd, uint32_t id, const char* args) {
+    char filename[256], dest_path[512], file_path[BUFFER_SIZE];
+    if (sscanf(args, "%255s %511s", filename, dest_path) != 2 || strlen(dest_path) < 4) {
+        dfs_send_text(sockfd, DFS_OP_ERR, id, "Usage: chunks <filename> <dest>");
+        return 0;
+    }
+    if (snprintf(file_path, sizeof(file_path), "%s/%s/%s", node_root, dest_path + 4, filename) >=
+        (int)sizeof(file_path))
+        return dfs_send_text(sockfd, DFS_OP_ERR, id, "Path too long") < 0 ? -1 : 0;
+    return dfs_delta_reply(sockfd, id, file_path, listing.root);
+}
+
+// --------------------------------------------------
+// Sends the requested byte range of file_path as one DATA frame (size
+// first, then contents); a zero length means the rest of the file
+// With `lz4` set (S1 relays a client's request for it) the range goes out
+// compressed instead, as a run of DATA frames
+// Replies NOTFOUND if it cannot be opened; returns -1 if the connection broke
+
+int send_file_path(int sockfd, uint32_t id, const char* file_path, uint64_t offset, uint64_t length, int lz4) {
+    struct stat st;
+    int fd = open(file_path, O_RDONLY);  // Open requested file
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        dfs_send_text(sockfd, DFS_OP_ERR, id, "NOTFOUND");  // File not found
+        return 0;
+    }
+
+    // Send the range straight from the page cache to the socket, unless it
+    // is to be compressed on the way
+    dfs_clip_range(st.st_size, &offset, &length);
+    int rc = (lz4 ? dfs_send_stored_lz4(sockfd, id, fd, offset, length) :
+                    dfs_send_stored(sockfd, id, fd, offset, length)) == 0 ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+// --------------------------------------------------
+// Sends a requested file to S1 for download; only types that compress
+// well (see dfs_lz4_wanted) are sent compressed
+
+int send_file(int sockfd, uint32_t id, const char* filename, uint64_t offset, uint64_t length, int lz4) {
+    char file_path[BUFFER_SIZE];
+    if (snprintf(file_path, sizeof(file_path), "%s/%s", node_root, filename) >= (int)sizeof(file_path))  // Build path
+        return dfs_send_text(sockfd, DFS_OP_ERR, id, "NOTFOUND") < 0 ? -1 : 0;
+
+    int rc = send_file_path(sockfd, id, file_path, offset, length, lz4 && dfs_lz4_wanted(filename));
+
+    printf("[%s] Sent file '%s' to S1\n", node_name, filename);
+    return rc;
+}
+
+// --------------------------------------------------
+// Streams a tarball of all files in the node's directory to S1, built on
+// the fly with no scratch files (see dfs_tar.h). With `members_only` it is
+// this node's part of an archive S1 joins from several nodes.
+
+int send_tar(int sockfd, uint32_t id, int members_only) {
+    printf("[%s] Streaming %s%s...\n", node_name, node_tar, members_only ? " (members)" : "");
+    int rc = members_only ? dfs_tar_reply_members(sockfd, id, node_root, node_ext) :
+                            dfs_tar_reply(sockfd, id, node_root, node_ext);
+    printf("[%s] Sent %s to S1\n", node_name, node_tar);
+    return rc;
+}
+
+// --------------------------------------------------
+// Pool entry points: uploads and single-file downloads run on the
+// transfer pool, tarball builds on the tar pool
+
+int run_transfer(int sockfd, const struct dfs_hdr* hdr, const char* args) {
+    char filename[256], path[512];
+    unsigned long long offset = 0, length = 0, total = 0;
+    if (hdr->opcode == DFS_OP_UPLOADF) {
+        if (sscanf(args, "%255s %511s %llu %llu", filename, path, &offset, &total) < 2)
+            return -1;  // The unread DATA frame leaves the stream out of sync
+        return receive_file(sockfd, hdr->request_id, filename, path, offset, total);
+    }
+    if (hdr->opcode == DFS_OP_CHUNKS)
+        return send_chunk_digests(sockfd, hdr->request_id, args);
+    if (sscanf(args, "%511s %llu %llu", path, &offset, &length) >= 1)
+        return send_file(sockfd, hdr->request_id, path, offset, length,  // Send a file or part of it
+                         hdr->flags & DFS_FLAG_LZ4);
+    return 0;
+}
+
+int run_tar(int sockfd, const struct dfs_hdr* hdr, const char* args) {
+    char ext[16], part[16] = "";
+    int members_only = sscanf(args, "%15s %15s", ext, part) == 2 && strcmp(part, "members") == 0;
+    return send_tar(sockfd, hdr->request_id, members_only);
+}
+
+// --------------------------------------------------
+// This function is triggered when S1's connection becomes readable.
+// It reads one command and routes it to the appropriate function.
+// S1 keeps the connection for further commands; returns -1 once it is
+// no longer usable.
+
+int handle_client(int sockfd) {
+    char buffer[BUFFER_SIZE];
+    struct dfs_hdr hdr;
+
+    // Read command frame from S1
+    if (dfs_recv_hdr(sockfd, &hdr) < 0 ||
+        dfs_recv_text(sockfd, &hdr, buffer, sizeof(buffer)) < 0) {
+        return -1;
+    }
+    uint32_t id = hdr.request_id;
+    printf("[%s] Command received: op=%d %s\n", node_name, hdr.opcode, buffer);
+
+    // Upload command from S1, or download of a single file
+    if (hdr.opcode == DFS_OP_UPLOADF || hdr.opcode == DFS_OP_DOWNLF || hdr.opcode == DFS_OP_CHUNKS) {
+        if (dfs_pool_submit(&transfer_pool, sockfd, &hdr, buffer) == 0)
+            return DFS_SERVE_DEFERRED;
+        // Refuse an upload before reading its body; closing makes S1's relay fail fast
+        dfs_send_text(sockfd, DFS_OP_ERR, id, "BUSY");
+        if (hdr.opcode == DFS_OP_UPLOADF) return -1;
+
+    // Request for tarball download ("<ext>", or "<ext> members" for a part)
+    } else if (hdr.opcode == DFS_OP_DOWNLTAR) {
+        char ext[16], msg[64];
+        if (sscanf(buffer, "%15s", ext) == 1) {
+            snprintf(msg, sizeof(msg), "%s files not supported", node_ext);
+            if (strcmp(ext, node_ext) != 0)
+                dfs_send_text(sockfd, DFS_OP_ERR, id, "Unsupported extension");
+            else if (!node_tar)
+                dfs_send_text(sockfd, DFS_OP_ERR, id, msg);
+            else if (dfs_pool_submit(&tar_pool, sockfd, &hdr, buffer) == 0)
+                return DFS_SERVE_DEFERRED;
+            else
+                dfs_send_text(sockfd, DFS_OP_ERR, id, "BUSY");
+        }
+
+    // How far an interrupted upload got
+    } else if (hdr.opcode == DFS_OP_RESUME) {
+        send_resume_offset(sockfd, id, buffer);
+
+    // Request to display all stored files
+    } else if (hdr.opcode == DFS_OP_DISPFNAMES) {
+        // Served from the in-memory listing (see dfs_list.h)
+        struct dfs_list_query q;
+        if (dfs_list_parse(buffer, &q) == 0) {
+            size_t list_len = 0;
+            char* list = dfs_list_query(&listing, &q, &list_len);
+            if (list)
+                dfs_send_frame(sockfd, DFS_OP_OK, 0, id, list, list_len);
+            else
+                dfs_send_text(sockfd, DFS_OP_ERR, id, "Out of memory");
+            free(list);
+        } else {
+            dfs_send_text(sockfd, DFS_OP_ERR, id, "Usage: dispfnames <foldername>\n");
+        }
+
+    // File delete command
+    } else if (hdr.opcode == DFS_OP_REMOVEF) {
+        // One or more exact logical paths, resolved through the in-memory
+        // index (no directory search); one result line per path, in order
+        char* reply = NULL;
+        size_t reply_len = 0;
+        FILE* out = open_memstream(&reply, &reply_len);
+        int count = 0, removed = 0;
+        char* save = NULL;
+        for (char* key = strtok_r(buffer, " \n", &save); key && out; key = strtok_r(NULL, " \n", &save)) {
+            int ok = dfs_list_unlink(&listing, key) == 0;
+            fprintf(out, "%s%s", count++ ? "\n" : "", ok ? "REMOVED" : "NOTFOUND");
+            removed += ok;
+            if (ok) printf("[%s] Removed file: %s\n", node_name, key);
+        }
+        if (out) fclose(out);
+        if (count > 0 && reply)
+            dfs_send_frame(sockfd, removed == count ? DFS_OP_OK : DFS_OP_ERR, 0, id, reply, reply_len);
+        else
+            dfs_send_text(sockfd, DFS_OP_ERR, id, "Usage: removef <path>...");
+        free(reply);
+    } else {
+        dfs_send_text(sockfd, DFS_OP_ERR, id, "Unknown command");
+    }
+
+    return 0;  // Keep the connection open for S1's next command
+}
+
+// --------------------------------------------------
+// Main server loop that runs forever
+// Accepts client connections (from S1) and spawns handler
+// Usage: Snode [-n name] [-p port] [-e ext] [-t tarname] [-w workers]
+//              [-r stream-MiB] [-d direct-MiB] [-s sync-ms] [-u]
+
+int main(int argc, char* argv[]) {
+    int server_sock;
+    struct sockaddr_in addr;
+    int workers = dfs_reactor_default_workers();
+    int sync_ms = DFS_SYNC_MS, uring = 0;
+    long direct_mb = -1;
+
+    // -n NAME names the node: its files live in ~/NAME and its log lines
+    // start with [NAME]. It defaults to the name the binary runs under, so
+    // a copy or link called S3 is the classic S3.
+    // -p PORT, -e .EXT, -t NAME.tar: where it listens, the extension it
+    // stores and the name of the tarball of them (no -t: no downltar);
+    // S2, S3 and S4 default to their classic values
+    // -w N sets the number of reactor and transfer threads
+    // -r N: downloads of N MiB or more read ahead and drop pages behind them,
+    // so small hot files stay cached; -d N: read those with O_DIRECT
+    // -s N: uploads finishing within N ms share one round of fsyncs
+    // -u: io_uring engine for uploads, falling back to blocking I/O if unavailable
+    const char* base = strrchr(argv[0], '/');
+    node_name = base ? base + 1 : argv[0];
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:e:t:w:r:d:s:u")) != -1) {
+        if (opt == 'n' && *optarg && !strchr(optarg, '/')) {
+            node_name = optarg;
+        } else if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) <= 65535) {
+            node_port = atoi(optarg);
+        } else if (opt == 'e' && optarg[0] == '.' && strlen(optarg) < sizeof(listing.ext)) {
+            node_ext = optarg;
+        } else if (opt == 't' && *optarg) {
+            node_tar = optarg;
+        } else if (opt == 'w' && atoi(optarg) > 0) {
+            workers = atoi(optarg);
+        } else if (opt == 'r' && atol(optarg) > 0) {
+            dfs_read_policy.stream_min = (uint64_t)atol(optarg) << 20;
+        } else if (opt == 'd' && atol(optarg) >= 0) {
+            direct_mb = atol(optarg);
+        } else if (opt == 's') {
+            sync_ms = atoi(optarg);
+        } else if (opt == 'u') {
+            uring = 1;
+        } else {
+            node_port = -1;
+            break;
+        }
+    }
+
+    // Fill in what was not given from the classic server of that name
+    for (size_t i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+        const struct preset* p = &presets[i];
+        if (strcmp(node_name, p->name) != 0) continue;
+        if (!node_port) node_port = p->port;
+        if (!node_ext) node_ext = p->ext;
+        if (!node_tar && strcmp(node_ext, p->ext) == 0) node_tar = p->tar;
+        if (direct_mb < 0) direct_mb = p->direct_mb;
+    }
+    if (node_port <= 0 || !node_ext) {
+        fprintf(stderr, "Usage: %s [-n name] [-p port] [-e ext] [-t tarname] [-w workers] [-r stream-MiB]\n"
+                        "       [-d direct-MiB] [-s sync-ms] [-u]\n"
+                        "(-p and -e are required unless the name is S2, S3 or S4)\n", argv[0]);
+        return 1;
+    }
+    if (direct_mb >= 0) dfs_read_policy.direct_min = (uint64_t)direct_mb << 20;
+
+    signal(SIGPIPE, SIG_IGN);  // A vanished S1 should fail the send, not kill the server
+
+    server_sock = socket(AF_INET, SOCK_STREAM, 0);  // Create TCP socket
+    int reuse = 1;  // Allow quick restarts while old connections sit in TIME_WAIT
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(node_port);
+    addr.sin_addr.s_addr = INADDR_ANY;  // Accept any incoming IP
+
+    if (bind(server_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {  // Bind to port
+        node_perror("bind");
+        return 1;
+    }
+
+    // Index the stored files for dispfnames before taking requests
+    snprintf(node_root, sizeof(node_root), "%s/%s", getenv("HOME"), node_name);
+    if (dfs_list_open(&listing, node_root, node_ext, 1) < 0) {
+        node_perror("Cannot scan the storage directory");
+        return 1;
+    }
+    dfs_sync_init(&syncer, sync_ms);
+    if (uring && dfs_uring_probe() < 0)
+        node_perror("io_uring unavailable, uploads use blocking I/O");
+    else if (uring)
+        dfs_uring_on = 1;
+
+    listen(server_sock, SOMAXCONN);  // Start listening
+    printf("[%s] Storing %s files in %s, listening on port %d...\n", node_name, node_ext, node_root, node_port);
+
+    // Serve S1's connections from a pool of worker threads; transfers and
+    // tarball builds get bounded pools of their own
+    struct dfs_reactor reactor = { node_name, server_sock, -1, handle_client, 0 };
+    if (dfs_pool_start(&transfer_pool, &reactor, workers, TRANSFER_QUEUE, run_transfer) < 0 ||
+        dfs_pool_start(&tar_pool, &reactor, 1, TAR_QUEUE, run_tar) < 0) {
+        node_perror("pthread_create");
+        return 1;
+    }
+    dfs_reactor_run(&reactor, workers);
+
+    return 0;
+}
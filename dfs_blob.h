@@ -0,0 +1,142 @@
+// dfs_blob.h
+// Content-addressed file store used by the storage nodes (Snode).
+//
+// The bytes of every stored file live once, in a blob named by their
+// SHA-256 under <root>/.blobs/ (e.g. .blobs/9f/86d0...), and each stored
+// path is a hard link to its blob. The file system's link count is the
+// reference count: an upload whose contents are already stored only links
+// the existing blob under its new path, and a blob is deleted once its
+// own name is the last link left. The digest is also kept in a
+// "user.dfs.sha256" xattr, which all links share, so any stored path leads
+// back to its blob. Next to a blob may lie "<blob>.chunks", the digests
+// of its chunks for delta uploads (see dfs_delta.h); it goes with the blob.
+//
+// Files stored before deduplication (no digest xattr) are left as they are.
+
+#ifndef DFS_BLOB_H
+#define DFS_BLOB_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "dfs_sha256.h"
+
+#define DFS_BLOB_DIR ".blobs"               // Under each server's root; not listed or archived
+#define DFS_BLOB_XATTR "user.dfs.sha256"
+#define DFS_BLOB_CHUNKS ".chunks"           // Suffix of a blob's chunk digests
+
+// "<root>/.blobs/ab/cdef..." for digest "abcdef...". With `mk` set the
+// directories are created as needed.
+static inline int dfs_blob_path(char* out, size_t cap, const char* root, const char* hex, int mk) {
+    int n = snprintf(out, cap, "%s/" DFS_BLOB_DIR "/%.2s/%s", root, hex, hex + 2);
+    if (n < 0 || (size_t)n >= cap) return -1;
+    if (mk) {
+        char* fan = strrchr(out, '/');
+        *fan = '\0';
+        char* top = strrchr(out, '/');
+        *top = '\0';
+        mkdir(out, 0755);
+        *top = '/';
+        mkdir(out, 0755);
+        *fan = '/';
+    }
+    return 0;
+}
+
+// Digest of the blob a stored path links to. Returns 0, or -1 if it has none.
+static inline int dfs_blob_of(const char* path, char hex[DFS_SHA256_HEX]) {
+    ssize_t n = getxattr(path, DFS_BLOB_XATTR, hex, DFS_SHA256_HEX - 1);
+    if (n != DFS_SHA256_HEX - 1) return -1;
+    hex[n] = '\0';
+    return 0;
+}
+
+// Same for the stored file open on `fd`
+static inline int dfs_blob_of_fd(int fd, char hex[DFS_SHA256_HEX]) {
+    ssize_t n = fgetxattr(fd, DFS_BLOB_XATTR, hex, DFS_SHA256_HEX - 1);
+    if (n != DFS_SHA256_HEX - 1) return -1;
+    hex[n] = '\0';
+    return 0;
+}
+
+// Record digest `hex` on the received file open on `fd`. Done before the
+// file is flushed, so the xattr is on disk with the bytes it names.
+static inline int dfs_blob_tag(int fd, const char* hex) {
+    return fsetxattr(fd, DFS_BLOB_XATTR, hex, DFS_SHA256_HEX - 1, 0);
+}
+
+// Call after a path linked to blob `hex` was removed or replaced: deletes
+// the blob if no stored path links to it any more. A concurrent upload may
+// link it again in between; that file then simply stops being shared.
+static inline void dfs_blob_release(const char* root, const char* hex) {
+    char blob[4096];
+    struct stat st;
+    if (dfs_blob_path(blob, sizeof(blob), root, hex, 0) == 0 && stat(blob, &st) == 0 && st.st_nlink <= 1 &&
+        unlink(blob) == 0 && strlen(blob) + sizeof(DFS_BLOB_CHUNKS) <= sizeof(blob)) {
+        strcat(blob, DFS_BLOB_CHUNKS);
+        unlink(blob);
+    }
+}
+
+// Publish a fully received upload: `part` (open on `fd`, tagged and
+// flushed) holds bytes whose SHA-256 is `hex`, and becomes `final`. If a blob with that digest is
+// stored, the part file is dropped and `final` is linked to the blob;
+// otherwise the part file becomes the blob. Whatever `final` held before
+// is released. Returns 1 if the contents were already stored, 0 if they
+// are new, -1 if `final` could not be written.
+static inline int dfs_blob_publish(const char* root, int fd, const char* part, const char* final,
+                                   const char* hex) {
+    char blob[4096], tmp[4096], old[DFS_SHA256_HEX], tag[DFS_SHA256_HEX];
+    int had_old = dfs_blob_of(final, old) == 0;
+
+    // Without the xattr a path could not find its blob again; store plainly
+    if (dfs_blob_of_fd(fd, tag) < 0 || strcmp(tag, hex) != 0 ||
+        dfs_blob_path(blob, sizeof(blob), root, hex, 1) < 0 ||
+        snprintf(tmp, sizeof(tmp), "%s.link", part) >= (int)sizeof(tmp)) {
+        if (rename(part, final) < 0) return -1;
+        if (had_old) dfs_blob_release(root, old);
+        return 0;
+    }
+
+    int rc = -1;
+    for (int attempt = 0; attempt < 3 && rc < 0; attempt++) {
+        // Already stored: link it under a temporary name, then move that into place
+        if (link(blob, tmp) == 0) {
+            if (rename(tmp, final) < 0) {
+                unlink(tmp);
+                return -1;
+            }
+            unlink(part);
+            rc = 1;
+        } else if (errno == EEXIST) {
+            unlink(tmp);                    // Left over from a crash
+        } else if (errno == ENOENT) {
+            // New contents: the part file becomes the blob
+            if (link(part, blob) == 0 || errno != EEXIST) {  // EEXIST: stored meanwhile, go again
+                if (rename(part, final) < 0) return -1;
+                rc = 0;
+            }
+        } else {
+            if (rename(part, final) < 0) return -1;  // e.g. too many links: keep a private copy
+            rc = 0;
+        }
+    }
+    if (rc < 0 && rename(part, final) == 0) rc = 0;
+    if (rc >= 0 && had_old && strcmp(old, hex) != 0) dfs_blob_release(root, old);
+    return rc;
+}
+
+// Remove stored path `path` and release its blob. Returns unlink()'s result.
+static inline int dfs_blob_unlink(const char* root, const char* path) {
+    char hex[DFS_SHA256_HEX];
+    int shared = dfs_blob_of(path, hex) == 0;
+    int rc = unlink(path);
+    if (rc == 0 && shared) dfs_blob_release(root, hex);
+    return rc;
+}
+
+#endif // DFS_BLOB_H
@@ -0,0 +1,211 @@
+// dfs_cache.h
+// S1's cache of hot files held by S2/S3/S4.
+//
+// A downlf of a file another server holds normally costs a round trip to
+// that server. With the cache, S1 fetches the whole file once into an
+// in-memory file (memfd) and serves that download, and the later ones,
+// straight from it: any byte range, plain with sendfile() or compressed.
+// The file's checksum is kept with it, so a cached copy is verified by
+// the client as usual.
+//
+// The cache is bounded in bytes and evicts the least recently used file
+// first. Files larger than an eighth of it are never cached, so one large
+// download cannot flush out many small hot ones. Entries are keyed by
+// logical path and tagged with the index generation of the upload they
+// copy (struct dfs_meta's gen): a lookup whose generation differs is a
+// miss, so a file replaced by any session is fetched afresh. S1 also
+// drops an entry as soon as its path is uploaded or removed.
+//
+// An entry in use by a download stays alive (reference count) even if it
+// is evicted meanwhile; its memory is freed once the last reader is done.
+//
+// Only one download fetches a given file at a time: a miss on a path whose
+// fill is already under way waits for that fill and is then served from
+// the new entry, or, if the fill did not produce one, relayed from the
+// server like an uncached download.
+
+#ifndef DFS_CACHE_H
+#define DFS_CACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "dfs_htab.h"
+
+struct dfs_cached {
+    struct dfs_cached *prev, *next;  // LRU list, most recently used first
+    char* key;                  // Logical path
+    uint64_t gen;               // Index generation the contents belong to
+    int fd;                     // memfd holding the contents
+    uint64_t size;
+    uint32_t crc;               // The file's checksum, if have_crc
+    int have_crc;
+    int refs;                   // Readers, plus one while in the cache
+};
+
+struct dfs_cache {
+    pthread_mutex_t lock;       // Guards everything below
+    struct dfs_htab map;        // key -> struct dfs_cached*
+    struct dfs_htab filling;    // Keys being fetched into the cache
+    pthread_cond_t filled;      // A fill finished
+    struct dfs_cached *head, *tail;
+    uint64_t cap;               // Bytes the cached files may use (0 = off)
+    uint64_t used;
+    uint64_t max_file;          // Largest file worth caching
+    uint64_t hits, misses;
+};
+
+static inline int dfs_cache_init(struct dfs_cache* c, uint64_t cap) {
+    memset(c, 0, sizeof(*c));
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->filled, NULL);
+    c->cap = cap;
+    c->max_file = cap / 8;
+    return dfs_htab_init(&c->map, 256) < 0 || dfs_htab_init(&c->filling, 16) < 0 ? -1 : 0;
+}
+
+// Is a file of this size worth fetching into the cache?
+static inline int dfs_cache_wants(const struct dfs_cache* c, uint64_t size) {
+    return c->cap > 0 && size <= c->max_file;
+}
+
+// A new, empty entry for the caller to fill through e->fd, or NULL
+static inline struct dfs_cached* dfs_cache_new(const char* key, uint64_t gen) {
+    struct dfs_cached* e = calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    e->key = strdup(key);
+    e->fd = memfd_create("dfs-cache", MFD_CLOEXEC);
+    if (!e->key || e->fd < 0) {
+        if (e->fd >= 0) close(e->fd);
+        free(e->key);
+        free(e);
+        return NULL;
+    }
+    e->gen = gen;
+    e->refs = 1;
+    return e;
+}
+
+static inline void dfs_cache_free(struct dfs_cached* e) {
+    close(e->fd);
+    free(e->key);
+    free(e);
+}
+
+// Take `e` out of the map and list; caller holds the lock
+static inline void dfs_cache_unlink(struct dfs_cache* c, struct dfs_cached* e) {
+    if (e->prev) e->prev->next = e->next; else c->head = e->next;
+    if (e->next) e->next->prev = e->prev; else c->tail = e->prev;
+    dfs_htab_del(&c->map, e->key);
+    c->used -= e->size;
+    if (--e->refs == 0) dfs_cache_free(e);
+}
+
+// Done with an entry from dfs_cache_get or dfs_cache_new
+static inline void dfs_cache_release(struct dfs_cache* c, struct dfs_cached* e) {
+    pthread_mutex_lock(&c->lock);
+    int last = --e->refs == 0;
+    pthread_mutex_unlock(&c->lock);
+    if (last) dfs_cache_free(e);
+}
+
+// The cached copy of `key` at generation `gen`, held for the caller, or
+// NULL; caller holds the lock. A copy of an older generation is dropped
+// on the way.
+static inline struct dfs_cached* dfs_cache_find(struct dfs_cache* c, const char* key, uint64_t gen) {
+    struct dfs_cached* e = dfs_htab_get(&c->map, key);
+    if (e && e->gen != gen) {
+        dfs_cache_unlink(c, e);
+        e = NULL;
+    }
+    if (e) {
+        // Move to the front of the LRU list
+        if (e != c->head) {
+            e->prev->next = e->next;
+            if (e->next) e->next->prev = e->prev; else c->tail = e->prev;
+            e->prev = NULL;
+            e->next = c->head;
+            c->head->prev = e;
+            c->head = e;
+        }
+        e->refs++;
+    }
+    return e;
+}
+
+// The cached copy of `key` at generation `gen`, held for the caller (give
+// it back with dfs_cache_release), or NULL
+static inline struct dfs_cached* dfs_cache_get(struct dfs_cache* c, const char* key, uint64_t gen) {
+    pthread_mutex_lock(&c->lock);
+    struct dfs_cached* e = dfs_cache_find(c, key, gen);
+    if (e) c->hits++; else c->misses++;
+    pthread_mutex_unlock(&c->lock);
+    return e;
+}
+
+// As dfs_cache_get, but on a miss with no fill of `key` under way, the
+// caller becomes its filler (*fill = 1): it fetches the file into a
+// dfs_cache_new entry and then calls dfs_cache_filled, whether or not the
+// entry made it into the cache. A miss while another download fills `key`
+// waits for that fill and looks again; if there is still no copy,
+// *fill = 0 and the caller should fetch the file without caching it.
+static inline struct dfs_cached* dfs_cache_claim(struct dfs_cache* c, const char* key, uint64_t gen, int* fill) {
+    pthread_mutex_lock(&c->lock);
+    struct dfs_cached* e = dfs_cache_find(c, key, gen);
+    *fill = 0;
+    if (!e && dfs_htab_get(&c->filling, key)) {
+        while (dfs_htab_get(&c->filling, key))
+            pthread_cond_wait(&c->filled, &c->lock);
+        e = dfs_cache_find(c, key, gen);
+    } else if (!e && dfs_htab_put(&c->filling, key, c) == NULL && dfs_htab_get(&c->filling, key)) {
+        *fill = 1;
+    }
+    if (e) c->hits++; else c->misses++;
+    pthread_mutex_unlock(&c->lock);
+    return e;
+}
+
+// The fill of `key` claimed with dfs_cache_claim is over; wake its waiters
+static inline void dfs_cache_filled(struct dfs_cache* c, const char* key) {
+    pthread_mutex_lock(&c->lock);
+    dfs_htab_del(&c->filling, key);
+    pthread_cond_broadcast(&c->filled);
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Add a filled entry (e->size set), replacing any older copy of its key
+// and evicting least recently used files until it fits. The caller keeps
+// its own reference.
+static inline void dfs_cache_insert(struct dfs_cache* c, struct dfs_cached* e) {
+    if (!dfs_cache_wants(c, e->size)) return;
+    pthread_mutex_lock(&c->lock);
+    struct dfs_cached* old = dfs_htab_get(&c->map, e->key);
+    if (old) dfs_cache_unlink(c, old);
+    while (c->tail && c->used + e->size > c->cap)
+        dfs_cache_unlink(c, c->tail);
+
+    if (dfs_htab_put(&c->map, e->key, e) == NULL && dfs_htab_get(&c->map, e->key) == e) {
+        e->prev = NULL;
+        e->next = c->head;
+        if (c->head) c->head->prev = e; else c->tail = e;
+        c->head = e;
+        c->used += e->size;
+        e->refs++;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Forget `key` (it was uploaded again or removed)
+static inline void dfs_cache_drop(struct dfs_cache* c, const char* key) {
+    if (c->cap == 0) return;
+    pthread_mutex_lock(&c->lock);
+    struct dfs_cached* e = dfs_htab_get(&c->map, key);
+    if (e) dfs_cache_unlink(c, e);
+    pthread_mutex_unlock(&c->lock);
+}
+
+#endif // DFS_CACHE_H
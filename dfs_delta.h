@@ -0,0 +1,298 @@
+// dfs_delta.h
+// Delta uploads: re-uploading a changed file moves only its changed chunks.
+//
+// Files are cut into fixed DFS_CHUNK_SIZE chunks. Before a delta upload
+// the client asks the file's server for the SHA-256 of every chunk of the
+// copy it holds (DFS_OP_CHUNKS), compares them with its own, and sends an
+// UPLOADF whose DATA frame has DFS_FLAG_DELTA set. Its payload is
+//
+//   bitmap     one bit per chunk of the new file, LSB first; 1 = the chunk
+//              follows in this frame, 0 = same as the stored copy
+//   chunks     the flagged chunks, in order
+//   trailer    CRC32C of the whole new file (DFS_FLAG_CSUM, always set)
+//
+// The server rebuilds the file into its part file from the received chunks
+// and the stored copy. The trailer checks the result, so a stored copy that
+// changed in between shows up as a checksum mismatch, and the client then
+// falls back to a full upload. The new file's size travels in the UPLOADF
+// command, since the frame does not carry it.
+//
+// A storage node hashes the chunks of every upload as it arrives (in the
+// same pass as the whole file's SHA-256) and keeps the digests next to the
+// file's blob (see dfs_blob.h), so answering CHUNKS reads 32 bytes per
+// chunk instead of the whole file. Digests missing, torn or older than the
+// file are computed again from the file, and kept. Files of one chunk are
+// simply hashed when asked; a list of one would cost an inode per file.
+
+#ifndef DFS_DELTA_H
+#define DFS_DELTA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "dfs_proto.h"
+#include "dfs_sha256.h"
+#include "dfs_blob.h"
+
+#define DFS_DELTA_MAX_CHUNKS (DFS_MAX_TEXT / DFS_SHA256_SIZE)  // Largest digest list exchanged
+
+static inline uint64_t dfs_delta_chunks(uint64_t size) {
+    return (size + DFS_CHUNK_SIZE - 1) / DFS_CHUNK_SIZE;
+}
+
+static inline size_t dfs_delta_chunk_len(uint64_t size, uint64_t i) {
+    uint64_t left = size - i * DFS_CHUNK_SIZE;
+    return left < DFS_CHUNK_SIZE ? left : DFS_CHUNK_SIZE;
+}
+
+// SHA-256 of every chunk of `fd` (`size` bytes) into a malloc'd array of
+// DFS_SHA256_SIZE-byte digests. Returns the chunk count, or -1.
+static inline long dfs_delta_digests(int fd, uint64_t size, unsigned char** out) {
+    uint64_t n = dfs_delta_chunks(size);
+    unsigned char* d = malloc(n * DFS_SHA256_SIZE + 1);
+    char* buf = malloc(DFS_CHUNK_SIZE);
+    if (!d || !buf || n > DFS_DELTA_MAX_CHUNKS) goto fail;
+    for (uint64_t i = 0; i < n; i++) {
+        size_t len = dfs_delta_chunk_len(size, i), got = 0;
+        while (got < len) {
+            ssize_t r = pread(fd, buf + got, len - got, i * DFS_CHUNK_SIZE + got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) goto fail;
+            got += r;
+        }
+        struct dfs_sha256 s;
+        dfs_sha256_init(&s);
+        dfs_sha256_update(&s, buf, len);
+        dfs_sha256_final(&s, d + i * DFS_SHA256_SIZE);
+    }
+    free(buf);
+    *out = d;
+    return (long)n;
+fail:
+    free(d);
+    free(buf);
+    return -1;
+}
+
+// "<root>/.blobs/ab/cdef....chunks": where the chunk digests of blob `hex` are kept
+static inline int dfs_delta_cache_path(char* out, size_t cap, const char* root, const char* hex, int mk) {
+    if (dfs_blob_path(out, cap, root, hex, mk) < 0) return -1;
+    size_t n = strlen(out);
+    if (n + sizeof(DFS_BLOB_CHUNKS) > cap) return -1;
+    memcpy(out + n, DFS_BLOB_CHUNKS, sizeof(DFS_BLOB_CHUNKS));
+    return 0;
+}
+
+// Keep the `n` chunk digests `d` of blob `hex` under `root` (best effort).
+// They are written to a temporary file renamed into place, so a reader
+// sees the old list or the new one.
+static inline void dfs_delta_save(const char* root, const char* hex, const unsigned char* d, uint64_t n) {
+    char path[4096], tmp[4096];
+    if (dfs_delta_cache_path(path, sizeof(path), root, hex, 1) < 0 ||
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+        return;
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0) return;
+    size_t len = n * DFS_SHA256_SIZE, done = 0;
+    while (done < len) {
+        ssize_t w = write(fd, d + done, len - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        done += w;
+    }
+    close(fd);
+    if (done < len || rename(tmp, path) < 0) unlink(tmp);
+}
+
+// The kept chunk digests of the stored file open on `fd` (`st` its stat)
+// into a malloc'd array, as dfs_delta_digests. Returns -1 if the file is
+// not a blob or its digests are missing, torn or older than the file.
+static inline long dfs_delta_cached(const char* root, int fd, const struct stat* st, unsigned char** out) {
+    char hex[DFS_SHA256_HEX], path[4096];
+    uint64_t n = dfs_delta_chunks(st->st_size);
+    struct stat cs;
+    if (n > DFS_DELTA_MAX_CHUNKS || dfs_blob_of_fd(fd, hex) < 0 ||
+        dfs_delta_cache_path(path, sizeof(path), root, hex, 0) < 0)
+        return -1;
+    int cfd = open(path, O_RDONLY | O_CLOEXEC);
+    if (cfd < 0) return -1;
+    unsigned char* d = NULL;
+    size_t len = n * DFS_SHA256_SIZE, got = 0;
+    if (fstat(cfd, &cs) == 0 && (uint64_t)cs.st_size == len &&
+        (cs.st_mtim.tv_sec > st->st_mtim.tv_sec ||
+         (cs.st_mtim.tv_sec == st->st_mtim.tv_sec && cs.st_mtim.tv_nsec >= st->st_mtim.tv_nsec)) &&
+        (d = malloc(len + 1)) != NULL) {
+        while (got < len) {
+            ssize_t r = pread(cfd, d + got, len - got, got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            got += r;
+        }
+    }
+    close(cfd);
+    if (!d || got < len) {
+        free(d);
+        return -1;
+    }
+    *out = d;
+    return (long)n;
+}
+
+// Answer DFS_OP_CHUNKS for the stored file at `path`: an OK frame holding
+// its chunk digests, empty if there is no such file (nothing to reuse).
+// With `root` set (a node's blob store) the kept digests of a file of
+// several chunks are used, and kept if they had to be computed. Returns -1 only if the socket failed.
+static inline int dfs_delta_reply(int sock, uint32_t id, const char* path, const char* root) {
+    unsigned char* d = NULL;
+    long n = 0;
+    struct stat st;
+    char hex[DFS_SHA256_HEX];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        int keep = root && dfs_delta_chunks(st.st_size) > 1;
+        n = keep ? dfs_delta_cached(root, fd, &st, &d) : -1;
+        if (n < 0) {
+            n = dfs_delta_digests(fd, st.st_size, &d);
+            if (n >= 0 && keep && dfs_blob_of_fd(fd, hex) == 0) dfs_delta_save(root, hex, d, n);
+        }
+    }
+    if (fd >= 0) close(fd);
+    if (n < 0) n = 0;
+    int rc = dfs_send_frame(sock, DFS_OP_OK, 0, id, d, n * DFS_SHA256_SIZE);
+    free(d);
+    return rc;
+}
+
+// Copy `len` bytes at `offset` of `basis` to the writer, extending the
+// checksums. Returns -1 if the basis could not supply them.
+static inline int dfs_delta_copy(int basis, struct dfs_writer* w, uint64_t offset, size_t len, uint32_t* crc,
+                                 struct dfs_sha256* sha) {
+    while (len > 0) {
+        size_t want;
+        char* buf = dfs_writer_space(w, &want);
+        if (want > len) want = len;
+        ssize_t n = pread(basis, buf, want, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        *crc = dfs_crc32c(*crc, buf, n);
+        if (sha) dfs_sha256_update(sha, buf, n);
+        dfs_writer_commit(w, n);
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Receive delta DATA frame `h` for a new file of `size` bytes into `fd`
+// (an empty part file), taking unflagged chunks from `basis` (the stored
+// copy; -1 if none). Codes and checksums as for dfs_recv_summed. A chunk
+// the basis no longer has fails the checksum (-3), like any other change
+// to the basis since its digests were sent.
+static inline int dfs_recv_delta(int sock, const struct dfs_hdr* h, int fd, int basis, uint64_t size,
+                                 uint32_t* crc, struct dfs_sha256* sha) {
+    uint64_t n = dfs_delta_chunks(size), left = dfs_body_len(h);
+    size_t maplen = (n + 7) / 8;
+    uint32_t sent = 0;
+    *crc = 0;
+    if (!dfs_has_csum(h) || n > DFS_DELTA_MAX_CHUNKS || left < maplen)
+        return dfs_drain(sock, h->length) < 0 ? -2 : -1;
+
+    unsigned char* map = malloc(maplen + 1);
+    if (!map || dfs_recv_all(sock, map, maplen) < 0) {
+        free(map);
+        return -2;
+    }
+    left -= maplen;
+
+    // The flagged chunks must add up to the frame's length
+    uint64_t want = 0;
+    for (uint64_t i = 0; i < n; i++)
+        if (map[i / 8] & (1u << (i % 8))) want += dfs_delta_chunk_len(size, i);
+    if (want != left) {
+        free(map);
+        return dfs_drain(sock, left + DFS_CSUM_SIZE) < 0 ? -2 : -1;
+    }
+
+    // The whole new file goes through one writer, in DFS_WRITE_BLOCK writes
+    struct dfs_writer w;
+    int rc = 0, stale = 0;
+    dfs_writer_init(&w, fd);
+    for (uint64_t i = 0; i < n; i++) {
+        size_t len = dfs_delta_chunk_len(size, i);
+        if (map[i / 8] & (1u << (i % 8))) {
+            int r = dfs_recv_to_writer(sock, &w, len, rc == 0 && !stale ? crc : NULL, rc == 0 && !stale ? sha : NULL);
+            if (r == -2) {
+                free(map);
+                dfs_writer_finish(&w);
+                return -2;
+            }
+            if (r < 0) rc = -1;     // Keep reading so the stream stays in sync
+        } else if (rc == 0 && !stale &&
+                   (basis < 0 || dfs_delta_copy(basis, &w, i * DFS_CHUNK_SIZE, len, crc, sha) < 0)) {
+            stale = 1;
+        }
+    }
+    free(map);
+    if (dfs_writer_finish(&w) < 0) rc = -1;
+
+    if (dfs_recv_csum(sock, h, &sent) < 0) return -2;
+    if (rc < 0) return -1;
+    return stale || sent != *crc ? -3 : 0;
+}
+
+// Client side: send `fd` (`size` bytes) as a delta DATA frame against the
+// stored copy's chunk digests `have` (`nhave` of them). Every chunk is
+// read once here to hash it; only changed chunks are then sent, with
+// sendfile(). The bytes of file data sent are left in *sent.
+static inline int dfs_send_delta(int sock, uint32_t id, int fd, uint64_t size, const unsigned char* have,
+                                 uint64_t nhave, uint64_t* sent) {
+    uint64_t n = dfs_delta_chunks(size);
+    size_t maplen = (n + 7) / 8;
+    unsigned char* map = calloc(maplen + 1, 1);
+    char* buf = malloc(DFS_CHUNK_SIZE);
+    uint32_t crc = 0;
+    int rc = -1;
+    *sent = 0;
+    if (!map || !buf) goto out;
+
+    // Hash each chunk and flag the ones the server's copy differs in
+    for (uint64_t i = 0; i < n; i++) {
+        size_t len = dfs_delta_chunk_len(size, i), got = 0;
+        while (got < len) {
+            ssize_t r = pread(fd, buf + got, len - got, i * DFS_CHUNK_SIZE + got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) goto out;
+            got += r;
+        }
+        crc = dfs_crc32c(crc, buf, len);
+
+        unsigned char digest[DFS_SHA256_SIZE];
+        struct dfs_sha256 s;
+        dfs_sha256_init(&s);
+        dfs_sha256_update(&s, buf, len);
+        dfs_sha256_final(&s, digest);
+        if (i >= nhave || memcmp(digest, have + i * DFS_SHA256_SIZE, DFS_SHA256_SIZE) != 0) {
+            map[i / 8] |= 1u << (i % 8);
+            *sent += len;
+        }
+    }
+
+    if (dfs_send_hdr(sock, DFS_OP_DATA, DFS_FLAG_CSUM | DFS_FLAG_DELTA, id, maplen + *sent + DFS_CSUM_SIZE) < 0 ||
+        dfs_send_all(sock, map, maplen) < 0)
+        goto out;
+    for (uint64_t i = 0; i < n; i++)
+        if ((map[i / 8] & (1u << (i % 8))) &&
+            dfs_send_fd_at(sock, fd, i * DFS_CHUNK_SIZE, dfs_delta_chunk_len(size, i)) < 0)
+            goto out;
+    rc = dfs_send_csum(sock, crc);
+out:
+    free(map);
+    free(buf);
+    return rc;
+}
+
+#endif // DFS_DELTA_H
@@ -0,0 +1,136 @@
+// dfs_htab.h
+// String-keyed hash table (FNV-1a, separate chaining, doubles when full).
+// Keys are copied into the table; values are opaque pointers owned by the caller.
+
+#ifndef DFS_HTAB_H
+#define DFS_HTAB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct dfs_hent {
+    struct dfs_hent* next;
+    uint64_t hash;
+    void* value;
+    char key[];                 // NUL-terminated copy of the key
+};
+
+struct dfs_htab {
+    struct dfs_hent** buckets;
+    size_t nbuckets;            // Always a power of two
+    size_t count;
+};
+
+static inline uint64_t dfs_hash_str(const char* s) {
+    uint64_t h = 1469598103934665603ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static inline int dfs_htab_init(struct dfs_htab* t, size_t nbuckets) {
+    size_t n = 16;
+    while (n < nbuckets) n <<= 1;
+    t->buckets = calloc(n, sizeof(*t->buckets));
+    t->nbuckets = t->buckets ? n : 0;
+    t->count = 0;
+    return t->buckets ? 0 : -1;
+}
+
+// Rehash into twice as many buckets once the load factor reaches 1
+static inline void dfs_htab_grow(struct dfs_htab* t) {
+    size_t n = t->nbuckets * 2;
+    struct dfs_hent** nb = calloc(n, sizeof(*nb));
+    if (!nb) return;            // Keep working with longer chains
+    for (size_t i = 0; i < t->nbuckets; i++) {
+        struct dfs_hent* e = t->buckets[i];
+        while (e) {
+            struct dfs_hent* next = e->next;
+            e->next = nb[e->hash & (n - 1)];
+            nb[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(t->buckets);
+    t->buckets = nb;
+    t->nbuckets = n;
+}
+
+static inline struct dfs_hent* dfs_htab_find(const struct dfs_htab* t, const char* key) {
+    uint64_t h = dfs_hash_str(key);
+    for (struct dfs_hent* e = t->buckets[h & (t->nbuckets - 1)]; e; e = e->next)
+        if (e->hash == h && strcmp(e->key, key) == 0)
+            return e;
+    return NULL;
+}
+
+static inline void* dfs_htab_get(const struct dfs_htab* t, const char* key) {
+    struct dfs_hent* e = dfs_htab_find(t, key);
+    return e ? e->value : NULL;
+}
+
+// Insert or replace. Returns the previous value (NULL if the key is new),
+// so the caller can free it.
+static inline void* dfs_htab_put(struct dfs_htab* t, const char* key, void* value) {
+    struct dfs_hent* e = dfs_htab_find(t, key);
+    if (e) {
+        void* old = e->value;
+        e->value = value;
+        return old;
+    }
+
+    size_t klen = strlen(key);
+    e = malloc(sizeof(*e) + klen + 1);
+    if (!e) return NULL;
+    memcpy(e->key, key, klen + 1);
+    e->hash = dfs_hash_str(key);
+    e->value = value;
+    e->next = t->buckets[e->hash & (t->nbuckets - 1)];
+    t->buckets[e->hash & (t->nbuckets - 1)] = e;
+    if (++t->count > t->nbuckets) dfs_htab_grow(t);
+    return NULL;
+}
+
+// Remove a key. Returns its value (NULL if absent) for the caller to free.
+static inline void* dfs_htab_del(struct dfs_htab* t, const char* key) {
+    uint64_t h = dfs_hash_str(key);
+    struct dfs_hent** pp = &t->buckets[h & (t->nbuckets - 1)];
+    for (struct dfs_hent* e = *pp; e; pp = &e->next, e = e->next) {
+        if (e->hash == h && strcmp(e->key, key) == 0) {
+            void* value = e->value;
+            *pp = e->next;
+            free(e);
+            t->count--;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+// Call fn(key, value, arg) for every entry, in no particular order
+static inline void dfs_htab_each(const struct dfs_htab* t,
+                                 void (*fn)(const char* key, void* value, void* arg), void* arg) {
+    for (size_t i = 0; i < t->nbuckets; i++)
+        for (struct dfs_hent* e = t->buckets[i]; e; e = e->next)
+            fn(e->key, e->value, arg);
+}
+
+// Release the table itself; values must be freed by the caller first
+static inline void dfs_htab_free(struct dfs_htab* t) {
+    for (size_t i = 0; i < t->nbuckets; i++) {
+        struct dfs_hent* e = t->buckets[i];
+        while (e) {
+            struct dfs_hent* next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(t->buckets);
+    t->buckets = NULL;
+    t->nbuckets = t->count = 0;
+}
+
+#endif // DFS_HTAB_H
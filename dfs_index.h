@@ -0,0 +1,338 @@
+// dfs_index.h
+// Persistent metadata index used by S1: logical path -> where the file lives.
+//
+// The index is an append-only log on disk plus an in-memory hash table.
+// Every upload appends a PUT record and every removal a DEL record; the
+// table is rebuilt by replaying the log. Each S1 worker keeps its own copy of
+// the table and, before every lookup or update, replays whatever other
+// workers appended since it last looked, so all sessions see the same
+// namespace. flock() serialises writers against readers in other processes;
+// a mutex does the same for threads sharing one dfs_index.
+//
+// Record layout (little-endian), 16-byte header followed by the key:
+//   u32 crc      CRC-32C of everything after this field
+//   u8  op       DFS_IDX_PUT / DFS_IDX_DEL
+//   u8  server   1 = S1, else the storage node's id (2 = S2, 3 = S3, 4 = S4
+//                in the classic layout; see dfs_route.h)
+//   u16 keylen
+//   u64 size     file size in bytes
+//   key[keylen]  logical path, e.g. "reports/q1.pdf"
+//
+// A crash can only leave a torn record at the end of the log. Its CRC fails,
+// readers stop in front of it and the next writer truncates it away.
+
+#ifndef DFS_INDEX_H
+#define DFS_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "dfs_htab.h"
+#include "dfs_csum.h"
+#include "dfs_sync.h"
+
+#define DFS_IDX_MAGIC    "DFSIDX1\n"
+#define DFS_IDX_MAGICLEN 8
+#define DFS_IDX_RECHDR   16
+#define DFS_IDX_PUT      1
+#define DFS_IDX_DEL      2
+
+// What the index knows about one file
+struct dfs_meta {
+    uint8_t server;             // Which server stores it (1 = S1, else a node id)
+    uint64_t size;              // Size at upload time
+    uint64_t gen;               // Log offset of the record; changes on every re-upload
+};
+
+struct dfs_index {
+    char path[1024];
+    int fd;
+    uint64_t applied;           // Log bytes already folded into `map`
+    uint64_t records;           // Records replayed (live + superseded)
+    struct dfs_htab map;        // key -> struct dfs_meta*
+    pthread_mutex_t lock;       // Guards `map` and `applied` between threads
+};
+
+static inline void dfs_index_apply(struct dfs_index* ix, uint8_t op, uint8_t server,
+                                   uint64_t size, const char* key, uint64_t gen) {
+    if (op == DFS_IDX_PUT) {
+        struct dfs_meta* m = malloc(sizeof(*m));
+        if (!m) return;
+        m->server = server;
+        m->size = size;
+        m->gen = gen;
+        free(dfs_htab_put(&ix->map, key, m));
+    } else {
+        free(dfs_htab_del(&ix->map, key));
+    }
+    ix->records++;
+}
+
+// Replay records appended since the last call. With `repair` set (caller
+// holds the exclusive lock) a torn tail is truncated so appends can follow.
+static inline void dfs_index_catch_up(struct dfs_index* ix, int repair) {
+    struct stat st;
+    if (fstat(ix->fd, &st) < 0 || (uint64_t)st.st_size <= ix->applied) return;
+
+    uint64_t end = st.st_size, pos = ix->applied;
+    size_t cap = 64 * 1024, kcap = 0;
+    char* buf = malloc(cap);
+    char* key = NULL;               // NUL-terminated copy of a record's key
+    if (!buf) return;
+
+    while (pos < end) {
+        if (pos + DFS_IDX_RECHDR > end)
+            goto torn;                        // Partial header at the end
+        size_t want = end - pos < cap ? end - pos : cap;
+        ssize_t n = pread(ix->fd, buf, want, pos);
+        if (n <= 0) break;
+
+        size_t off = 0;
+        while (off + DFS_IDX_RECHDR <= (size_t)n) {
+            uint32_t crc;
+            uint16_t klen;
+            uint64_t size;
+            memcpy(&crc, buf + off, 4);
+            memcpy(&klen, buf + off + 6, 2);
+            memcpy(&size, buf + off + 8, 8);
+            klen = le16toh(klen);
+            size_t reclen = DFS_IDX_RECHDR + klen;
+
+            if (pos + off + reclen > end)
+                goto torn;                    // Runs past the end of the log
+            if (off + reclen > (size_t)n) {
+                if (reclen > cap) {           // Longer than the buffer: grow and retry
+                    char* bigger = realloc(buf, reclen);
+                    if (!bigger) goto done;
+                    buf = bigger;
+                    cap = reclen;
+                }
+                break;
+            }
+            if (le32toh(crc) != dfs_crc32c(0, buf + off + 4, reclen - 4))
+                goto torn;
+
+            if ((size_t)klen + 1 > kcap) {
+                char* bigger = realloc(key, (size_t)klen + 1);
+                if (!bigger) goto done;
+                key = bigger;
+                kcap = (size_t)klen + 1;
+            }
+            memcpy(key, buf + off + DFS_IDX_RECHDR, klen);
+            key[klen] = '\0';
+            dfs_index_apply(ix, buf[off + 4], buf[off + 5], le64toh(size), key, pos + off);
+            off += reclen;
+        }
+        pos += off;
+    }
+    goto done;
+
+torn:
+    if (repair) {
+        fprintf(stderr, "[index] Dropping torn record at offset %llu\n", (unsigned long long)pos);
+        if (ftruncate(ix->fd, pos) < 0) perror("[index] ftruncate");
+    }
+done:
+    ix->applied = pos;
+    free(buf);
+    free(key);
+}
+
+// Open (or create) the log at `path` and load it into memory
+static inline int dfs_index_open(struct dfs_index* ix, const char* path) {
+    char magic[DFS_IDX_MAGICLEN];
+
+    snprintf(ix->path, sizeof(ix->path), "%s", path);
+    ix->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (ix->fd < 0) return -1;
+    if (dfs_htab_init(&ix->map, 1024) < 0) return -1;
+    ix->records = 0;
+    pthread_mutex_init(&ix->lock, NULL);
+
+    flock(ix->fd, LOCK_EX);
+    if (pread(ix->fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+        // Brand-new (or empty) log: stamp the header
+        if (ftruncate(ix->fd, 0) < 0 ||
+            write(ix->fd, DFS_IDX_MAGIC, DFS_IDX_MAGICLEN) != DFS_IDX_MAGICLEN) {
+            flock(ix->fd, LOCK_UN);
+            return -1;
+        }
+        fsync(ix->fd);
+    } else if (memcmp(magic, DFS_IDX_MAGIC, DFS_IDX_MAGICLEN) != 0) {
+        fprintf(stderr, "[index] %s is not an index log\n", path);
+        flock(ix->fd, LOCK_UN);
+        return -1;
+    }
+    ix->applied = DFS_IDX_MAGICLEN;
+    dfs_index_catch_up(ix, 1);
+    flock(ix->fd, LOCK_UN);
+    return 0;
+}
+
+// After fork(): take a private file descriptor so flock() excludes the
+// parent and sibling workers (locks belong to the open file, not the process)
+static inline int dfs_index_reopen(struct dfs_index* ix) {
+    int fd = open(ix->path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd < 0) return -1;
+    close(ix->fd);
+    ix->fd = fd;
+    return 0;
+}
+
+// Bring the in-memory table up to date with other workers' appends
+static inline void dfs_index_refresh(struct dfs_index* ix) {
+    pthread_mutex_lock(&ix->lock);
+    flock(ix->fd, LOCK_SH);
+    dfs_index_catch_up(ix, 0);
+    flock(ix->fd, LOCK_UN);
+    pthread_mutex_unlock(&ix->lock);
+}
+
+// Look up `key`. Returns 0 and fills `out` if present, -1 otherwise.
+static inline int dfs_index_get(struct dfs_index* ix, const char* key, struct dfs_meta* out) {
+    pthread_mutex_lock(&ix->lock);
+    flock(ix->fd, LOCK_SH);
+    dfs_index_catch_up(ix, 0);
+    struct dfs_meta* m = dfs_htab_get(&ix->map, key);
+    if (m) *out = *m;
+    flock(ix->fd, LOCK_UN);
+    pthread_mutex_unlock(&ix->lock);
+    return m ? 0 : -1;
+}
+
+// Append one record per key with a single write and one fdatasync, then
+// apply them locally (batched removals pay for one flush, not one each)
+static inline int dfs_index_append_many(struct dfs_index* ix, uint8_t op, uint8_t server,
+                                        uint64_t size, const char* const* keys, size_t n) {
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t klen = strlen(keys[i]);
+        if (klen > 65535) return -1;
+        total += DFS_IDX_RECHDR + klen;
+    }
+
+    unsigned char* buf = malloc(total ? total : 1);
+    if (!buf) return -1;
+    unsigned char* rec = buf;
+    for (size_t i = 0; i < n; i++) {
+        size_t klen = strlen(keys[i]);
+        uint16_t klen_le = htole16(klen);
+        uint64_t size_le = htole64(size);
+        rec[4] = op;
+        rec[5] = server;
+        memcpy(rec + 6, &klen_le, 2);
+        memcpy(rec + 8, &size_le, 8);
+        memcpy(rec + DFS_IDX_RECHDR, keys[i], klen);
+        uint32_t crc_le = htole32(dfs_crc32c(0, rec + 4, DFS_IDX_RECHDR + klen - 4));
+        memcpy(rec, &crc_le, 4);
+        rec += DFS_IDX_RECHDR + klen;
+    }
+
+    int rc = -1;
+    pthread_mutex_lock(&ix->lock);
+    flock(ix->fd, LOCK_EX);
+    dfs_index_catch_up(ix, 1);
+    if (write(ix->fd, buf, total) == (ssize_t)total && fdatasync(ix->fd) == 0) {
+        for (size_t i = 0; i < n; i++) {
+            dfs_index_apply(ix, op, server, size, keys[i], ix->applied);
+            ix->applied += DFS_IDX_RECHDR + strlen(keys[i]);
+        }
+        rc = 0;
+    }
+    flock(ix->fd, LOCK_UN);
+    pthread_mutex_unlock(&ix->lock);
+    free(buf);
+    return rc;
+}
+
+static inline int dfs_index_append(struct dfs_index* ix, uint8_t op, uint8_t server,
+                                   uint64_t size, const char* key) {
+    return dfs_index_append_many(ix, op, server, size, &key, 1);
+}
+
+static inline int dfs_index_put(struct dfs_index* ix, const char* key, uint8_t server, uint64_t size) {
+    return dfs_index_append(ix, DFS_IDX_PUT, server, size, key);
+}
+
+static inline int dfs_index_del(struct dfs_index* ix, const char* key) {
+    return dfs_index_append(ix, DFS_IDX_DEL, 0, 0, key);
+}
+
+static inline int dfs_index_del_many(struct dfs_index* ix, const char* const* keys, size_t n) {
+    return n ? dfs_index_append_many(ix, DFS_IDX_DEL, 0, 0, keys, n) : 0;
+}
+
+// Helper for dfs_index_compact: write one live entry as a PUT record
+struct dfs_index_writer {
+    FILE* fp;
+    int failed;
+};
+
+static inline void dfs_index_write_live(const char* key, void* value, void* arg) {
+    struct dfs_index_writer* w = arg;
+    struct dfs_meta* m = value;
+    size_t klen = strlen(key);
+    unsigned char hdr[DFS_IDX_RECHDR];
+    uint16_t klen_le = htole16(klen);
+    uint64_t size_le = htole64(m->size);
+
+    hdr[4] = DFS_IDX_PUT;
+    hdr[5] = m->server;
+    memcpy(hdr + 6, &klen_le, 2);
+    memcpy(hdr + 8, &size_le, 8);
+    uint32_t crc = dfs_crc32c(0, hdr + 4, DFS_IDX_RECHDR - 4);
+    crc = htole32(dfs_crc32c(crc, key, klen));
+    memcpy(hdr, &crc, 4);
+    if (fwrite(hdr, 1, sizeof(hdr), w->fp) != sizeof(hdr) || fwrite(key, 1, klen, w->fp) != klen)
+        w->failed = 1;
+}
+
+static inline void dfs_index_free_meta(const char* key, void* value, void* arg) {
+    (void)key; (void)arg;
+    free(value);
+}
+
+// Rewrite the log with only the live entries when superseded records
+// dominate it. Call while no other worker is running (S1 startup).
+static inline int dfs_index_compact(struct dfs_index* ix) {
+    if (ix->records < 1024 || ix->records < 2 * ix->map.count) return 0;
+
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ix->path);
+    struct dfs_index_writer w = { fopen(tmp, "wb"), 0 };
+    if (!w.fp) return -1;
+    fwrite(DFS_IDX_MAGIC, 1, DFS_IDX_MAGICLEN, w.fp);
+    dfs_htab_each(&ix->map, dfs_index_write_live, &w);
+    if (fflush(w.fp) != 0 || fsync(fileno(w.fp)) != 0) w.failed = 1;
+    fclose(w.fp);
+    if (w.failed || rename(tmp, ix->path) < 0) {
+        remove(tmp);
+        return -1;
+    }
+
+    // Make the rename itself durable: flush the directory holding the log
+    char dir[1100];
+    snprintf(dir, sizeof(dir), "%s", ix->path);
+    char* slash = strrchr(dir, '/');
+    if (slash) *(slash == dir ? slash + 1 : slash) = '\0';
+    if (dfs_sync_dir_now(slash ? dir : ".") < 0) perror("[index] fsync of the log's directory");
+
+    // Reload from the compacted log so every entry's gen matches its new offset
+    // (from a copy of the path: dfs_index_open rewrites ix->path)
+    printf("[index] Compacted %llu records down to %zu\n", (unsigned long long)ix->records, ix->map.count);
+    dfs_htab_each(&ix->map, dfs_index_free_meta, NULL);
+    dfs_htab_free(&ix->map);
+    close(ix->fd);
+    snprintf(tmp, sizeof(tmp), "%s", ix->path);
+    return dfs_index_open(ix, tmp);
+}
+
+#endif // DFS_INDEX_H
@@ -0,0 +1,486 @@
+// dfs_list.h
+// In-process listing engine behind dispfnames on S1 and every storage node.
+//
+// Each server keeps the relative paths of the files it can list (e.g.
+// "docs/sub/a.txt") in one array sorted with strcmp(). The array is built
+// at startup by walking the storage directory with openat() and
+// getdents64(), and the upload and remove handlers keep it current. A
+// second array holds the same paths ordered by basename, so a listing of
+// a large directory (or of everything) is one pass over it in output
+// order with no sort per query; a small directory's range is found by
+// binary search and its few basenames sorted. No shell, find or sort
+// process is involved.
+// Files copied into the directory behind the server's back appear after
+// a restart. A hash table over the same paths resolves an exact path in
+// constant time, which removef uses instead of searching the tree.
+//
+// Queries are "<dir> [-p prefix] [-o offset] [-n limit]": the names of all
+// files under <dir> (recursively), sorted, optionally only those starting
+// with `prefix` and only the `limit` names after the first `offset`.
+// Includers must build with -pthread.
+
+#ifndef DFS_LIST_H
+#define DFS_LIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "dfs_proto.h"
+#include "dfs_htab.h"
+#include "dfs_blob.h"
+
+#define DFS_LIST_DEPTH  64          // Directory levels a walk descends
+#define DFS_LIST_DIRBUF (32 * 1024) // getdents64() buffer per open directory
+
+struct dfs_list {
+    char root[1024];            // Storage directory, e.g. ~/S2
+    char ext[16];               // Only names ending in this are listed
+    char** paths;               // Relative paths, sorted
+    char** byname;              // The same strings by basename, then path (cached mode only)
+    size_t n, cap;
+    struct dfs_htab index;      // path -> its string in `paths` (cached mode only)
+    int cached;                 // 0: walk the disk on every query instead
+    pthread_rwlock_t lock;
+};
+
+struct dfs_list_query {
+    char dir[512];              // Directory relative to the root ("" = all)
+    char prefix[256];           // Only names starting with this
+    uint64_t offset;            // Skip this many names first
+    uint64_t limit;             // Return at most this many (0 = all)
+};
+
+// Record layout returned by getdents64()
+struct dfs_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static inline int dfs_list_has_ext(const struct dfs_list* l, const char* name) {
+    size_t nlen = strlen(name), elen = strlen(l->ext);
+    return nlen >= elen && strcmp(name + nlen - elen, l->ext) == 0;
+}
+
+static inline int dfs_list_cmp(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static inline const char* dfs_list_base(const char* path) {
+    const char* base = strrchr(path, '/');
+    return base ? base + 1 : path;
+}
+
+// Order of `byname`: basename first, then the whole path
+static inline int dfs_list_byname_cmp(const char* a, const char* b) {
+    int c = strcmp(dfs_list_base(a), dfs_list_base(b));
+    return c ? c : strcmp(a, b);
+}
+
+static inline int dfs_list_byname_qcmp(const void* a, const void* b) {
+    return dfs_list_byname_cmp(*(char* const*)a, *(char* const*)b);
+}
+
+// First index whose path is >= key
+static inline size_t dfs_list_lower(const struct dfs_list* l, const char* key) {
+    size_t lo = 0, hi = l->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(l->paths[mid], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// First index in `byname` whose entry is >= path in basename order
+static inline size_t dfs_list_name_lower(const struct dfs_list* l, const char* path) {
+    size_t lo = 0, hi = l->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (dfs_list_byname_cmp(l->byname[mid], path) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// First index in `byname` whose basename is >= prefix
+static inline size_t dfs_list_prefix_lower(const struct dfs_list* l, const char* prefix) {
+    size_t lo = 0, hi = l->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(dfs_list_base(l->byname[mid]), prefix) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static inline int dfs_list_reserve(struct dfs_list* l) {
+    if (l->n < l->cap) return 0;
+    size_t cap = l->cap ? l->cap * 2 : 256;
+    char** paths = realloc(l->paths, cap * sizeof(*paths));
+    if (!paths) return -1;
+    l->paths = paths;
+    if (l->cached) {
+        char** byname = realloc(l->byname, cap * sizeof(*byname));
+        if (!byname) return -1;
+        l->byname = byname;
+    }
+    l->cap = cap;
+    return 0;
+}
+
+static inline int dfs_list_push(struct dfs_list* l, const char* rel) {
+    if (dfs_list_reserve(l) < 0 || !(l->paths[l->n] = strdup(rel))) return -1;
+    l->n++;
+    return 0;
+}
+
+// Append every listable file below the open directory `dirfd`, whose path
+// relative to the root is rel[0..rlen). Entries are left unsorted.
+static inline int dfs_list_walk(struct dfs_list* l, int dirfd, char* rel, size_t rlen, int depth) {
+    char* buf = malloc(DFS_LIST_DIRBUF);
+    if (!buf) return -1;
+
+    int rc = 0;
+    long n;
+    while (rc == 0 && (n = syscall(SYS_getdents64, dirfd, buf, DFS_LIST_DIRBUF)) > 0) {
+        for (long off = 0; off < n && rc == 0; ) {
+            struct dfs_dirent64* de = (struct dfs_dirent64*)(buf + off);
+            off += de->d_reclen;
+            const char* name = de->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+            size_t nlen = strlen(name);
+            if (rlen + nlen + 2 > 4096) continue;
+
+            // d_type saves a stat for almost every entry; fall back to
+            // fstatat() on filesystems that do not fill it in
+            unsigned char type = de->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            size_t len = rlen;
+            if (len) rel[len++] = '/';
+            memcpy(rel + len, name, nlen + 1);
+
+            if (type == DT_REG && dfs_list_has_ext(l, name)) {
+                rc = dfs_list_push(l, rel);
+            } else if (type == DT_DIR && depth < DFS_LIST_DEPTH &&
+                       !(rlen == 0 && strcmp(name, DFS_BLOB_DIR) == 0)) {  // Not the blob store
+                int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd >= 0) {
+                    rc = dfs_list_walk(l, fd, rel, len + nlen, depth + 1);
+                    close(fd);
+                }
+            }
+            rel[rlen] = '\0';
+        }
+    }
+    free(buf);
+    return rc;
+}
+
+// Collect the files under root/sub (sub = "" for everything), sorted
+static inline int dfs_list_scan(struct dfs_list* l, const char* sub) {
+    char rel[4096];
+    snprintf(rel, sizeof(rel), "%s", sub);
+
+    char path[2048];
+    snprintf(path, sizeof(path), "%s%s%s", l->root, *sub ? "/" : "", sub);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        // A plain file is listed on its own, like find does
+        struct stat st;
+        if (*sub && stat(path, &st) == 0 && S_ISREG(st.st_mode) && dfs_list_has_ext(l, sub))
+            return dfs_list_push(l, sub);
+        return 0;
+    }
+
+    int rc = dfs_list_walk(l, fd, rel, strlen(rel), 0);
+    close(fd);
+    if (l->n > 1) qsort(l->paths, l->n, sizeof(*l->paths), dfs_list_cmp);
+    return rc;
+}
+
+static inline void dfs_list_free(struct dfs_list* l) {
+    dfs_htab_free(&l->index);
+    for (size_t i = 0; i < l->n; i++) free(l->paths[i]);
+    free(l->paths);
+    free(l->byname);
+    l->paths = l->byname = NULL;
+    l->n = l->cap = 0;
+}
+
+// Set up a listing of `ext` files under `root`. With `cached` set the
+// tree is walked once now and kept in memory; otherwise every query walks
+// the part of the tree it asks about (for processes that cannot see each
+// other's updates, such as S1's fork mode). Returns -1 with errno
+// ENAMETOOLONG if `root` or `ext` does not fit.
+static inline int dfs_list_open(struct dfs_list* l, const char* root, const char* ext, int cached) {
+    if (snprintf(l->root, sizeof(l->root), "%s", root) >= (int)sizeof(l->root) ||
+        snprintf(l->ext, sizeof(l->ext), "%s", ext) >= (int)sizeof(l->ext)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    l->paths = l->byname = NULL;
+    l->n = l->cap = 0;
+    l->cached = cached;
+    memset(&l->index, 0, sizeof(l->index));
+    pthread_rwlock_init(&l->lock, NULL);
+    if (!cached) return 0;
+
+    if (dfs_list_scan(l, "") < 0 || dfs_htab_init(&l->index, l->n) < 0) return -1;
+    for (size_t i = 0; i < l->n; i++)
+        dfs_htab_put(&l->index, l->paths[i], l->paths[i]);
+    if (l->n) memcpy(l->byname, l->paths, l->n * sizeof(*l->byname));
+    if (l->n > 1) qsort(l->byname, l->n, sizeof(*l->byname), dfs_list_byname_qcmp);
+    return 0;
+}
+
+// A file was stored at `rel` (a logical path, see dfs_logical_path)
+static inline void dfs_list_add(struct dfs_list* l, const char* rel) {
+    const char* base = strrchr(rel, '/');
+    if (!l->cached || !dfs_list_has_ext(l, base ? base + 1 : rel)) return;
+
+    pthread_rwlock_wrlock(&l->lock);
+    size_t i = dfs_list_lower(l, rel);
+    char* copy;
+    if ((i == l->n || strcmp(l->paths[i], rel) != 0) && dfs_list_reserve(l) == 0 && (copy = strdup(rel))) {
+        size_t j = dfs_list_name_lower(l, rel);
+        memmove(l->paths + i + 1, l->paths + i, (l->n - i) * sizeof(*l->paths));
+        memmove(l->byname + j + 1, l->byname + j, (l->n - j) * sizeof(*l->byname));
+        l->paths[i] = l->byname[j] = copy;
+        l->n++;
+        dfs_htab_put(&l->index, rel, copy);
+    }
+    pthread_rwlock_unlock(&l->lock);
+}
+
+// The file at `rel` was removed
+static inline void dfs_list_remove(struct dfs_list* l, const char* rel) {
+    if (!l->cached) return;
+    pthread_rwlock_wrlock(&l->lock);
+    size_t i = dfs_list_lower(l, rel);
+    if (dfs_htab_del(&l->index, rel) && i < l->n && strcmp(l->paths[i], rel) == 0) {
+        size_t j = dfs_list_name_lower(l, rel);
+        free(l->paths[i]);
+        memmove(l->paths + i, l->paths + i + 1, (l->n - i - 1) * sizeof(*l->paths));
+        memmove(l->byname + j, l->byname + j + 1, (l->n - j - 1) * sizeof(*l->byname));
+        l->n--;
+    }
+    pthread_rwlock_unlock(&l->lock);
+}
+
+// Is there a file at exactly `rel`? Constant time (cached mode only).
+static inline int dfs_list_contains(struct dfs_list* l, const char* rel) {
+    pthread_rwlock_rdlock(&l->lock);
+    int found = dfs_htab_get(&l->index, rel) != NULL;
+    pthread_rwlock_unlock(&l->lock);
+    return found;
+}
+
+// Delete the file at logical path `rel` if the index knows it. Returns 0
+// if it was removed, -1 if there is no such file.
+static inline int dfs_list_unlink(struct dfs_list* l, const char* rel) {
+    char path[2048];
+    if (!dfs_list_contains(l, rel) ||
+        snprintf(path, sizeof(path), "%s/%s", l->root, rel) >= (int)sizeof(path))
+        return -1;
+    int rc = dfs_blob_unlink(l->root, path);  // Plain unlink() for files without a blob
+    if (rc < 0 && errno != ENOENT) return -1;
+
+    dfs_list_remove(l, rel);    // Gone from disk (or already was), so gone from the index
+    return rc;
+}
+
+// Parse "<dir> [-p prefix] [-o offset] [-n limit]". The directory is
+// normalised with dfs_logical_path. Returns -1 if malformed.
+static inline int dfs_list_parse(const char* args, struct dfs_list_query* q) {
+    char word[512];
+    int used;
+    memset(q, 0, sizeof(*q));
+    if (sscanf(args, "%511s%n", word, &used) != 1 || dfs_logical_path(word, q->dir, sizeof(q->dir)) < 0)
+        return -1;
+
+    for (args += used; sscanf(args, "%511s%n", word, &used) == 1; args += used) {
+        char value[512];
+        int vused;
+        if (word[0] != '-' || word[2] != '\0' || sscanf(args + used, "%511s%n", value, &vused) != 1)
+            return -1;
+        used += vused;
+
+        char* end = NULL;
+        if (word[1] == 'p' && strlen(value) < sizeof(q->prefix))
+            strcpy(q->prefix, value);
+        else if (word[1] == 'o')
+            q->offset = strtoull(value, &end, 10);
+        else if (word[1] == 'n')
+            q->limit = strtoull(value, &end, 10);
+        else
+            return -1;
+        if (end && (end == value || *end != '\0')) return -1;  // Not a number
+    }
+    return 0;
+}
+
+// Write a query back out in the form dfs_list_parse accepts
+static inline void dfs_list_format(const struct dfs_list_query* q, char* out, size_t cap) {
+    int n = snprintf(out, cap, "%s", *q->dir ? q->dir : "/");
+    if (*q->prefix && n >= 0 && (size_t)n < cap) n += snprintf(out + n, cap - n, " -p %s", q->prefix);
+    if (q->offset && n >= 0 && (size_t)n < cap)
+        n += snprintf(out + n, cap - n, " -o %llu", (unsigned long long)q->offset);
+    if (q->limit && n >= 0 && (size_t)n < cap)
+        snprintf(out + n, cap - n, " -n %llu", (unsigned long long)q->limit);
+}
+
+static inline int dfs_list_name_cmp(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+// First index from `from` on whose path does not start with dir[0..dlen)
+static inline size_t dfs_list_upper(const struct dfs_list* l, size_t from, const char* dir, size_t dlen) {
+    size_t lo = from, hi = l->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(l->paths[mid], dir, dlen) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Is `p` the file or directory `dir` (dlen bytes), or below it?
+static inline int dfs_list_under(const char* p, const char* dir, size_t dlen) {
+    return strncmp(p, dir, dlen) == 0 && (p[dlen] == '/' || p[dlen] == '\0');
+}
+
+// Basenames of the files in `l` under q->dir that match q->prefix,
+// sorted, paged and joined with newlines into a malloc'd buffer
+static inline char* dfs_list_collect(const struct dfs_list* l, const struct dfs_list_query* q, size_t* len) {
+    size_t dlen = strlen(q->dir), plen = strlen(q->prefix), count = 0, cap = 64;
+    const char** names = malloc(cap * sizeof(*names));
+    if (!names) return NULL;
+
+    // Every path under dir shares its first dlen bytes, so they are contiguous
+    size_t lo = dlen ? dfs_list_lower(l, q->dir) : 0, hi = dlen ? dfs_list_upper(l, lo, q->dir, dlen) : l->n;
+
+    // A small directory's names are sorted here; any larger share of the
+    // files is read off `byname`, already in order, up to the page's end
+    int in_order = l->byname && (hi - lo) * 8 >= l->n;
+    char* const* list = in_order ? l->byname : l->paths;
+    if (in_order) {
+        lo = plen ? dfs_list_prefix_lower(l, q->prefix) : 0;
+        hi = l->n;
+    }
+    for (size_t i = lo; i < hi; i++) {
+        const char* p = list[i];
+        const char* base = dfs_list_base(p);
+        if (plen && strncmp(base, q->prefix, plen) != 0) {
+            if (in_order) break;  // Past the names starting with prefix
+            continue;
+        }
+        if (dlen && !dfs_list_under(p, q->dir, dlen)) continue;  // e.g. "docs2/" under "docs"
+        if (count == cap) {
+            const char** bigger = realloc(names, (cap *= 2) * sizeof(*names));
+            if (!bigger) { free(names); return NULL; }
+            names = bigger;
+        }
+        names[count++] = base;
+        if (in_order && q->limit && count > q->offset && count - q->offset >= q->limit) break;
+    }
+    if (!in_order) qsort(names, count, sizeof(*names), dfs_list_name_cmp);
+
+    // Apply the page and join
+    size_t first = q->offset < count ? q->offset : count;
+    size_t last = q->limit && q->limit < count - first ? first + q->limit : count;
+    size_t total = 0;
+    for (size_t i = first; i < last; i++) total += strlen(names[i]) + 1;
+    char* out = malloc(total + 1);
+    if (out) {
+        char* w = out;
+        for (size_t i = first; i < last; i++) {
+            size_t n = strlen(names[i]);
+            memcpy(w, names[i], n);
+            w[n] = '\n';
+            w += n + 1;
+        }
+        *w = '\0';
+        *len = total;
+    }
+    free(names);
+    return out;
+}
+
+// Run a query. Returns the listing ("name\n" per file) in a malloc'd,
+// NUL-terminated buffer with its length in *len, or NULL if out of memory.
+static inline char* dfs_list_query(struct dfs_list* l, const struct dfs_list_query* q, size_t* len) {
+    if (l->cached) {
+        pthread_rwlock_rdlock(&l->lock);
+        char* out = dfs_list_collect(l, q, len);
+        pthread_rwlock_unlock(&l->lock);
+        return out;
+    }
+
+    // Uncached: walk just the requested subtree
+    struct dfs_list tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    memcpy(tmp.root, l->root, sizeof(tmp.root));
+    memcpy(tmp.ext, l->ext, sizeof(tmp.ext));
+    char* out = NULL;
+    if (dfs_list_scan(&tmp, q->dir) == 0)
+        out = dfs_list_collect(&tmp, q, len);
+    dfs_list_free(&tmp);
+    return out;
+}
+
+// Merge `n` listings as dfs_list_query returns them (from the several
+// nodes holding one extension) into one sorted listing of the same form.
+// The inputs are cut into lines in place. Returns NULL if out of memory.
+static inline char* dfs_list_merge(char** lists, int n, size_t* len) {
+    size_t count = 0, total = 0;
+    for (int i = 0; i < n; i++)
+        for (const char* p = lists[i]; p && *p; p++) count += *p == '\n';
+    const char** names = malloc((count + 1) * sizeof(*names));
+    if (!names) return NULL;
+
+    count = 0;
+    for (int i = 0; i < n; i++) {
+        char* save = NULL;
+        for (char* name = lists[i] ? strtok_r(lists[i], "\n", &save) : NULL; name;
+             name = strtok_r(NULL, "\n", &save)) {
+            names[count++] = name;
+            total += strlen(name) + 1;
+        }
+    }
+    qsort(names, count, sizeof(*names), dfs_list_name_cmp);
+
+    char* out = malloc(total + 1);
+    if (out) {
+        char* w = out;
+        for (size_t i = 0; i < count; i++) {
+            size_t k = strlen(names[i]);
+            memcpy(w, names[i], k);
+            w[k] = '\n';
+            w += k + 1;
+        }
+        *w = '\0';
+        *len = total;
+    }
+    free(names);
+    return out;
+}
+
+#endif // DFS_LIST_H
@@ -0,0 +1,139 @@
+// dfs_lz4.h
+// Block compressor for .txt and .c transfers (see "Compression" in dfs_proto.h).
+//
+// Blocks use the LZ4 block format: a run of sequences, each a token byte
+// (literal count in the high nibble, match length - 4 in the low one; 15
+// means more length bytes follow, each adding up to 255), the literals,
+// then a 2-byte little-endian offset back into the output. The last
+// sequence is literals only, and covers at least the last 5 bytes. The
+// compressor is the simple greedy one: a hash of the next 4 bytes finds
+// the last place they were seen, with no search for longer matches. That
+// keeps it well above network speed on source code and text, which is all
+// it is used for.
+//
+// Nothing outside libc is needed; blocks are at most DFS_LZ4_BLOCK bytes,
+// so every offset fits the 64 KiB window.
+
+#ifndef DFS_LZ4_H
+#define DFS_LZ4_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define DFS_LZ4_BLOCK (64 * 1024)                           // Largest block, uncompressed
+#define DFS_LZ4_BOUND(n) ((n) + (n) / 255 + 16)             // Worst-case compressed size
+#define DFS_LZ4_HASH_BITS 12
+
+static inline uint32_t dfs_lz4_read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline unsigned char* dfs_lz4_length(unsigned char* op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// Compress `n` bytes (n <= DFS_LZ4_BLOCK) into `dst` of `cap` bytes.
+// Returns the compressed size, or -1 if it does not fit.
+static inline int dfs_lz4_compress(const unsigned char* src, size_t n, unsigned char* dst, size_t cap) {
+    uint16_t table[1 << DFS_LZ4_HASH_BITS] = {0};  // Last position (in src) each hash was seen at
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    // Matches start at least 12 bytes before the end and stop 5 before it
+    if (n >= 13) {
+        const unsigned char *mflimit = end - 12, *matchlimit = end - 5;
+        for (ip++; ip < mflimit; ) {
+            uint32_t seq = dfs_lz4_read32(ip);
+            uint32_t h = (seq * 2654435761u) >> (32 - DFS_LZ4_HASH_BITS);
+            const unsigned char* ref = src + table[h];
+            table[h] = (uint16_t)(ip - src);
+            if (ref >= ip || dfs_lz4_read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char* p = ip + 4;
+            for (const unsigned char* q = ref + 4; p < matchlimit && *p == *q; p++, q++)
+                ;
+
+            size_t lit = ip - anchor, mlen = p - ip - 4;
+            if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return -1;
+            unsigned char* token = op++;
+            *token = (unsigned char)((lit < 15 ? lit : 15) << 4 | (mlen < 15 ? mlen : 15));
+            if (lit >= 15) op = dfs_lz4_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            size_t off = ip - ref;
+            *op++ = (unsigned char)off;
+            *op++ = (unsigned char)(off >> 8);
+            if (mlen >= 15) op = dfs_lz4_length(op, mlen - 15);
+            ip = anchor = p;
+        }
+    }
+
+    // The rest goes out as literals
+    size_t lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return -1;
+    *op++ = (unsigned char)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op = dfs_lz4_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return (int)(op - dst);
+}
+
+// Decompress the `n`-byte block `src` into `dst` of `cap` bytes. Every
+// length and offset is checked, so a damaged block fails instead of
+// writing out of bounds. Returns the decompressed size, or -1.
+static inline int dfs_lz4_decompress(const unsigned char* src, size_t n, unsigned char* dst, size_t cap) {
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                lit += b = *ip++;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;  // Final, literals-only sequence
+
+        if (iend - ip < 2) return -1;
+        size_t off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                mlen += b = *ip++;
+            } while (b == 255);
+        }
+        mlen += 4;
+        if (mlen > (size_t)(oend - op)) return -1;
+
+        // Byte by byte: the match may overlap what it is copying (runs)
+        const unsigned char* m = op - off;
+        for (size_t i = 0; i < mlen; i++) op[i] = m[i];
+        op += mlen;
+    }
+    return (int)(op - dst);
+}
+
+#endif // DFS_LZ4_H
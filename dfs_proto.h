@@ -0,0 +1,989 @@
+// dfs_proto.h
+// Wire protocol shared by S1, the storage nodes and w25clients.
+//
+// Every message on every connection is a frame: a fixed 16-byte header
+// followed by exactly `length` payload bytes.
+//
+//   byte 0      opcode      (DFS_OP_*)
+//   byte 1      flags       (DFS_FLAG_*; zero unless noted)
+//   bytes 2-3   reserved    (zero)
+//   bytes 4-7   request id  (echoed back in every reply frame)
+//   bytes 8-15  payload length, 64-bit
+//
+// All integers are big-endian. Command frames carry their arguments as
+// text in the payload (e.g. "report.pdf ~S1/reports" for uploadf). File
+// contents travel in a DFS_OP_DATA frame whose length is the file size, so
+// receivers know exactly how many bytes to expect and never scan the data.
+// A DATA frame flagged DFS_FLAG_CSUM ends with the file's CRC32C (see
+// "Checksums" below); one flagged DFS_FLAG_LZ4 is compressed and may be
+// continued in further frames (see "Compression").
+//
+// Files including this header must define _GNU_SOURCE before their first
+// system #include (needed for splice()).
+
+#ifndef DFS_PROTO_H
+#define DFS_PROTO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "dfs_csum.h"
+#include "dfs_sha256.h"
+#include "dfs_lz4.h"
+
+#define DFS_HDR_SIZE 16
+#define DFS_IO_CHUNK (64 * 1024)        // Bytes moved per read/send when streaming data
+#define DFS_MAX_TEXT (1024 * 1024)      // Largest text payload a receiver will buffer
+#define DFS_PIPE_SIZE (1024 * 1024)     // Pipe capacity requested for splice() relays
+#define DFS_CHUNK_SIZE (1024 * 1024)    // Granularity at which interrupted uploads resume
+#define DFS_WRITE_BLOCK (1024 * 1024)   // Received file data reaches the disk in writes this large
+
+// ----------------------------
+// Opcodes
+// ----------------------------
+// Requests (client -> S1, S1 -> storage nodes)
+#define DFS_OP_UPLOADF    0x01  // "<filename> <dest> [offset [size]]", followed by a
+                                // DATA frame holding the file from `offset` on
+                                // (size: the file's size, given for delta and
+                                // compressed uploads)
+#define DFS_OP_DOWNLF     0x02  // "<path> [offset [length]]"; length 0 = to the end.
+                                // Flagged DFS_FLAG_LZ4: a compressed reply is welcome
+#define DFS_OP_REMOVEF    0x03  // "<path>"
+#define DFS_OP_DISPFNAMES 0x04  // "<pathname>"
+#define DFS_OP_DOWNLTAR   0x05  // "<.ext>"; S1 asks a node for "<.ext> members" when
+                                // it joins several nodes' archives (see dfs_tar.h)
+#define DFS_OP_RESUME     0x06  // "<filename> <dest>"; OK reply is the offset an
+                                // interrupted upload may continue from
+#define DFS_OP_STAT       0x07  // "<path>"; OK reply is the file's size in bytes
+#define DFS_OP_CHUNKS     0x08  // "<filename> <dest>"; OK reply is the binary chunk
+                                // digests of the stored copy (see dfs_delta.h)
+
+// Replies
+#define DFS_OP_OK         0x40  // Success; payload is a message for the user
+#define DFS_OP_ERR        0x41  // Failure; payload is the error text
+#define DFS_OP_DATA       0x42  // Raw file contents
+
+// Flags
+#define DFS_FLAG_MORE     0x01  // On a reply: further reply frames for the same
+                                // request follow (dispfnames streams its listing)
+#define DFS_FLAG_CSUM     0x02  // On DATA: the last DFS_CSUM_SIZE payload bytes are
+                                // the CRC32C of the whole file, not file data
+#define DFS_FLAG_DELTA    0x04  // On an upload's DATA: only changed chunks follow
+                                // (see dfs_delta.h)
+#define DFS_FLAG_LZ4      0x08  // On DATA: one compressed block; with DFS_FLAG_MORE,
+                                // more DATA frames of the same file follow
+
+struct dfs_hdr {
+    uint8_t  opcode;
+    uint8_t  flags;
+    uint32_t request_id;
+    uint64_t length;
+};
+
+// Turn a client path like "~S1/reports//q1.pdf" into its logical form
+// "reports/q1.pdf", which is how every server names the file relative to
+// its storage directory: drops the ~S1 root and leading, trailing or
+// doubled slashes. Returns -1 if the path is too long or climbs out with "..".
+static inline int dfs_logical_path(const char* in, char* key, size_t cap) {
+    if (in[0] == '~') {
+        in = strchr(in, '/');
+        if (!in) in = "";
+    }
+
+    size_t n = 0;
+    for (; *in; in++) {
+        if (*in == '/' && (n == 0 || key[n - 1] == '/')) continue;
+        if (n + 1 >= cap) return -1;
+        key[n++] = *in;
+    }
+    if (n > 0 && key[n - 1] == '/') n--;
+    key[n] = '\0';
+
+    // Reject any ".." component
+    for (const char* c = key; (c = strstr(c, "..")) != NULL; c += 2) {
+        if ((c == key || c[-1] == '/') && (c[2] == '\0' || c[2] == '/'))
+            return -1;
+    }
+    return 0;
+}
+
+// Map a command word typed by the user to its opcode (0 if unknown)
+static inline int dfs_opcode_for(const char* word) {
+    if (strcmp(word, "uploadf") == 0)    return DFS_OP_UPLOADF;
+    if (strcmp(word, "downlf") == 0)     return DFS_OP_DOWNLF;
+    if (strcmp(word, "removef") == 0)    return DFS_OP_REMOVEF;
+    if (strcmp(word, "dispfnames") == 0) return DFS_OP_DISPFNAMES;
+    if (strcmp(word, "downltar") == 0)   return DFS_OP_DOWNLTAR;
+    return 0;
+}
+
+// ----------------------------
+// Low-level socket helpers
+// ----------------------------
+
+// Send all `len` bytes, retrying on short writes. Returns 0 or -1.
+static inline int dfs_send_all(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Receive exactly `len` bytes. Returns 0, or -1 on error / early close.
+static inline int dfs_recv_all(int fd, void* buf, size_t len) {
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// ----------------------------
+// Frame helpers
+// ----------------------------
+
+static inline void dfs_encode_hdr(unsigned char out[DFS_HDR_SIZE], uint8_t op, uint8_t flags,
+                                  uint32_t id, uint64_t len) {
+    uint32_t id_be = htobe32(id);
+    uint64_t len_be = htobe64(len);
+    out[0] = op;
+    out[1] = flags;
+    out[2] = out[3] = 0;
+    memcpy(out + 4, &id_be, 4);
+    memcpy(out + 8, &len_be, 8);
+}
+
+static inline int dfs_send_hdr(int fd, uint8_t op, uint8_t flags, uint32_t id, uint64_t len) {
+    unsigned char raw[DFS_HDR_SIZE];
+    dfs_encode_hdr(raw, op, flags, id, len);
+    return dfs_send_all(fd, raw, sizeof(raw));
+}
+
+// Read the next frame header. Returns 0, or -1 if the peer closed.
+static inline int dfs_recv_hdr(int fd, struct dfs_hdr* h) {
+    unsigned char raw[DFS_HDR_SIZE];
+    uint32_t id_be;
+    uint64_t len_be;
+    if (dfs_recv_all(fd, raw, sizeof(raw)) < 0) return -1;
+    h->opcode = raw[0];
+    h->flags = raw[1];
+    memcpy(&id_be, raw + 4, 4);
+    memcpy(&len_be, raw + 8, 8);
+    h->request_id = be32toh(id_be);
+    h->length = be64toh(len_be);
+    return 0;
+}
+
+// Send a complete frame (header + in-memory payload) in one call
+static inline int dfs_send_frame(int fd, uint8_t op, uint8_t flags, uint32_t id,
+                                 const void* payload, size_t len) {
+    unsigned char raw[DFS_HDR_SIZE];
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t total = DFS_HDR_SIZE + len, sent = 0;
+
+    dfs_encode_hdr(raw, op, flags, id, len);
+    iov[0].iov_base = raw;
+    iov[0].iov_len = DFS_HDR_SIZE;
+    iov[1].iov_base = (void*)payload;
+    iov[1].iov_len = len;
+
+    // sendmsg may write only part of the frame; fall back to send_all for the rest
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return -1;
+    sent = n;
+    if (sent < DFS_HDR_SIZE) {
+        if (dfs_send_all(fd, raw + sent, DFS_HDR_SIZE - sent) < 0) return -1;
+        sent = DFS_HDR_SIZE;
+    }
+    if (sent < total)
+        return dfs_send_all(fd, (const char*)payload + (sent - DFS_HDR_SIZE), total - sent);
+    return 0;
+}
+
+// Send a text frame (OK/ERR reply or command arguments)
+static inline int dfs_send_text(int fd, uint8_t op, uint32_t id, const char* text) {
+    return dfs_send_frame(fd, op, 0, id, text, strlen(text));
+}
+
+// Discard `len` payload bytes (used to skip a frame we can't accept)
+static inline int dfs_drain(int fd, uint64_t len) {
+    char buf[DFS_IO_CHUNK];
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        if (dfs_recv_all(fd, buf, want) < 0) return -1;
+        len -= want;
+    }
+    return 0;
+}
+
+// Discard the file DATA frame `h` announces, with the frames continuing it
+// if it is compressed. Returns 0, or -1 if the socket failed.
+static inline int dfs_drain_data(int fd, const struct dfs_hdr* h) {
+    struct dfs_hdr next = *h;
+    for (;;) {
+        if (dfs_drain(fd, next.length) < 0) return -1;
+        if (!(next.flags & DFS_FLAG_MORE)) return 0;
+        if (dfs_recv_hdr(fd, &next) < 0 || next.opcode != DFS_OP_DATA) return -1;
+    }
+}
+
+// Read a text payload into `buf` and NUL-terminate it.
+// Payloads that don't fit are drained and reported as an error.
+static inline int dfs_recv_text(int fd, const struct dfs_hdr* h, char* buf, size_t cap) {
+    if (h->length >= cap) {
+        dfs_drain(fd, h->length);
+        return -1;
+    }
+    if (dfs_recv_all(fd, buf, h->length) < 0) return -1;
+    buf[h->length] = '\0';
+    return 0;
+}
+
+// Read a text payload of any size (up to DFS_MAX_TEXT) into a malloc'd,
+// NUL-terminated buffer. Returns NULL on error; the caller frees the result.
+static inline char* dfs_recv_text_alloc(int fd, const struct dfs_hdr* h) {
+    if (h->length > DFS_MAX_TEXT) {
+        dfs_drain(fd, h->length);
+        return NULL;
+    }
+    char* buf = malloc(h->length + 1);
+    if (!buf) {
+        dfs_drain(fd, h->length);
+        return NULL;
+    }
+    if (dfs_recv_all(fd, buf, h->length) < 0) {
+        free(buf);
+        return NULL;
+    }
+    buf[h->length] = '\0';
+    return buf;
+}
+
+// ----------------------------
+// Bulk data helpers
+// ----------------------------
+
+// Copy `len` bytes from `fd` to `sock` through a user-space buffer.
+// Fallback for file types sendfile() can't read from.
+static inline int dfs_send_fd_copy(int sock, int fd, uint64_t len) {
+    char buf[DFS_IO_CHUNK];
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t n = read(fd, buf, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;   // File shrank under us; caller must drop the connection
+        if (dfs_send_all(sock, buf, n) < 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Stream `len` bytes from file descriptor `fd` (at its current offset) to
+// socket `sock`. Uses sendfile() so the data goes from the page cache to
+// the socket without passing through user space.
+static inline int dfs_send_fd(int sock, int fd, uint64_t len) {
+    int first = 1;
+    while (len > 0) {
+        size_t want = len < (1u << 30) ? len : (1u << 30);
+        ssize_t n = sendfile(sock, fd, NULL, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && first && (errno == EINVAL || errno == ENOSYS))
+            return dfs_send_fd_copy(sock, fd, len);
+        if (n <= 0) return -1;   // Socket error, or the file shrank under us
+        len -= n;
+        first = 0;
+    }
+    return 0;
+}
+
+// Writer for received file data: bytes are gathered in a DFS_WRITE_BLOCK
+// buffer and written out when it is full, at file offsets that are
+// multiples of the block size, so a large upload reaches the disk in few
+// big aligned writes rather than one small write per recv(). With the
+// space reserved up front (dfs_part_open) that keeps stored files
+// contiguous on disk. If the buffer cannot be allocated, a small one
+// inside the writer is used.
+struct dfs_writer {
+    int fd;
+    char* buf;
+    size_t block;               // Size of buf
+    size_t used;                // Bytes buffered
+    size_t room;                // Bytes that fit before the next aligned boundary
+    int failed;                 // A write failed; later data is dropped
+    char* heap;                 // buf, if malloc'd
+    char spare[DFS_IO_CHUNK];
+};
+
+// Start buffering writes to `fd`, from its current offset on
+static inline void dfs_writer_init(struct dfs_writer* w, int fd) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    w->fd = fd;
+    w->heap = malloc(DFS_WRITE_BLOCK);
+    w->buf = w->heap ? w->heap : w->spare;
+    w->block = w->heap ? DFS_WRITE_BLOCK : sizeof(w->spare);
+    w->used = 0;
+    w->room = w->block - (pos > 0 ? (uint64_t)pos % w->block : 0);
+    w->failed = 0;
+}
+
+static inline void dfs_writer_flush(struct dfs_writer* w) {
+    for (char* p = w->buf; w->used > 0 && !w->failed; ) {
+        ssize_t n = write(w->fd, p, w->used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            w->failed = 1;
+            break;
+        }
+        p += n;
+        w->used -= n;
+    }
+    w->used = 0;
+    w->room = w->block;
+}
+
+// Where the next bytes go: fill up to *n bytes there, then commit them
+static inline char* dfs_writer_space(struct dfs_writer* w, size_t* n) {
+    *n = w->room - w->used;
+    return w->buf + w->used;
+}
+
+static inline void dfs_writer_commit(struct dfs_writer* w, size_t n) {
+    w->used += n;
+    if (w->used == w->room) dfs_writer_flush(w);
+}
+
+// Append `n` bytes
+static inline void dfs_writer_put(struct dfs_writer* w, const void* data, size_t n) {
+    const char* p = data;
+    while (n > 0) {
+        size_t fit;
+        char* dst = dfs_writer_space(w, &fit);
+        if (fit > n) fit = n;
+        memcpy(dst, p, fit);
+        dfs_writer_commit(w, fit);
+        p += fit;
+        n -= fit;
+    }
+}
+
+// Write out the rest and free the buffer. Returns -1 if any write failed.
+static inline int dfs_writer_finish(struct dfs_writer* w) {
+    dfs_writer_flush(w);
+    free(w->heap);
+    return w->failed ? -1 : 0;
+}
+
+// Receive `len` bytes from socket `sock` straight into the writer's
+// buffer, extending the CRC32C in *crc and the SHA-256 in *sha (either may
+// be NULL) with every byte as it arrives. If a write fails the rest of the
+// payload is still drained so the stream stays in sync; returns -1 in that
+// case, -2 if the socket itself failed.
+static inline int dfs_recv_to_writer(int sock, struct dfs_writer* w, uint64_t len, uint32_t* crc,
+                                     struct dfs_sha256* sha) {
+    while (len > 0) {
+        size_t want;
+        char* buf = dfs_writer_space(w, &want);
+        if (want > len) want = len;
+        ssize_t n = recv(sock, buf, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -2;
+        len -= n;
+        if (crc) *crc = dfs_crc32c(*crc, buf, n);
+        if (sha) dfs_sha256_update(sha, buf, n);
+        dfs_writer_commit(w, n);
+    }
+    return w->failed ? -1 : 0;
+}
+
+// Receive `len` bytes from socket `sock` and write them to file descriptor
+// `fd` (at its current offset) in DFS_WRITE_BLOCK writes, checksumming as
+// dfs_recv_to_writer does. What arrived before a socket failure is still
+// written, so an interrupted upload can resume after it.
+// Returns 0, -1 if writing failed, -2 if the socket failed.
+static inline int dfs_recv_to_fd_csum(int sock, int fd, uint64_t len, uint32_t* crc, struct dfs_sha256* sha) {
+    struct dfs_writer w;
+    dfs_writer_init(&w, fd);
+    int rc = dfs_recv_to_writer(sock, &w, len, crc, sha);
+    int written = dfs_writer_finish(&w);
+    return rc == -2 ? -2 : rc < 0 || written < 0 ? -1 : 0;
+}
+
+static inline int dfs_recv_to_fd(int sock, int fd, uint64_t len) {
+    return dfs_recv_to_fd_csum(sock, fd, len, NULL, NULL);
+}
+
+// Like dfs_recv_to_fd, but write the bytes at `offset` with pwrite(), so
+// several threads can fill different ranges of one file through one
+// descriptor (striped downloads).
+static inline int dfs_recv_to_fd_at(int sock, int fd, uint64_t offset, uint64_t len) {
+    char buf[DFS_IO_CHUNK];
+    int write_failed = 0;
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t n = recv(sock, buf, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -2;
+        len -= n;
+        if (write_failed) continue;
+        for (char* p = buf; n > 0; ) {
+            ssize_t w = pwrite(fd, p, n, offset);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) { write_failed = 1; break; }
+            p += w;
+            n -= w;
+            offset += w;
+        }
+    }
+    return write_failed ? -1 : 0;
+}
+
+// Relay failure after the destination broke: either keep reading the source
+// so its stream stays in sync (returns -1), or give up on it too (-2).
+static inline int dfs_relay_dest_failed(int from, uint64_t left, int drain) {
+    if (!drain) return -2;
+    return dfs_drain(from, left) < 0 ? -2 : -1;
+}
+
+// Copy `len` payload bytes from one socket to another through a buffer
+static inline int dfs_relay_copy(int from, int to, uint64_t len, int drain) {
+    char buf[DFS_IO_CHUNK];
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t n = recv(from, buf, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -2;
+        len -= n;
+        if (dfs_send_all(to, buf, n) < 0) return dfs_relay_dest_failed(from, len, drain);
+    }
+    return 0;
+}
+
+// Move `len` payload bytes from one socket to another (S1 relaying between
+// the client and S2/S3/S4). splice() moves the data socket -> pipe -> socket
+// inside the kernel, so relayed bytes never enter user space. The pipe is
+// the only buffer: when the destination is slow, splice() blocks and TCP
+// flow control pushes back on the source.
+//
+// Returns 0 on success, -2 if the source failed. If the destination fails,
+// the rest of the payload is drained from the source when `drain` is set
+// (returns -1, source still usable); otherwise returns -2 immediately.
+static inline int dfs_relay(int from, int to, uint64_t len, int drain) {
+    int p[2];
+    if (len == 0) return 0;
+    if (pipe2(p, O_CLOEXEC) < 0) return dfs_relay_copy(from, to, len, drain);
+    fcntl(p[1], F_SETPIPE_SZ, DFS_PIPE_SIZE);  // Best effort; default is 64 KiB
+
+    int rc = 0, first = 1;
+    while (len > 0) {
+        size_t want = len < DFS_PIPE_SIZE ? len : DFS_PIPE_SIZE;
+        ssize_t in = splice(from, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0 && first && errno == EINVAL) {  // splice unsupported here
+            close(p[0]);
+            close(p[1]);
+            return dfs_relay_copy(from, to, len, drain);
+        }
+        if (in <= 0) { rc = -2; break; }
+        first = 0;
+        len -= in;
+
+        // Empty the pipe into the destination before reading more
+        while (in > 0) {
+            ssize_t out = splice(p[0], NULL, to, NULL, in, SPLICE_F_MOVE | (len ? SPLICE_F_MORE : 0));
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) { rc = -1; break; }
+            in -= out;
+        }
+        if (rc < 0) {
+            rc = dfs_relay_dest_failed(from, len, drain);
+            break;
+        }
+    }
+
+    close(p[0]);
+    close(p[1]);
+    return rc;
+}
+
+// ----------------------------
+// Byte ranges and resumable uploads
+// ----------------------------
+
+// Clamp the range [*offset, *offset + *len) to a file of `size` bytes.
+// A zero length means "to the end of the file".
+static inline void dfs_clip_range(uint64_t size, uint64_t* offset, uint64_t* len) {
+    if (*offset > size) *offset = size;
+    if (*len == 0 || *len > size - *offset) *len = size - *offset;
+}
+
+// Stream `len` bytes of `fd` starting at `offset` to `sock`. sendfile()
+// reads at the given offset, so the descriptor's own offset is untouched.
+static inline int dfs_send_fd_at(int sock, int fd, uint64_t offset, uint64_t len) {
+    off_t off = offset;
+    int first = 1;
+    while (len > 0) {
+        size_t want = len < (1u << 30) ? len : (1u << 30);
+        ssize_t n = sendfile(sock, fd, &off, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && first && (errno == EINVAL || errno == ENOSYS))
+            return lseek(fd, off, SEEK_SET) < 0 ? -1 : dfs_send_fd_copy(sock, fd, len);
+        if (n <= 0) return -1;
+        len -= n;
+        first = 0;
+    }
+    return 0;
+}
+
+// An upload is received into "<dir>/.<name>.part" and renamed to
+// "<dir>/<name>" once every byte is in, so a half-received file is never
+// served. If the connection drops, the part file stays behind and the
+// sender may continue where it stopped (DFS_OP_RESUME, then UPLOADF with
+// an offset). Returns -1 if the path does not fit.
+static inline int dfs_part_path(char* out, size_t cap, const char* dir, const char* name) {
+    int n = snprintf(out, cap, "%s/.%s.part", dir, name);
+    if (n >= 0 && (size_t)n < cap) return 0;
+    errno = ENAMETOOLONG;
+    return -1;
+}
+
+// Where an interrupted upload may resume: the part file's size, rounded
+// down to a whole chunk so a torn final write is sent again. 0 if none.
+static inline uint64_t dfs_part_resume(const char* part) {
+    struct stat st;
+    if (stat(part, &st) < 0 || !S_ISREG(st.st_mode)) return 0;
+    return (uint64_t)st.st_size / DFS_CHUNK_SIZE * DFS_CHUNK_SIZE;
+}
+
+// Open the part file to receive bytes from `offset` on: anything past
+// `offset` is cut off and the descriptor is left positioned there. A fresh
+// upload (offset 0) starts an empty file. Returns -1 (errno EINVAL) if the
+// part file holds fewer than `offset` bytes.
+//
+// `size` is the finished file's size if known (0 if not). The space up to
+// it is reserved with fallocate(), without changing the file's size (a
+// resume still goes by the bytes actually received). The file system can
+// then lay a large upload out in one piece, and a disk too full for it
+// fails here (errno ENOSPC) rather than midway. File systems without
+// fallocate() just skip the reservation.
+static inline int dfs_part_open(const char* part, uint64_t offset, uint64_t size) {
+    int fd = open(part, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < offset) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if (ftruncate(fd, offset) < 0 || lseek(fd, offset, SEEK_SET) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (size > offset && fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, size - offset) < 0 && errno == ENOSPC) {
+        close(fd);
+        errno = ENOSPC;
+        return -1;
+    }
+    return fd;
+}
+
+// ----------------------------
+// Page cache policy for stored files
+// ----------------------------
+// Small files go out with plain sendfile() and stay in the page cache,
+// where serving them again is cheap. A transfer of dfs_read_policy.
+// stream_min bytes or more is a stream: the kernel is told it will be
+// read sequentially, the next window is read ahead while the current one
+// is sent, and pages a window behind are dropped, so streaming one huge
+// .zip does not evict the small hot files. From dfs_read_policy.direct_min
+// bytes on (if set) the file is read with O_DIRECT into an aligned buffer
+// instead and never enters the page cache. Each storage server takes both
+// thresholds from its command line.
+
+#define DFS_STREAM_WINDOW (8 * 1024 * 1024)  // Read-ahead / drop-behind step of a stream
+#define DFS_DIRECT_ALIGN 4096                 // Offset and size alignment O_DIRECT needs
+#define DFS_DIRECT_BUF (1024 * 1024)          // Bytes per O_DIRECT read
+
+struct dfs_read_policy {
+    uint64_t stream_min;        // Read ahead and drop behind from this length on
+    uint64_t direct_min;        // Bypass the page cache from this length on (0 = never)
+};
+
+static struct dfs_read_policy dfs_read_policy = { 4 * DFS_STREAM_WINDOW, 0 };
+
+// Send [offset, offset + len) of `fd` as a stream (see above)
+static inline int dfs_send_stream(int sock, int fd, uint64_t offset, uint64_t len) {
+    uint64_t end = offset + len, dropped = offset;
+    posix_fadvise(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+    readahead(fd, offset, DFS_STREAM_WINDOW);
+    while (offset < end) {
+        uint64_t n = end - offset < DFS_STREAM_WINDOW ? end - offset : DFS_STREAM_WINDOW;
+        if (offset + n < end) readahead(fd, offset + n, DFS_STREAM_WINDOW);
+        if (dfs_send_fd_at(sock, fd, offset, n) < 0) return -1;
+        offset += n;
+
+        // The last window sent may still be queued on the socket; drop the one before
+        if (offset - dropped > DFS_STREAM_WINDOW) {
+            posix_fadvise(fd, dropped, offset - DFS_STREAM_WINDOW - dropped, POSIX_FADV_DONTNEED);
+            dropped = offset - DFS_STREAM_WINDOW;
+        }
+    }
+    posix_fadvise(fd, dropped, end - dropped, POSIX_FADV_DONTNEED);
+    return 0;
+}
+
+// Send [offset, offset + len) of `fd` through an aligned buffer with
+// O_DIRECT set on it for the duration. Returns 0, -1 on error, or 1 if
+// the file system does not do O_DIRECT (nothing has been sent then).
+static inline int dfs_send_direct(int sock, int fd, uint64_t offset, uint64_t len) {
+    int flags = fcntl(fd, F_GETFL);
+    void* buf = NULL;
+    if (flags < 0 || posix_memalign(&buf, DFS_DIRECT_ALIGN, DFS_DIRECT_BUF) != 0) return 1;
+    if (fcntl(fd, F_SETFL, flags | O_DIRECT) < 0) {
+        free(buf);
+        return 1;
+    }
+
+    int rc = 0, first = 1;
+    while (len > 0 && rc == 0) {
+        // Read whole aligned blocks around the range; a read at the end of the file may come up short
+        uint64_t start = offset & ~(uint64_t)(DFS_DIRECT_ALIGN - 1), skip = offset - start;
+        uint64_t want = (skip + len + DFS_DIRECT_ALIGN - 1) & ~(uint64_t)(DFS_DIRECT_ALIGN - 1);
+        if (want > DFS_DIRECT_BUF) want = DFS_DIRECT_BUF;
+        ssize_t n = pread(fd, buf, want, start);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && first && errno == EINVAL) rc = 1;
+        else if (n <= (ssize_t)skip) rc = -1;   // Read error, or the file shrank under us
+        else {
+            uint64_t take = (uint64_t)n - skip < len ? (uint64_t)n - skip : len;
+            if (dfs_send_all(sock, (char*)buf + skip, take) < 0) rc = -1;
+            offset += take;
+            len -= take;
+        }
+        first = 0;
+    }
+    fcntl(fd, F_SETFL, flags);
+    free(buf);
+    return rc;
+}
+
+// Send [offset, offset + len) of a stored file under the policy above
+static inline int dfs_send_file_at(int sock, int fd, uint64_t offset, uint64_t len) {
+    if (dfs_read_policy.direct_min && len >= dfs_read_policy.direct_min) {
+        int rc = dfs_send_direct(sock, fd, offset, len);
+        if (rc <= 0) return rc;
+    }
+    if (len >= dfs_read_policy.stream_min) return dfs_send_stream(sock, fd, offset, len);
+    return dfs_send_fd_at(sock, fd, offset, len);
+}
+
+// ----------------------------
+// Checksums
+// ----------------------------
+// Every file carries a CRC32C of its whole contents. The receiver of an
+// upload computes it as the bytes stream in, checks it against the
+// sender's, and stores it with the file in an extended attribute, so a
+// download can send it along without reading the file again. A DATA frame
+// carrying it has DFS_FLAG_CSUM set and the checksum as its last 4 bytes
+// (big-endian); S1 relays such frames untouched. Files without a stored
+// checksum (e.g. on a file system without xattrs) go out without one.
+
+#define DFS_CSUM_SIZE 4
+#define DFS_CSUM_XATTR "user.dfs.crc32c"
+
+// Does this DATA frame end with a checksum trailer?
+static inline int dfs_has_csum(const struct dfs_hdr* h) {
+    return (h->flags & DFS_FLAG_CSUM) && h->length >= DFS_CSUM_SIZE;
+}
+
+// Number of file bytes in a DATA frame, i.e. without its trailer
+static inline uint64_t dfs_body_len(const struct dfs_hdr* h) {
+    return dfs_has_csum(h) ? h->length - DFS_CSUM_SIZE : h->length;
+}
+
+static inline int dfs_send_csum(int sock, uint32_t crc) {
+    uint32_t be = htobe32(crc);
+    return dfs_send_all(sock, &be, sizeof(be));
+}
+
+// Read the trailer of DATA frame `h` once its body is in.
+// Returns 1 with the checksum in *crc, 0 if the frame has none, -1 on error.
+static inline int dfs_recv_csum(int sock, const struct dfs_hdr* h, uint32_t* crc) {
+    uint32_t be;
+    if (!dfs_has_csum(h)) return 0;
+    if (dfs_recv_all(sock, &be, sizeof(be)) < 0) return -1;
+    *crc = be32toh(be);
+    return 1;
+}
+
+// Extend *crc (and *sha, if not NULL) with bytes [offset, offset + len) of `fd`
+static inline int dfs_sum_file(int fd, uint64_t offset, uint64_t len, uint32_t* crc, struct dfs_sha256* sha) {
+    char buf[DFS_IO_CHUNK];
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        *crc = dfs_crc32c(*crc, buf, n);
+        if (sha) dfs_sha256_update(sha, buf, n);
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// CRC32C of bytes [offset, offset + len) of `fd`, extending *crc
+static inline int dfs_crc32c_file(int fd, uint64_t offset, uint64_t len, uint32_t* crc) {
+    return dfs_sum_file(fd, offset, len, crc, NULL);
+}
+
+// Stored checksum of the file open on `fd`. Returns 0, or -1 if it has none.
+static inline int dfs_csum_load(int fd, uint32_t* crc) {
+    char text[16];
+    ssize_t n = fgetxattr(fd, DFS_CSUM_XATTR, text, sizeof(text) - 1);
+    if (n <= 0) return -1;
+    text[n] = '\0';
+    char* end;
+    unsigned long v = strtoul(text, &end, 16);
+    if (*end != '\0') return -1;
+    *crc = (uint32_t)v;
+    return 0;
+}
+
+// Store `crc` with the file open on `fd` (best effort)
+static inline int dfs_csum_store(int fd, uint32_t crc) {
+    char text[16];
+    int n = snprintf(text, sizeof(text), "%08x", crc);
+    return fsetxattr(fd, DFS_CSUM_XATTR, text, n, 0);
+}
+
+// Send bytes [offset, offset + len) of `fd` as a DATA frame, followed by
+// the file's checksum *crc (no trailer if `crc` is NULL). The bytes are
+// read under the page cache policy.
+static inline int dfs_send_range(int sock, uint32_t id, int fd, uint64_t offset, uint64_t len, const uint32_t* crc) {
+    if (dfs_send_hdr(sock, DFS_OP_DATA, crc ? DFS_FLAG_CSUM : 0, id, len + (crc ? DFS_CSUM_SIZE : 0)) < 0 ||
+        dfs_send_file_at(sock, fd, offset, len) < 0)
+        return -1;
+    return crc ? dfs_send_csum(sock, *crc) : 0;
+}
+
+// Send bytes [offset, offset + len) of a stored file as a DATA frame,
+// followed by the file's stored checksum if it has one (server side).
+static inline int dfs_send_stored(int sock, uint32_t id, int fd, uint64_t offset, uint64_t len) {
+    uint32_t crc;
+    int have = dfs_csum_load(fd, &crc) == 0;
+    return dfs_send_range(sock, id, fd, offset, len, have ? &crc : NULL);
+}
+
+// Send bytes [offset, offset + len) of a local file as a DATA frame whose
+// trailer is the CRC32C of the file's first offset + len bytes (upload
+// side). The range is read through user space so the checksum is computed
+// as it streams; a resumed upload also sums the prefix it skips.
+static inline int dfs_send_summed(int sock, uint32_t id, int fd, uint64_t offset, uint64_t len) {
+    char buf[DFS_IO_CHUNK];
+    uint32_t crc = 0;
+    if (dfs_crc32c_file(fd, 0, offset, &crc) < 0 ||
+        dfs_send_hdr(sock, DFS_OP_DATA, DFS_FLAG_CSUM, id, len + DFS_CSUM_SIZE) < 0)
+        return -1;
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;   // File shrank under us; caller must drop the connection
+        crc = dfs_crc32c(crc, buf, n);
+        if (dfs_send_all(sock, buf, n) < 0) return -1;
+        offset += n;
+        len -= n;
+    }
+    return dfs_send_csum(sock, crc);
+}
+
+static inline int dfs_recv_lz4(int sock, const struct dfs_hdr* h, int fd, uint64_t offset, uint32_t* crc,
+                               struct dfs_sha256* sha);
+
+// Receive the body of DATA frame `h` into `fd`, which already holds the
+// file's first `offset` bytes, then its trailer. The CRC32C of the whole
+// file (the bytes already held, then the new ones as they arrive) is left
+// in *crc; if `sha` is not NULL the whole file is fed to that SHA-256 too.
+// Compressed frames are decompressed on the way (see "Compression").
+// Returns 0, -1 if writing failed, -2 if the socket failed, -3 if the
+// sender's checksum does not match.
+static inline int dfs_recv_summed(int sock, const struct dfs_hdr* h, int fd, uint64_t offset, uint32_t* crc,
+                                  struct dfs_sha256* sha) {
+    if (h->flags & DFS_FLAG_LZ4) return dfs_recv_lz4(sock, h, fd, offset, crc, sha);
+    uint32_t sent;
+    *crc = 0;
+    int read_failed = dfs_sum_file(fd, 0, offset, crc, sha) < 0;
+    int rc = dfs_recv_to_fd_csum(sock, fd, dfs_body_len(h), crc, sha);
+    if (rc == -2) return -2;
+    int have = dfs_recv_csum(sock, h, &sent);
+    if (have < 0) return -2;
+    if (rc < 0 || read_failed) return -1;
+    return have && sent != *crc ? -3 : 0;
+}
+
+// ----------------------------
+// Compression
+// ----------------------------
+// A session started with the client's -z sends .txt and .c files
+// compressed. Such a file travels as a run of DATA frames flagged
+// DFS_FLAG_LZ4, one per DFS_LZ4_BLOCK bytes of the file, all but the last
+// also flagged DFS_FLAG_MORE. A frame's payload is the block's plain length
+// (4 bytes, big-endian) and then the block, compressed by dfs_lz4.h or
+// left as it is when that would not make it smaller. The last frame may
+// end with the usual checksum trailer: the CRC32C of the plain file.
+//
+// The client compresses its uploads itself and asks for compressed
+// downloads by flagging its DOWNLF; a server that does not, or a file of
+// another type, gets a plain reply. S1 relays the frames untouched, so
+// the S1-S3 link carries the compressed form too, and the receiving end
+// stores plain bytes (files stay seekable for ranges, resumes and deltas).
+// Types that are compressed already (.pdf, .zip) never go this way.
+
+// Is a file of this name worth compressing?
+static inline int dfs_lz4_wanted(const char* name) {
+    const char* dot = strrchr(name, '.');
+    return dot && (strcmp(dot, ".txt") == 0 || strcmp(dot, ".c") == 0);
+}
+
+// Send bytes [offset, offset + len) of `fd` as compressed DATA frames. With
+// `crc` NULL there is no trailer; otherwise it is *crc, which with
+// `summing` set is first extended over each block as it is read.
+static inline int dfs_send_lz4(int sock, uint32_t id, int fd, uint64_t offset, uint64_t len, uint32_t* crc,
+                               int summing) {
+    unsigned char* raw = malloc(DFS_LZ4_BLOCK);
+    unsigned char* out = malloc(DFS_HDR_SIZE + 4 + DFS_LZ4_BOUND(DFS_LZ4_BLOCK));  // Header, length, block
+    int rc = -1;
+    if (!raw || !out) goto out;
+
+    do {
+        size_t n = len < DFS_LZ4_BLOCK ? len : DFS_LZ4_BLOCK, got = 0;
+        while (got < n) {
+            ssize_t r = pread(fd, raw + got, n - got, offset + got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) goto out;   // File shrank under us; caller must drop the connection
+            got += r;
+        }
+        if (crc && summing) *crc = dfs_crc32c(*crc, raw, n);
+
+        int z = dfs_lz4_compress(raw, n, out + DFS_HDR_SIZE + 4, DFS_LZ4_BOUND(DFS_LZ4_BLOCK));
+        size_t body = z >= 0 && (size_t)z < n ? (size_t)z : n;
+        if (body == n) memcpy(out + DFS_HDR_SIZE + 4, raw, n);
+        offset += n;
+        len -= n;
+
+        int last = len == 0;
+        uint8_t flags = DFS_FLAG_LZ4 | (!last ? DFS_FLAG_MORE : crc ? DFS_FLAG_CSUM : 0);
+        uint32_t be = htobe32(n);
+        dfs_encode_hdr(out, DFS_OP_DATA, flags, id, 4 + body + (last && crc ? DFS_CSUM_SIZE : 0));
+        memcpy(out + DFS_HDR_SIZE, &be, 4);
+        if (dfs_send_all(sock, out, DFS_HDR_SIZE + 4 + body) < 0) goto out;
+    } while (len > 0);
+    rc = crc ? dfs_send_csum(sock, *crc) : 0;
+out:
+    free(raw);
+    free(out);
+    return rc;
+}
+
+// dfs_send_stored, compressed
+static inline int dfs_send_stored_lz4(int sock, uint32_t id, int fd, uint64_t offset, uint64_t len) {
+    uint32_t crc;
+    int have = dfs_csum_load(fd, &crc) == 0;
+    return dfs_send_lz4(sock, id, fd, offset, len, have ? &crc : NULL, 0);
+}
+
+// dfs_send_summed, compressed
+static inline int dfs_send_summed_lz4(int sock, uint32_t id, int fd, uint64_t offset, uint64_t len) {
+    uint32_t crc = 0;
+    if (dfs_crc32c_file(fd, 0, offset, &crc) < 0) return -1;
+    return dfs_send_lz4(sock, id, fd, offset, len, &crc, 1);
+}
+
+// dfs_recv_summed for compressed frames, `h` being the first. A block that
+// does not decompress to its stated length counts as a checksum mismatch;
+// the remaining frames are still read, so the stream stays in sync.
+static inline int dfs_recv_lz4(int sock, const struct dfs_hdr* h, int fd, uint64_t offset, uint32_t* crc,
+                               struct dfs_sha256* sha) {
+    size_t cap = 4 + DFS_LZ4_BOUND(DFS_LZ4_BLOCK);
+    unsigned char* in = malloc(cap);
+    unsigned char* raw = malloc(DFS_LZ4_BLOCK);
+    struct dfs_hdr cur = *h;
+    struct dfs_writer w;
+    uint32_t sent = 0;
+    int rc = 0, have = 0;
+    *crc = 0;
+    if (!in || !raw || dfs_sum_file(fd, 0, offset, crc, sha) < 0) rc = -1;
+    dfs_writer_init(&w, fd);
+
+    for (;;) {
+        uint64_t body = dfs_body_len(&cur);
+        if (rc == 0 && (body < 4 || body > cap)) rc = -3;
+        if (rc != 0) {
+            if (dfs_drain(sock, body) < 0) goto broken;
+        } else {
+            if (dfs_recv_all(sock, in, body) < 0) goto broken;
+            uint32_t be;
+            memcpy(&be, in, 4);
+            size_t n = be32toh(be);
+            const unsigned char* plain = in + 4;  // A block sent as it is
+            if (n > DFS_LZ4_BLOCK || (body - 4 != n && dfs_lz4_decompress(in + 4, body - 4, raw, n) != (int)n)) {
+                rc = -3;
+            } else {
+                if (body - 4 != n) plain = raw;
+                *crc = dfs_crc32c(*crc, plain, n);
+                if (sha) dfs_sha256_update(sha, plain, n);
+                dfs_writer_put(&w, plain, n);
+                if (w.failed) rc = -1;   // Disk full etc.; keep reading to stay in sync
+            }
+        }
+
+        int t = dfs_recv_csum(sock, &cur, &sent);
+        if (t < 0) goto broken;
+        if (!(cur.flags & DFS_FLAG_MORE)) {
+            have = t;
+            break;
+        }
+        if (dfs_recv_hdr(sock, &cur) < 0 || cur.opcode != DFS_OP_DATA || !(cur.flags & DFS_FLAG_LZ4))
+            goto broken;
+    }
+    free(in);
+    free(raw);
+    if (dfs_writer_finish(&w) < 0 && rc == 0) rc = -1;
+    if (rc < 0) return rc;
+    return have && sent != *crc ? -3 : 0;
+broken:
+    free(in);
+    free(raw);
+    dfs_writer_finish(&w);  // Keep what arrived for a resume
+    return -2;
+}
+
+#endif // DFS_PROTO_H
@@ -0,0 +1,245 @@
+// dfs_reactor.h
+// Shared epoll front end for S1 and the storage servers.
+//
+// One epoll instance watches the listening socket and every idle connection.
+// A fixed pool of worker threads, pinned round-robin to the cores the process
+// may run on, waits on it; whichever worker wakes up runs the ready
+// connection's next command to completion and re-arms it. EPOLLONESHOT keeps
+// a connection on one worker at a time, and an idle connection costs no
+// thread. Heavy commands can be handed on to bounded worker pools (below).
+// Includers must build with -pthread.
+
+#ifndef DFS_REACTOR_H
+#define DFS_REACTOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "dfs_proto.h"
+
+#define DFS_SERVE_DEFERRED 1    // serve() handed the connection to a pool
+
+struct dfs_reactor {
+    const char* name;           // Log prefix, e.g. "S1"
+    int listen_fd;
+    int epfd;
+    int (*serve)(int fd);       // Run one command; < 0 closes the connection,
+                                // DFS_SERVE_DEFERRED means a pool now owns it
+    int stall_secs;             // Send/receive timeout on accepted sockets (0 = none)
+};
+
+struct dfs_reactor_worker {
+    struct dfs_reactor* r;
+    int cpu;                    // Core to pin to, -1 for none
+};
+
+static inline void dfs_reactor_arm(struct dfs_reactor* r, int fd, int op) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT | (fd == r->listen_fd ? 0 : EPOLLRDHUP);
+    ev.data.fd = fd;
+    if (epoll_ctl(r->epfd, op, fd, &ev) < 0 && fd != r->listen_fd)
+        close(fd);
+}
+
+// Accept every pending connection and add it to the epoll set
+static inline void dfs_reactor_accept(struct dfs_reactor* r) {
+    while (1) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        int fd = accept4(r->listen_fd, (struct sockaddr*)&peer, &len, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            break;
+        }
+        printf("[%s] Connection from %s\n", r->name, inet_ntoa(peer.sin_addr));
+
+        // Every frame goes out in as few writes as possible, so Nagle would
+        // only hold back the tail of a reply that a pipelining peer awaits
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        // Connections stay blocking while a command runs; the timeouts keep
+        // a stalled peer from pinning a worker forever
+        if (r->stall_secs > 0) {
+            struct timeval tv = { r->stall_secs, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+        dfs_reactor_arm(r, fd, EPOLL_CTL_ADD);
+    }
+    dfs_reactor_arm(r, r->listen_fd, EPOLL_CTL_MOD);
+}
+
+static inline void* dfs_reactor_worker(void* arg) {
+    struct dfs_reactor_worker* w = arg;
+    struct dfs_reactor* r = w->r;
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    while (1) {
+        // Take one event at a time so other ready connections go to idle workers
+        struct epoll_event ev;
+        if (epoll_wait(r->epfd, &ev, 1, -1) <= 0) continue;
+
+        if (ev.data.fd == r->listen_fd) {
+            dfs_reactor_accept(r);
+        } else {
+            int rc = r->serve(ev.data.fd);
+            if (rc < 0)
+                close(ev.data.fd);  // Also drops it from the epoll set
+            else if (rc != DFS_SERVE_DEFERRED)
+                dfs_reactor_arm(r, ev.data.fd, EPOLL_CTL_MOD);
+        }
+    }
+    return NULL;
+}
+
+// Serve `listen_fd` with `workers` threads (the caller becomes one of them).
+// Does not return.
+static inline void dfs_reactor_run(struct dfs_reactor* r, int workers) {
+    fcntl(r->listen_fd, F_SETFL, fcntl(r->listen_fd, F_GETFL) | O_NONBLOCK);
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.fd = r->listen_fd };
+    if (r->epfd < 0 || epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listen_fd, &ev) < 0) {
+        perror("epoll");
+        exit(1);
+    }
+
+    int cpus[CPU_SETSIZE], ncpus = 0;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &allowed)) cpus[ncpus++] = c;
+    }
+
+    printf("[%s] %d workers over %d cores\n", r->name, workers, ncpus);
+    struct dfs_reactor_worker* w = calloc(workers, sizeof(*w));
+    for (int i = 0; i < workers; i++) {
+        w[i].r = r;
+        w[i].cpu = ncpus ? cpus[i % ncpus] : -1;
+    }
+    for (int i = 1; i < workers; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, dfs_reactor_worker, &w[i]) == 0)
+            pthread_detach(t);
+    }
+    dfs_reactor_worker(&w[0]);
+}
+
+// Default pool size: one worker per core, at least four
+static inline int dfs_reactor_default_workers(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 4 ? 4 : (int)n;
+}
+
+// Worker pools for heavy requests.
+// A reactor worker that reads a bulk command (a file transfer, a tarball
+// build) hands it to a pool instead of running it, and serve() returns
+// DFS_SERVE_DEFERRED. Each pool has its own fixed set of threads and a
+// bounded queue, so at most `threads` requests of that kind run at once,
+// the rest wait their turn without holding a reactor worker, and listings
+// and removals keep flowing however many large transfers are in progress.
+// Once the queue is full, submit fails and the caller replies BUSY.
+
+struct dfs_job {
+    struct dfs_job* next;
+    int fd;
+    struct dfs_hdr hdr;         // The command frame's header
+    char args[];                // Its payload
+};
+
+struct dfs_pool {
+    struct dfs_reactor* r;
+    int (*run)(int fd, const struct dfs_hdr* hdr, const char* args);  // < 0 closes,
+                                // DFS_SERVE_DEFERRED leaves the fd to run()
+    int max_queued;
+    int queued;
+    struct dfs_job* head;
+    struct dfs_job* tail;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+static inline void* dfs_pool_thread(void* arg) {
+    struct dfs_pool* p = arg;
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->head)
+            pthread_cond_wait(&p->ready, &p->lock);
+        struct dfs_job* job = p->head;
+        p->head = job->next;
+        if (!p->head) p->tail = NULL;
+        p->queued--;
+        pthread_mutex_unlock(&p->lock);
+
+        // Run it, then give the connection back to the reactor
+        int rc = p->run(job->fd, &job->hdr, job->args);
+        if (rc < 0)
+            close(job->fd);
+        else if (rc != DFS_SERVE_DEFERRED)
+            dfs_reactor_arm(p->r, job->fd, EPOLL_CTL_MOD);
+        free(job);
+    }
+    return NULL;
+}
+
+static inline int dfs_pool_start(struct dfs_pool* p, struct dfs_reactor* r, int threads, int max_queued,
+                                 int (*run)(int fd, const struct dfs_hdr* hdr, const char* args)) {
+    p->r = r;
+    p->run = run;
+    p->max_queued = max_queued;
+    p->queued = 0;
+    p->head = p->tail = NULL;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->ready, NULL);
+    for (int i = 0; i < threads; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, dfs_pool_thread, p) != 0) return -1;
+        pthread_detach(t);
+    }
+    return 0;
+}
+
+// Queue a command for the pool. Returns -1 (nothing queued) when it is full.
+static inline int dfs_pool_submit(struct dfs_pool* p, int fd, const struct dfs_hdr* hdr, const char* args) {
+    size_t len = strlen(args);
+    struct dfs_job* job = malloc(sizeof(*job) + len + 1);
+    if (!job) return -1;
+    job->next = NULL;
+    job->fd = fd;
+    job->hdr = *hdr;
+    memcpy(job->args, args, len + 1);
+
+    pthread_mutex_lock(&p->lock);
+    if (p->queued >= p->max_queued) {
+        pthread_mutex_unlock(&p->lock);
+        free(job);
+        return -1;
+    }
+    if (p->tail) p->tail->next = job;
+    else p->head = job;
+    p->tail = job;
+    p->queued++;
+    pthread_cond_signal(&p->ready);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+#endif // DFS_REACTOR_H
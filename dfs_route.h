@@ -0,0 +1,192 @@
+// dfs_route.h
+// S1's routing table: which storage nodes hold which files.
+//
+// Every storage node (an Snode process; S2, S3 and S4 are the classic
+// three) holds the files of one extension. Several nodes may hold the same
+// extension; a new file then goes to one of them chosen by hashing its
+// logical path, so the files of one extension, and the traffic for them,
+// are spread across all of its nodes. The hash is rendezvous (highest
+// random weight) hashing: each node scores the path and the highest score
+// wins, so adding a node only moves the paths that now score highest on
+// it, about 1/n of them, and removing one only moves the paths it held.
+// Where a file lands is recorded in S1's index under the node's id, so
+// files already stored are found wherever they are after the table
+// changes; only new files follow the hash.
+//
+// The table is read at startup from a text file, one node per line:
+//
+//     # id  address          extension
+//     2     127.0.0.1:6501   .pdf
+//     3     127.0.0.1:6502   .txt
+//     5     127.0.0.1:6504   .txt
+//     6     store7:6501      .zip
+//
+// An address is an IPv4 address or a host name; names are resolved (to
+// their first IPv4 address) once, when the table is read.
+// Ids run from 2 to 255 (1 is S1 itself) and must not be reused for
+// another extension while the index still names them. Extensions are
+// listed in the order of their first node, which is also the order
+// dispfnames lists them in. Without a file the table is the classic layout
+// (.pdf on S2, .txt on S3, .zip on S4, at the ids S1 has always recorded).
+// .c files are always S1's own.
+
+#ifndef DFS_ROUTE_H
+#define DFS_ROUTE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define DFS_ROUTE_IDS  256          // Node ids fit the index's one byte
+#define DFS_ROUTE_EXT  16           // Longest extension, NUL included
+
+struct dfs_node {
+    int id;                     // Recorded in the index for the files it holds
+    struct sockaddr_in addr;
+    char ext[DFS_ROUTE_EXT];    // Extension it holds, e.g. ".txt"
+};
+
+// All the nodes holding one extension
+struct dfs_route {
+    char ext[DFS_ROUTE_EXT];
+    int nodes[DFS_ROUTE_IDS];   // Node ids, in table order
+    int n;
+};
+
+struct dfs_routes {
+    struct dfs_node node[DFS_ROUTE_IDS];  // Indexed by id; id 0 = no such node
+    struct dfs_route route[DFS_ROUTE_IDS];
+    int nroutes;
+    int ids[DFS_ROUTE_IDS];     // Ids of all nodes, in table order
+    int nnodes;
+};
+
+// The node with id `id`, or NULL
+static inline const struct dfs_node* dfs_route_node(const struct dfs_routes* rt, int id) {
+    return id > 1 && id < DFS_ROUTE_IDS && rt->node[id].id ? &rt->node[id] : NULL;
+}
+
+// The route for extension `ext`, or NULL if no node holds it
+static inline const struct dfs_route* dfs_route_find(const struct dfs_routes* rt, const char* ext) {
+    for (int i = 0; i < rt->nroutes; i++)
+        if (strcmp(rt->route[i].ext, ext) == 0) return &rt->route[i];
+    return NULL;
+}
+
+static inline int dfs_route_has(const struct dfs_route* r, int id) {
+    for (int i = 0; i < r->n; i++)
+        if (r->nodes[i] == id) return 1;
+    return 0;
+}
+
+// Score of `key` on node `id`: FNV-1a over the path, then a 64-bit mix
+// with the id so every node ranks the paths differently
+static inline uint64_t dfs_route_score(const char* key, int id) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char* p = (const unsigned char*)key; *p; p++)
+        h = (h ^ *p) * 1099511628211ULL;
+    h ^= (uint64_t)id * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+// The node of route `r` a new file with logical path `key` goes to
+static inline int dfs_route_pick(const struct dfs_route* r, const char* key) {
+    int best = r->nodes[0];
+    uint64_t best_score = dfs_route_score(key, best);
+    for (int i = 1; i < r->n; i++) {
+        uint64_t s = dfs_route_score(key, r->nodes[i]);
+        if (s > best_score) {
+            best = r->nodes[i];
+            best_score = s;
+        }
+    }
+    return best;
+}
+
+// Add node `id` at host:port holding `ext`. Returns -1 with errno EINVAL if
+// the id, host or extension is unusable or the id is taken.
+static inline int dfs_route_add(struct dfs_routes* rt, int id, const char* host, int port, const char* ext) {
+    struct dfs_node* n = &rt->node[id < 0 || id >= DFS_ROUTE_IDS ? 0 : id];
+    if (id < 2 || id >= DFS_ROUTE_IDS || n->id || port <= 0 || port > 65535 || ext[0] != '.' ||
+        strlen(ext) >= DFS_ROUTE_EXT || strcmp(ext, ".c") == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *ai;
+    if (getaddrinfo(host, NULL, &hints, &ai) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&n->addr, ai->ai_addr, sizeof(n->addr));
+    n->addr.sin_port = htons(port);
+    freeaddrinfo(ai);
+    n->id = id;
+    strcpy(n->ext, ext);
+    rt->ids[rt->nnodes++] = id;
+
+    struct dfs_route* r = (struct dfs_route*)dfs_route_find(rt, ext);
+    if (!r) {
+        r = &rt->route[rt->nroutes++];
+        strcpy(r->ext, ext);
+        r->n = 0;
+    }
+    r->nodes[r->n++] = id;
+    return 0;
+}
+
+// The classic layout: S2, S3 and S4 on this host
+static inline void dfs_route_default(struct dfs_routes* rt) {
+    memset(rt, 0, sizeof(*rt));
+    dfs_route_add(rt, 2, "127.0.0.1", 6501, ".pdf");
+    dfs_route_add(rt, 3, "127.0.0.1", 6502, ".txt");
+    dfs_route_add(rt, 4, "127.0.0.1", 6503, ".zip");
+}
+
+// Read the table from `path`. Returns -1 with errno set if it cannot be
+// read (ENOENT if there is no such file) or has a bad line (EINVAL, after
+// naming the line on stderr).
+static inline int dfs_route_load(struct dfs_routes* rt, const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+    memset(rt, 0, sizeof(*rt));
+
+    char line[512];
+    int lineno = 0, rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char addr[128], ext[64], extra;
+        int id, port, fields = sscanf(line, "%d %127s %63s %c", &id, addr, ext, &extra);
+        if (fields <= 0) continue;  // Blank or comment
+        char* colon = strrchr(addr, ':');
+        if (fields == 3 && colon) {
+            *colon = '\0';
+            port = atoi(colon + 1);
+            rc = dfs_route_add(rt, id, addr, port, ext);
+        } else {
+            errno = EINVAL;
+            rc = -1;
+        }
+        if (rc < 0)
+            fprintf(stderr, "[route] %s:%d: expected \"<id 2-255> <host>:<port> <.ext>\" with an unused id and a known host\n",
+                    path, lineno);
+    }
+    fclose(f);
+    if (rc == 0 && rt->nnodes == 0) {
+        fprintf(stderr, "[route] %s: no nodes\n", path);
+        errno = EINVAL;
+        rc = -1;
+    }
+    return rc;
+}
+
+#endif // DFS_ROUTE_H
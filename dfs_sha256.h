@@ -0,0 +1,246 @@
+// dfs_sha256.h
+// SHA-256, used to name stored file contents (see dfs_blob.h).
+//
+// Unlike CRC-32C this is collision resistant, so two files with the same
+// digest can be treated as the same bytes without comparing them. On
+// x86-64 CPUs with the SHA extensions each block is compressed with the
+// sha256rnds2/msg1/msg2 instructions; elsewhere a portable version runs.
+// As with dfs_csum.h the choice is made once, at run time.
+
+#ifndef DFS_SHA256_H
+#define DFS_SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define DFS_SHA256_HW 1
+#endif
+
+#define DFS_SHA256_SIZE 32
+#define DFS_SHA256_HEX (2 * DFS_SHA256_SIZE + 1)  // Hex digest plus NUL
+
+struct dfs_sha256_pieces;
+
+struct dfs_sha256 {
+    uint32_t h[8];
+    uint64_t len;                   // Bytes hashed so far
+    unsigned char buf[64];          // Partial block
+    size_t used;
+    struct dfs_sha256_pieces* pieces;  // If set, the stream's pieces are hashed too
+};
+
+// Digests of the consecutive `size`-byte pieces of the stream a dfs_sha256
+// hashes (the last one may be shorter), e.g. a file's chunks, taken in the
+// same pass as the digest of the whole
+struct dfs_sha256_pieces {
+    size_t size;
+    unsigned char* d;               // DFS_SHA256_SIZE bytes per finished piece (malloc'd)
+    uint64_t n, cap, max;           // Finished pieces, room for, most kept
+    int overflow;                   // More than `max` pieces, or out of memory: d is incomplete
+    struct dfs_sha256 cur;          // The piece being hashed
+};
+
+static const uint32_t dfs_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define DFS_ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline void dfs_sha256_blocks_sw(uint32_t h[8], const unsigned char* p, size_t nblocks) {
+    for (; nblocks > 0; nblocks--, p += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = DFS_ROR32(w[i - 15], 7) ^ DFS_ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = DFS_ROR32(w[i - 2], 17) ^ DFS_ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = k + (DFS_ROR32(e, 6) ^ DFS_ROR32(e, 11) ^ DFS_ROR32(e, 25)) +
+                          ((e & f) ^ (~e & g)) + dfs_sha256_k[i] + w[i];
+            uint32_t t2 = (DFS_ROR32(a, 2) ^ DFS_ROR32(a, 13) ^ DFS_ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            k = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+    }
+}
+
+#ifdef DFS_SHA256_HW
+// SHA extensions version. The state is kept as the ABEF/CDGH register
+// pair the sha256rnds2 instruction works on; each step of the loop does
+// four rounds and derives the next four message words.
+__attribute__((target("sha,sse4.1,ssse3")))
+static inline void dfs_sha256_blocks_hw(uint32_t h[8], const unsigned char* p, size_t nblocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&h[0]), 0xB1);   // CDAB
+    __m128i st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&h[4]), 0x1B);   // EFGH
+    __m128i st0 = _mm_alignr_epi8(tmp, st1, 8);                                       // ABEF
+    st1 = _mm_blend_epi16(st1, tmp, 0xF0);                                            // CDGH
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+        __m128i abef = st0, cdgh = st1, w[4];
+        for (int i = 0; i < 16; i++) {
+            __m128i m;
+            if (i < 4) {
+                m = w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16 * i)), bswap);
+            } else {
+                // W[i..i+3] from the previous sixteen words
+                __m128i t = _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+                                          _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                m = w[i & 3] = _mm_sha256msg2_epu32(t, w[(i + 3) & 3]);
+            }
+            m = _mm_add_epi32(m, _mm_loadu_si128((const __m128i*)&dfs_sha256_k[4 * i]));
+            st1 = _mm_sha256rnds2_epu32(st1, st0, m);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(m, 0x0E));
+        }
+        st0 = _mm_add_epi32(st0, abef);
+        st1 = _mm_add_epi32(st1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(st0, 0x1B);                                               // FEBA
+    st1 = _mm_shuffle_epi32(st1, 0xB1);                                               // DCHG
+    _mm_storeu_si128((__m128i*)&h[0], _mm_blend_epi16(tmp, st1, 0xF0));               // DCBA
+    _mm_storeu_si128((__m128i*)&h[4], _mm_alignr_epi8(st1, tmp, 8));                  // HGFE
+}
+
+static inline int dfs_sha256_hw_ok(void) {
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1) || !(c & bit_SSSE3)) return 0;
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29));  // SHA
+}
+#endif
+
+static inline void dfs_sha256_blocks(uint32_t h[8], const unsigned char* p, size_t nblocks) {
+#ifdef DFS_SHA256_HW
+    static int hw = -1;
+    if (hw < 0) hw = dfs_sha256_hw_ok();  // Racing initialisers agree
+    if (hw) {
+        dfs_sha256_blocks_hw(h, p, nblocks);
+        return;
+    }
+#endif
+    dfs_sha256_blocks_sw(h, p, nblocks);
+}
+
+static inline void dfs_sha256_init(struct dfs_sha256* s) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(s->h, iv, sizeof(iv));
+    s->len = 0;
+    s->used = 0;
+    s->pieces = NULL;
+}
+
+static inline void dfs_sha256_final(struct dfs_sha256* s, unsigned char out[DFS_SHA256_SIZE]);
+
+// Hash the pieces of the stream `s` hashes from now on (attach before the
+// first byte): every `size` bytes, keeping up to `max` digests
+static inline void dfs_sha256_pieces_init(struct dfs_sha256_pieces* p, struct dfs_sha256* s, size_t size,
+                                          uint64_t max) {
+    memset(p, 0, sizeof(*p));
+    p->size = size;
+    p->max = max;
+    dfs_sha256_init(&p->cur);
+    s->pieces = p;
+}
+
+// Finish the piece being hashed into the list
+static inline void dfs_sha256_pieces_cut(struct dfs_sha256_pieces* p) {
+    unsigned char digest[DFS_SHA256_SIZE];
+    dfs_sha256_final(&p->cur, digest);
+    dfs_sha256_init(&p->cur);
+    if (p->overflow || p->n == p->max) {
+        p->overflow = 1;
+        return;
+    }
+    if (p->n == p->cap) {
+        uint64_t cap = p->cap ? 2 * p->cap : 64;
+        unsigned char* d = realloc(p->d, cap * DFS_SHA256_SIZE);
+        if (!d) {
+            p->overflow = 1;
+            return;
+        }
+        p->d = d;
+        p->cap = cap;
+    }
+    memcpy(p->d + p->n++ * DFS_SHA256_SIZE, digest, DFS_SHA256_SIZE);
+}
+
+static inline void dfs_sha256_pieces_free(struct dfs_sha256_pieces* p) {
+    free(p->d);
+    p->d = NULL;
+}
+
+static inline void dfs_sha256_update(struct dfs_sha256* s, const void* data, size_t len) {
+    const unsigned char* p = data;
+    for (size_t off = 0; s->pieces && off < len;) {
+        struct dfs_sha256_pieces* pc = s->pieces;
+        size_t take = pc->size - pc->cur.len < len - off ? pc->size - pc->cur.len : len - off;
+        dfs_sha256_update(&pc->cur, p + off, take);
+        off += take;
+        if (pc->cur.len == pc->size) dfs_sha256_pieces_cut(pc);
+    }
+    s->len += len;
+    if (s->used > 0) {
+        size_t take = 64 - s->used < len ? 64 - s->used : len;
+        memcpy(s->buf + s->used, p, take);
+        s->used += take;
+        p += take;
+        len -= take;
+        if (s->used < 64) return;
+        dfs_sha256_blocks(s->h, s->buf, 1);
+        s->used = 0;
+    }
+    dfs_sha256_blocks(s->h, p, len / 64);
+    memcpy(s->buf, p + len / 64 * 64, len % 64);
+    s->used = len % 64;
+}
+
+// Finish the hash (and its pieces, the last one included)
+static inline void dfs_sha256_final(struct dfs_sha256* s, unsigned char out[DFS_SHA256_SIZE]) {
+    if (s->pieces && s->pieces->cur.len > 0) dfs_sha256_pieces_cut(s->pieces);
+    s->pieces = NULL;
+    uint64_t bits = s->len * 8;
+    unsigned char pad[72] = {0x80};
+    size_t npad = (s->used < 56 ? 56 : 120) - s->used;
+    for (int i = 0; i < 8; i++) pad[npad + i] = (unsigned char)(bits >> (56 - 8 * i));
+    dfs_sha256_update(s, pad, npad + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (unsigned char)(s->h[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(s->h[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(s->h[i] >> 8);
+        out[4 * i + 3] = (unsigned char)s->h[i];
+    }
+}
+
+// Finish the hash as lowercase hex
+static inline void dfs_sha256_hex(struct dfs_sha256* s, char out[DFS_SHA256_HEX]) {
+    static const char digits[] = "0123456789abcdef";
+    unsigned char d[DFS_SHA256_SIZE];
+    dfs_sha256_final(s, d);
+    for (int i = 0; i < DFS_SHA256_SIZE; i++) {
+        out[2 * i] = digits[d[i] >> 4];
+        out[2 * i + 1] = digits[d[i] & 15];
+    }
+    out[2 * DFS_SHA256_SIZE] = '\0';
+}
+
+#endif // DFS_SHA256_H
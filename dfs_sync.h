@@ -0,0 +1,163 @@
+// dfs_sync.h
+// Group commit: making uploads durable without one fsync per file each.
+//
+// An upload is durable once its part file's bytes are on disk, it has been
+// renamed into place, and that rename is on disk too, i.e. the directory
+// holding it has been synced. The receiving thread hands each of those
+// flushes to a shared syncer and waits. The syncer's flusher thread takes
+// everything pending and flushes it together, then wakes every waiter;
+// flushes requested meanwhile wait for the next batch. So the busier the
+// disk, the larger the batches.
+//
+// The flusher first starts writeback of every file in the batch at once
+// (sync_file_range), so the disk sees all their data queued together
+// rather than one file's at a time, then fdatasync()s each file, which by
+// then mostly waits for writes already under way, and fsync()s each
+// distinct directory once. Only the batch's own files and directories are
+// flushed, so a small upload never waits for other files' writeback, and
+// every request gets the result of its own flush. The xattrs set on a
+// part file before its flush (checksum, digest) are metadata fdatasync()
+// may leave behind; on journaling file systems (ext4, XFS) they reach the
+// disk at the latest with the directory's fsync, which commits the journal.
+//
+// Only after both flushes is the upload acknowledged, so an OK always
+// means the file survives a crash. A crash before then leaves at most a
+// part file behind, never a torn file under the real name.
+//
+// With interval_ms > 0 the flusher also waits that long after the first
+// pending flush, so uploads finishing together share a batch even on a
+// fast disk; that pays off where each fsync is expensive (spinning disks,
+// network block devices). A negative interval turns the flushes off, for
+// scratch setups. The thread is started on first use, so a syncer set up
+// before fork() works in the child.
+
+#ifndef DFS_SYNC_H
+#define DFS_SYNC_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DFS_SYNC_MS 0               // Default extra wait for a batch to fill
+
+struct dfs_sync_req {
+    struct dfs_sync_req* next;
+    int fd;                     // File to flush, or -1
+    const char* dir;            // Else the directory to flush
+    int rc;                     // 1 until flushed, then 0 or -1
+    int done;                   // Set under the lock when rc is final
+};
+
+struct dfs_sync {
+    pthread_mutex_t lock;       // Guards everything below
+    pthread_cond_t wake;        // Flusher: requests are pending
+    pthread_cond_t done;        // Waiters: a batch was flushed
+    struct dfs_sync_req* pending;
+    int interval_ms;
+    int running;                // The flusher thread is started
+};
+
+static inline int dfs_sync_dir_now(const char* dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// Flush one request on its own, when there is no flusher thread
+static inline int dfs_sync_now(const struct dfs_sync_req* q) {
+    return q->fd >= 0 ? fsync(q->fd) : dfs_sync_dir_now(q->dir);
+}
+
+static inline void* dfs_sync_thread(void* arg) {
+    struct dfs_sync* s = arg;
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        while (!s->pending)
+            pthread_cond_wait(&s->wake, &s->lock);
+
+        // Let the uploads finishing alongside this one join the batch
+        if (s->interval_ms > 0) {
+            pthread_mutex_unlock(&s->lock);
+            struct timespec nap = { s->interval_ms / 1000, (long)(s->interval_ms % 1000) * 1000000 };
+            nanosleep(&nap, NULL);
+            pthread_mutex_lock(&s->lock);
+        }
+        struct dfs_sync_req* batch = s->pending;
+        s->pending = NULL;
+        pthread_mutex_unlock(&s->lock);
+
+        // Start writeback of every file at once, then wait for each
+        for (struct dfs_sync_req* q = batch; q; q = q->next)
+            if (q->fd >= 0) sync_file_range(q->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        for (struct dfs_sync_req* q = batch; q; q = q->next)
+            if (q->fd >= 0) q->rc = fdatasync(q->fd) < 0 ? -1 : 0;
+
+        // Flush each distinct directory once
+        for (struct dfs_sync_req* q = batch; q; q = q->next) {
+            if (q->fd >= 0 || q->rc != 1) continue;  // A file, or a directory already flushed
+            q->rc = dfs_sync_dir_now(q->dir) < 0 ? -1 : 0;
+            for (struct dfs_sync_req* o = q->next; o; o = o->next)
+                if (o->fd < 0 && o->rc == 1 && strcmp(o->dir, q->dir) == 0) o->rc = q->rc;
+        }
+
+        // Waiters cannot return (and drop their requests) before the unlock
+        pthread_mutex_lock(&s->lock);
+        for (struct dfs_sync_req* q = batch; q; q = q->next)
+            q->done = 1;
+        pthread_cond_broadcast(&s->done);
+    }
+    return NULL;
+}
+
+static inline void dfs_sync_init(struct dfs_sync* s, int interval_ms) {
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    pthread_cond_init(&s->done, NULL);
+    s->interval_ms = interval_ms;
+}
+
+// Queue `q` for the next batch and wait until it has been flushed
+static inline int dfs_sync_wait(struct dfs_sync* s, struct dfs_sync_req* q) {
+    if (s->interval_ms < 0) return 0;
+
+    q->rc = 1;
+    q->done = 0;
+    pthread_mutex_lock(&s->lock);
+    if (!s->running) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, dfs_sync_thread, s) != 0) {
+            pthread_mutex_unlock(&s->lock);
+            return dfs_sync_now(q);  // No flusher; flush alone
+        }
+        pthread_detach(t);
+        s->running = 1;
+    }
+    q->next = s->pending;
+    s->pending = q;
+    pthread_cond_signal(&s->wake);
+    while (!q->done)
+        pthread_cond_wait(&s->done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+    return q->rc;
+}
+
+// Flush a received file's bytes (and its xattrs) before it is renamed into place
+static inline int dfs_sync_file(struct dfs_sync* s, int fd) {
+    struct dfs_sync_req q = { NULL, fd, NULL, 0, 0 };
+    return dfs_sync_wait(s, &q);
+}
+
+// Flush directory `dir` after a file was renamed into it
+static inline int dfs_sync_dir(struct dfs_sync* s, const char* dir) {
+    struct dfs_sync_req q = { NULL, -1, dir, 0, 0 };
+    return dfs_sync_wait(s, &q);
+}
+
+#endif // DFS_SYNC_H
@@ -0,0 +1,403 @@
+// dfs_tar.h
+// In-process tar writer used by downltar on S1 and the storage nodes.
+//
+// Instead of running find and tar into scratch files and then sending the
+// result, the server walks its directory tree, collects the matching files
+// (name, size, mode, mtime) and streams the archive straight onto the socket:
+// a 512-byte ustar header per file, the body via sendfile(), zero padding to
+// the next block, and the end-of-archive blocks. Only file metadata is
+// touched before the first byte goes out, and nothing is written to disk.
+//
+// The DATA frame must announce its length up front, so the archive is sized
+// from the scan. If a file changes after the scan the archive keeps the
+// scanned size: a file that shrank is padded with zeros, one that grew is
+// cut off. Member names follow GNU tar: the absolute path without its
+// leading '/'. Names that do not fit a ustar header use a GNU long-name
+// record. The archive is padded to tar's default 10240-byte record.
+//
+// Files that are hard links to one another (on a storage node, paths
+// sharing a content blob; see dfs_blob.h) are sent once: later members are
+// hard-link entries naming the first, as GNU tar writes them, and carry no
+// body.
+
+#ifndef DFS_TAR_H
+#define DFS_TAR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "dfs_proto.h"
+#include "dfs_blob.h"
+
+#define DFS_TAR_BLOCK  512
+#define DFS_TAR_RECORD 10240        // GNU tar's default record size
+#define DFS_TAR_DEPTH  64           // Directory levels the scan descends
+
+// One file to archive
+struct dfs_tar_entry {
+    char* path;                 // Absolute path on disk
+    uint64_t size;              // Size at scan time; exactly this much is sent
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    dev_t dev;
+    ino_t ino;
+    nlink_t nlink;
+    ssize_t link;               // Earlier member with the same contents (a hard link), or -1
+};
+
+struct dfs_tar {
+    struct dfs_tar_entry* v;
+    size_t n, cap;
+};
+
+static inline uint64_t dfs_tar_pad(uint64_t n) {
+    return (n + DFS_TAR_BLOCK - 1) / DFS_TAR_BLOCK * DFS_TAR_BLOCK;
+}
+
+static inline int dfs_tar_add(struct dfs_tar* t, const char* path, const struct stat* st) {
+    if (t->n == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 64;
+        struct dfs_tar_entry* v = realloc(t->v, cap * sizeof(*v));
+        if (!v) return -1;
+        t->v = v;
+        t->cap = cap;
+    }
+    struct dfs_tar_entry* e = &t->v[t->n];
+    if (!(e->path = strdup(path))) return -1;
+    e->size = st->st_size;
+    e->mode = st->st_mode & 07777;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    e->mtime = st->st_mtime;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->nlink = st->st_nlink;
+    e->link = -1;
+    t->n++;
+    return 0;
+}
+
+// Collect regular files under `dir` whose names end in `ext`
+static inline int dfs_tar_walk(struct dfs_tar* t, const char* dir, const char* ext, int depth) {
+    DIR* d = opendir(dir);
+    if (!d) return depth == 0 ? -1 : 0;   // Unreadable subdirectories are skipped, like find
+
+    size_t elen = strlen(ext);
+    int rc = 0;
+    struct dirent* de;
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        char path[4096];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= (int)sizeof(path)) continue;
+
+        // d_type saves a stat for directories and files of other types;
+        // fall back to lstat when the filesystem does not report it
+        struct stat st;
+        if (depth == 0 && strcmp(de->d_name, DFS_BLOB_DIR) == 0) continue;  // Reached through the stored paths
+        if (de->d_type == DT_DIR) {
+            if (depth < DFS_TAR_DEPTH) rc = dfs_tar_walk(t, path, ext, depth + 1);
+            continue;
+        }
+        if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN) continue;
+        size_t nlen = strlen(de->d_name);
+        if (de->d_type == DT_REG && (nlen < elen || strcmp(de->d_name + nlen - elen, ext) != 0)) continue;
+        if (lstat(path, &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            if (depth < DFS_TAR_DEPTH) rc = dfs_tar_walk(t, path, ext, depth + 1);
+        } else if (S_ISREG(st.st_mode) && nlen >= elen && strcmp(de->d_name + nlen - elen, ext) == 0) {
+            rc = dfs_tar_add(t, path, &st);
+        }
+    }
+    closedir(d);
+    return rc;
+}
+
+static inline int dfs_tar_cmp(const void* a, const void* b) {
+    return strcmp(((const struct dfs_tar_entry*)a)->path, ((const struct dfs_tar_entry*)b)->path);
+}
+
+// Order members by inode, then by position in the archive
+static inline int dfs_tar_inode_cmp(const void* a, const void* b, void* arg) {
+    const struct dfs_tar_entry* v = arg;
+    const struct dfs_tar_entry *x = &v[*(const size_t*)a], *y = &v[*(const size_t*)b];
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    return *(const size_t*)a < *(const size_t*)b ? -1 : 1;
+}
+
+// Point every member that shares its inode with an earlier member at that
+// first one. Only files with more than one link are looked at.
+static inline int dfs_tar_links(struct dfs_tar* t) {
+    size_t* order = malloc(t->n * sizeof(*order) + 1);
+    size_t n = 0;
+    if (!order) return -1;
+    for (size_t i = 0; i < t->n; i++)
+        if (t->v[i].nlink > 1) order[n++] = i;
+    qsort_r(order, n, sizeof(*order), dfs_tar_inode_cmp, t->v);
+    for (size_t i = 1; i < n; i++) {
+        struct dfs_tar_entry *first = &t->v[order[i - 1]], *e = &t->v[order[i]];
+        if (e->dev == first->dev && e->ino == first->ino)
+            e->link = first->link >= 0 ? first->link : (ssize_t)order[i - 1];
+    }
+    free(order);
+    return 0;
+}
+
+static inline void dfs_tar_free(struct dfs_tar* t) {
+    for (size_t i = 0; i < t->n; i++) free(t->v[i].path);
+    free(t->v);
+    t->v = NULL;
+    t->n = t->cap = 0;
+}
+
+// Scan `root` for files ending in `ext`, in path order. Returns -1 if
+// `root` cannot be read or memory runs out.
+static inline int dfs_tar_scan(struct dfs_tar* t, const char* root, const char* ext) {
+    t->v = NULL;
+    t->n = t->cap = 0;
+    if (dfs_tar_walk(t, root, ext, 0) < 0) {
+        dfs_tar_free(t);
+        return -1;
+    }
+    qsort(t->v, t->n, sizeof(*t->v), dfs_tar_cmp);
+    if (dfs_tar_links(t) < 0) {
+        dfs_tar_free(t);
+        return -1;
+    }
+    return 0;
+}
+
+// Name stored in the archive: the path without its leading '/'
+static inline const char* dfs_tar_name(const struct dfs_tar_entry* e) {
+    const char* name = e->path;
+    while (*name == '/') name++;
+    return name;
+}
+
+// Does `name` fit the ustar name/prefix fields? Fills them if so.
+static inline int dfs_tar_split(const char* name, char* hdr) {
+    size_t len = strlen(name);
+    if (len <= 100) {
+        memcpy(hdr, name, len);
+        return 1;
+    }
+    // Split at a '/' so the prefix is at most 155 bytes and the rest at most 100
+    for (const char* s = name + len - 1; s > name; s--) {
+        if (*s != '/') continue;
+        size_t plen = s - name;
+        if (len - plen - 1 > 100) break;
+        if (plen > 155) continue;
+        memcpy(hdr + 345, name, plen);
+        memcpy(hdr, s + 1, len - plen - 1);
+        return 1;
+    }
+    return 0;
+}
+
+// Write a numeric header field: octal when it fits, else GNU base-256
+static inline void dfs_tar_num(char* field, size_t width, uint64_t v) {
+    if (width <= 8 ? v < (1ull << 21) : v < (1ull << 33)) {
+        field[width - 1] = '\0';           // width - 1 zero-padded digits, then NUL
+        for (size_t i = width - 1; i > 0; i--, v >>= 3)
+            field[i - 1] = (char)('0' + (v & 7));
+        return;
+    }
+    memset(field, 0, width);
+    field[0] = (char)0x80;
+    for (size_t i = width - 1; i > 0 && v; i--, v >>= 8)
+        field[i] = (char)(v & 0xff);
+}
+
+static inline void dfs_tar_header(char* hdr, const char* name, char type, uint64_t size,
+                                  mode_t mode, uid_t uid, gid_t gid, time_t mtime, const char* link) {
+    memset(hdr, 0, DFS_TAR_BLOCK);
+    if (!dfs_tar_split(name, hdr))
+        memcpy(hdr, name, 100);             // Truncated; a long-name record precedes it
+    dfs_tar_num(hdr + 100, 8, mode);
+    dfs_tar_num(hdr + 108, 8, uid);
+    dfs_tar_num(hdr + 116, 8, gid);
+    dfs_tar_num(hdr + 124, 12, size);
+    dfs_tar_num(hdr + 136, 12, mtime < 0 ? 0 : (uint64_t)mtime);
+    hdr[156] = type;
+    if (link) strncpy(hdr + 157, link, 100);  // Truncated if long; a long-link record precedes it
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+
+    // Checksum: byte sum with the checksum field itself counted as spaces
+    unsigned sum = 0;
+    memset(hdr + 148, ' ', 8);
+    for (int i = 0; i < DFS_TAR_BLOCK; i++) sum += (unsigned char)hdr[i];
+    snprintf(hdr + 148, 8, "%06o", sum);
+    hdr[155] = ' ';
+}
+
+// Target a hard-link member names, or NULL for a member with a body
+static inline const char* dfs_tar_link(const struct dfs_tar* t, const struct dfs_tar_entry* e) {
+    return e->link >= 0 ? dfs_tar_name(&t->v[e->link]) : NULL;
+}
+
+// Bytes one entry takes in the archive, headers and padding included
+static inline uint64_t dfs_tar_entry_size(const struct dfs_tar* t, const struct dfs_tar_entry* e) {
+    char scratch[DFS_TAR_BLOCK] = {0};
+    const char* name = dfs_tar_name(e);
+    const char* link = dfs_tar_link(t, e);
+    uint64_t n = DFS_TAR_BLOCK + (link ? 0 : dfs_tar_pad(e->size));
+    if (!dfs_tar_split(name, scratch))
+        n += DFS_TAR_BLOCK + dfs_tar_pad(strlen(name) + 1);
+    if (link && strlen(link) > 100)
+        n += DFS_TAR_BLOCK + dfs_tar_pad(strlen(link) + 1);
+    return n;
+}
+
+// Bytes the members take, i.e. the archive without its end
+static inline uint64_t dfs_tar_members_size(const struct dfs_tar* t) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < t->n; i++) n += dfs_tar_entry_size(t, &t->v[i]);
+    return n;
+}
+
+// Length of an archive whose members take `members` bytes: the
+// end-of-archive marker added and padded to whole records
+static inline uint64_t dfs_tar_total(uint64_t members) {
+    uint64_t n = members + 2 * DFS_TAR_BLOCK;
+    return (n + DFS_TAR_RECORD - 1) / DFS_TAR_RECORD * DFS_TAR_RECORD;
+}
+
+// Total archive length, i.e. the DATA frame's payload length
+static inline uint64_t dfs_tar_size(const struct dfs_tar* t) {
+    return dfs_tar_total(dfs_tar_members_size(t));
+}
+
+static inline int dfs_tar_zeros(int sock, uint64_t len) {
+    static const char zeros[DFS_TAR_RECORD];
+    while (len > 0) {
+        size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+        if (dfs_send_all(sock, zeros, n) < 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// GNU long-name ('L') or long-link ('K') record: a header, then the full
+// name as its body
+static inline int dfs_tar_long(int sock, char* hdr, char type, const char* name) {
+    size_t len = strlen(name) + 1;
+    dfs_tar_header(hdr, "././@LongLink", type, len, 0644, 0, 0, 0, NULL);
+    return dfs_send_all(sock, hdr, DFS_TAR_BLOCK) < 0 || dfs_send_all(sock, name, len) < 0 ||
+           dfs_tar_zeros(sock, dfs_tar_pad(len) - len) < 0 ? -1 : 0;
+}
+
+// Send exactly `size` bytes of the file at `path`, zero-filling whatever
+// it no longer has (removed or truncated since the scan). A large body is
+// dropped from the page cache once sent (see dfs_read_policy).
+static inline int dfs_tar_body(int sock, const char* path, uint64_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    uint64_t left = size;
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+        while (left > 0) {
+            size_t want = left < (1u << 30) ? left : (1u << 30);
+            ssize_t n = sendfile(sock, fd, NULL, want);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && left == size && (errno == EINVAL || errno == ENOSYS)) {
+                int rc = dfs_send_fd_copy(sock, fd, left);
+                close(fd);
+                return rc;
+            }
+            if (n < 0) {
+                close(fd);
+                return -1;
+            }
+            if (n == 0) break;              // File ended early
+            left -= n;
+        }
+        if (size >= dfs_read_policy.stream_min) posix_fadvise(fd, 0, size, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    if (left > 0) fprintf(stderr, "[tar] %s changed while archiving; zero-filled\n", path);
+    return dfs_tar_zeros(sock, left);
+}
+
+// Stream the archive to `sock`, or with `members_only` just its members.
+// Exactly dfs_tar_size(t) (dfs_tar_members_size(t)) bytes are sent unless
+// the socket fails (returns -1).
+static inline int dfs_tar_send(int sock, const struct dfs_tar* t, int members_only) {
+    char hdr[DFS_TAR_BLOCK];
+    uint64_t sent = 0;
+
+    // Cork the socket so each small header leaves in the same segment as
+    // the body that follows it
+    int on = 1, off = 0;
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+
+    int rc = 0;
+    for (size_t i = 0; i < t->n && rc == 0; i++) {
+        const struct dfs_tar_entry* e = &t->v[i];
+        const char* name = dfs_tar_name(e);
+        const char* link = dfs_tar_link(t, e);
+
+        if (!dfs_tar_split(name, hdr) && dfs_tar_long(sock, hdr, 'L', name) < 0) rc = -1;
+        if (rc == 0 && link && strlen(link) > 100 && dfs_tar_long(sock, hdr, 'K', link) < 0) rc = -1;
+        if (rc < 0) break;
+        if (link) {
+            // Same contents as an earlier member: a hard link to it, no body
+            dfs_tar_header(hdr, name, '1', 0, e->mode, e->uid, e->gid, e->mtime, link);
+            rc = dfs_send_all(sock, hdr, DFS_TAR_BLOCK);
+        } else {
+            dfs_tar_header(hdr, name, '0', e->size, e->mode, e->uid, e->gid, e->mtime, NULL);
+            rc = dfs_send_all(sock, hdr, DFS_TAR_BLOCK) < 0 || dfs_tar_body(sock, e->path, e->size) < 0 ||
+                 dfs_tar_zeros(sock, dfs_tar_pad(e->size) - e->size) < 0 ? -1 : 0;
+        }
+        sent += dfs_tar_entry_size(t, e);
+    }
+
+    // End-of-archive blocks and record padding
+    if (rc == 0 && !members_only) rc = dfs_tar_zeros(sock, dfs_tar_size(t) - sent);
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    return rc;
+}
+
+// Scan `root` and send the archive of its `ext` files as one DATA frame.
+// Replies with an ERR frame if the scan fails; returns -1 only if the
+// socket broke mid-frame.
+static inline int dfs_tar_reply(int sock, uint32_t id, const char* root, const char* ext) {
+    struct dfs_tar t;
+    if (dfs_tar_scan(&t, root, ext) < 0)
+        return dfs_send_text(sock, DFS_OP_ERR, id, "Tar creation failed") < 0 ? -1 : 0;
+
+    int rc = dfs_send_hdr(sock, DFS_OP_DATA, 0, id, dfs_tar_size(&t)) < 0 ||
+             dfs_tar_send(sock, &t, 0) < 0 ? -1 : 0;
+    dfs_tar_free(&t);
+    return rc;
+}
+
+// Same, but only the members go out: no end-of-archive blocks and no
+// padding. S1 joins such parts from the several nodes holding one
+// extension into a single archive and ends it itself (dfs_tar_total).
+static inline int dfs_tar_reply_members(int sock, uint32_t id, const char* root, const char* ext) {
+    struct dfs_tar t;
+    if (dfs_tar_scan(&t, root, ext) < 0)
+        return dfs_send_text(sock, DFS_OP_ERR, id, "Tar creation failed") < 0 ? -1 : 0;
+
+    int rc = dfs_send_hdr(sock, DFS_OP_DATA, 0, id, dfs_tar_members_size(&t)) < 0 ||
+             dfs_tar_send(sock, &t, 1) < 0 ? -1 : 0;
+    dfs_tar_free(&t);
+    return rc;
+}
+
+#endif // DFS_TAR_H
@@ -0,0 +1,378 @@
+// dfs_uring.h
+// Optional io_uring engine for uploads on the storage nodes (-u).
+//
+// The blocking path receives an upload with a recv() per arriving burst
+// and a write() per DFS_WRITE_BLOCK, each one a system call that waits.
+// With the engine, each transfer thread owns an io_uring with
+// DFS_URING_BUFS registered DFS_WRITE_BLOCK buffers, and the socket and
+// part file are registered as its fixed files. Every block is one linked
+// pair of requests, a RECV that fills the buffer (MSG_WAITALL) and a
+// WRITE_FIXED of it to the file, so the kernel starts the write as soon
+// as the block is in, with no return to user space in between. The next
+// block's RECV goes out as soon as the previous one completes, while
+// earlier writes are still running, so the disk and the network overlap.
+// One io_uring_enter() submits a pair and reaps what has finished.
+//
+// Only one RECV is in flight per socket at a time: two would race for the
+// stream's bytes. Writes go to explicit offsets and may finish in any
+// order. The checksums are computed from the buffer once its RECV is done
+// (the write only reads it), so they still see the bytes in order.
+//
+// The ring is set up with raw system calls, so no liburing is needed.
+// If the kernel lacks io_uring, or a ring cannot be set up, the blocking
+// path is used instead. Compressed and delta uploads are parsed as they
+// arrive and always take the blocking path. Downloads stay on sendfile(),
+// which already moves a whole file in one zero-copy call.
+
+#ifndef DFS_URING_H
+#define DFS_URING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "dfs_proto.h"
+
+#define DFS_URING_DEPTH 16          // Submission queue entries
+#define DFS_URING_BUFS 4            // Registered buffers, i.e. blocks in flight
+
+struct dfs_uring {
+    int fd;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned tail;              // Our copy of *sq_tail, published on submit
+    unsigned queued;            // Filled entries not yet submitted
+    int broken;                 // Requests may still be in flight; never reuse
+    char* bufs[DFS_URING_BUFS];
+};
+
+// Set by -u once a test ring could be set up
+static int dfs_uring_on;
+
+// Each transfer thread's ring, and whether it has given up on the engine
+static __thread struct dfs_uring* dfs_uring_ring;
+static __thread int dfs_uring_failed;
+
+static inline void dfs_uring_free(struct dfs_uring* r) {
+    if (r->fd >= 0) close(r->fd);
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_len);
+    if (r->sq_map) munmap(r->sq_map, r->sq_map_len);
+    for (int i = 0; i < DFS_URING_BUFS; i++)
+        free(r->bufs[i]);
+    free(r);
+}
+
+// A new ring with its buffers registered and two fixed-file slots
+// (0: socket, 1: file), or NULL if io_uring is unavailable
+static inline struct dfs_uring* dfs_uring_new(void) {
+    struct dfs_uring* r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    r->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, DFS_URING_DEPTH, &p);
+    if (r->fd < 0) goto fail;
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_len > r->sq_map_len) r->sq_map_len = r->cq_map_len;
+        r->cq_map_len = r->sq_map_len;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                     IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        r->sq_map = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                         IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            r->cq_map = NULL;
+            goto fail;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    char* sq = r->sq_map;
+    char* cq = r->cq_map;
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->tail = *r->sq_tail;
+
+    // Buffers the kernel pins once instead of mapping on every write
+    struct iovec iov[DFS_URING_BUFS];
+    for (int i = 0; i < DFS_URING_BUFS; i++) {
+        if (posix_memalign((void**)&r->bufs[i], 4096, DFS_WRITE_BLOCK) != 0) {
+            r->bufs[i] = NULL;
+            goto fail;
+        }
+        iov[i].iov_base = r->bufs[i];
+        iov[i].iov_len = DFS_WRITE_BLOCK;
+    }
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, DFS_URING_BUFS) < 0) goto fail;
+
+    int slots[2] = {-1, -1};  // Filled per transfer
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, slots, 2) < 0) goto fail;
+    return r;
+fail:
+    dfs_uring_free(r);
+    return NULL;
+}
+
+// Can this kernel (and its seccomp policy) run the engine at all?
+static inline int dfs_uring_probe(void) {
+    struct dfs_uring* r = dfs_uring_new();
+    if (!r) return -1;
+    dfs_uring_free(r);
+    return 0;
+}
+
+// The calling thread's ring, set up on first use; NULL if the engine is
+// off or the ring cannot be set up (this thread then stays blocking)
+static inline struct dfs_uring* dfs_uring_mine(void) {
+    if (!dfs_uring_on || dfs_uring_failed) return NULL;
+    if (!dfs_uring_ring && !(dfs_uring_ring = dfs_uring_new())) dfs_uring_failed = 1;
+    return dfs_uring_ring;
+}
+
+// Give up on the calling thread's ring after it failed with requests
+// still in flight; the thread then stays blocking. Closing the ring
+// cancels them, but a cancelled RECV may still be copying into its buffer
+// for a while, so the buffers are left allocated rather than handed back
+// to malloc (a few MiB, once per thread, on a failure not expected at all).
+static inline void dfs_uring_retire(void) {
+    struct dfs_uring* r = dfs_uring_ring;
+    dfs_uring_ring = NULL;
+    dfs_uring_failed = 1;
+    if (!r) return;
+    for (int i = 0; i < DFS_URING_BUFS; i++)
+        r->bufs[i] = NULL;
+    dfs_uring_free(r);
+}
+
+// Next free submission entry, zeroed. The caller keeps at most
+// DFS_URING_DEPTH requests outstanding, so there always is one.
+static inline struct io_uring_sqe* dfs_uring_sqe(struct dfs_uring* r) {
+    unsigned i = r->tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[i] = i;
+    r->tail++;
+    r->queued++;
+    return sqe;
+}
+
+// Submit what is queued and take the next completion, waiting for one if
+// none is there yet: a single io_uring_enter() does both
+static inline int dfs_uring_wait(struct dfs_uring* r, struct io_uring_cqe* out) {
+    for (;;) {
+        unsigned head = *r->cq_head;
+        int ready = head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (r->queued > 0 || !ready) {
+            __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+            long n = syscall(__NR_io_uring_enter, r->fd, r->queued, ready ? 0 : 1,
+                             ready ? 0 : IORING_ENTER_GETEVENTS, NULL, 0);
+            if (n < 0 && errno != EINTR) return -1;
+            if (n > 0) r->queued -= n;
+            if (!ready) continue;
+        }
+        *out = r->cqes[head & *r->cq_mask];
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+}
+
+// Queue the RECV of bytes [got, len) of buffer `b`, linked to the write of
+// all `len` bytes at `at` unless `nowrite` (writing failed; just drain)
+static inline void dfs_uring_queue_block(struct dfs_uring* r, int b, size_t got, size_t len, uint64_t at,
+                                         int nowrite) {
+    struct io_uring_sqe* sqe = dfs_uring_sqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_FIXED_FILE | (nowrite ? 0 : IOSQE_IO_LINK);
+    sqe->fd = 0;
+    sqe->addr = (uintptr_t)(r->bufs[b] + got);
+    sqe->len = len - got;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->user_data = b * 2;
+    if (nowrite) return;
+
+    sqe = dfs_uring_sqe(r);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 1;
+    sqe->addr = (uintptr_t)r->bufs[b];
+    sqe->len = len;
+    sqe->off = at;
+    sqe->buf_index = b;
+    sqe->user_data = b * 2 + 1;
+}
+
+// Blocking pwrite() of a whole buffer
+static inline int dfs_uring_pwrite(int fd, const char* p, size_t n, uint64_t at) {
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, at);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        n -= w;
+        at += w;
+    }
+    return 0;
+}
+
+// Receive `len` bytes from the socket in fixed-file slot 0 of ring `r` into
+// `fd` (slot 1, for the writes) at `offset`, extending *crc and *sha (if not
+// NULL) as dfs_recv_to_fd_csum does, and with the same results: 0, -1 if
+// writing failed (the payload is still drained), -2 if the socket failed. Bytes that arrived before a socket
+// failure are written, for a resume. `fd` is left positioned after the data.
+// If the ring itself fails, r->broken is set: requests may still be in
+// flight, so it must not be used again.
+static inline int dfs_uring_recv_file(struct dfs_uring* r, int fd, uint64_t offset, uint64_t len,
+                                      uint32_t* crc, struct dfs_sha256* sha) {
+    size_t size[DFS_URING_BUFS], got[DFS_URING_BUFS];
+    uint64_t at[DFS_URING_BUFS];
+    int busy[DFS_URING_BUFS] = {0};  // Requests outstanding per buffer
+    uint64_t pos = offset, left = len, cut = 0;
+    int recving = -1, inflight = 0, sock_failed = 0, write_failed = 0;
+
+    while (1) {
+        // Start the next block once the previous RECV is done and a buffer is free
+        if (recving < 0 && left > 0 && !sock_failed) {
+            for (int b = 0; b < DFS_URING_BUFS; b++) {
+                if (busy[b]) continue;
+                size_t room = DFS_WRITE_BLOCK - pos % DFS_WRITE_BLOCK;  // Keep writes block-aligned
+                size[b] = left < room ? left : room;
+                got[b] = 0;
+                at[b] = pos;
+                busy[b] = write_failed ? 1 : 2;
+                inflight += busy[b];
+                dfs_uring_queue_block(r, b, 0, size[b], at[b], write_failed);
+                recving = b;
+                pos += size[b];
+                left -= size[b];
+                break;
+            }
+        }
+        if (inflight == 0) break;
+
+        struct io_uring_cqe cqe;
+        if (dfs_uring_wait(r, &cqe) < 0) {
+            r->broken = 1;  // Not expected: the CQ ring has room for every request
+            return -2;
+        }
+        int b = cqe.user_data / 2;
+        inflight--;
+        busy[b]--;
+
+        if (cqe.user_data % 2 == 0) {
+            // RECV done: sum what arrived, in stream order
+            if (cqe.res > 0) {
+                if (crc) *crc = dfs_crc32c(*crc, r->bufs[b] + got[b], cqe.res);
+                if (sha) dfs_sha256_update(sha, r->bufs[b] + got[b], cqe.res);
+                got[b] += cqe.res;
+            }
+            if (got[b] == size[b]) {
+                recving = -1;
+            } else if (cqe.res <= 0 && cqe.res != -EINTR && cqe.res != -EAGAIN) {
+                // Peer gone: keep what did arrive (cut back below, once all is done)
+                recving = -1;
+                sock_failed = 1;
+                cut = at[b] + got[b];
+                if (!write_failed && got[b] > 0 && dfs_uring_pwrite(fd, r->bufs[b], got[b], at[b]) < 0)
+                    write_failed = 1;
+            }
+            // Otherwise it came up short (a signal, or a kernel that ignores
+            // MSG_WAITALL here): the socket stays ours and the block resumes below
+        } else if (cqe.res == -ECANCELED) {
+            // Its RECV came up short
+        } else if (cqe.res < 0) {
+            write_failed = 1;
+        } else if ((size_t)cqe.res < size[b] &&
+                   dfs_uring_pwrite(fd, r->bufs[b] + cqe.res, size[b] - cqe.res, at[b] + cqe.res) < 0) {
+            write_failed = 1;
+        }
+
+        // Ask for the rest of a short block once its write (cancelled, or
+        // done with a partly filled buffer) is out of the way; the whole
+        // block is written again
+        if (recving == b && busy[b] == 0) {
+            busy[b] = write_failed ? 1 : 2;
+            inflight += busy[b];
+            dfs_uring_queue_block(r, b, got[b], size[b], at[b], write_failed);
+        }
+    }
+
+    if (sock_failed) {
+        if (ftruncate(fd, cut) == 0) lseek(fd, cut, SEEK_SET);  // Exactly what arrived
+        return -2;
+    }
+    lseek(fd, offset + len, SEEK_SET);
+    return write_failed ? -1 : 0;
+}
+
+// Point fixed-file slots 0 (the socket) and 1 (the part file) of ring `r`
+// at `sock` and `fd`; -1 and -1 empty them again. Returns -1 if the ring
+// did not take both.
+static inline int dfs_uring_files(struct dfs_uring* r, int sock, int fd) {
+    int files[2] = { sock, fd };
+    struct io_uring_files_update up = { 0, 0, (uintptr_t)files };
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES_UPDATE, &up, 2) == 2 ? 0 : -1;
+}
+
+// dfs_recv_summed through the calling thread's ring when the engine is on
+// and the frame is a plain one; otherwise (or if the ring cannot take this
+// transfer's files) exactly dfs_recv_summed. The ring lets go of the socket
+// and the file before this returns, so closing them really closes them.
+static inline int dfs_uring_recv_summed(int sock, const struct dfs_hdr* h, int fd, uint64_t offset, uint32_t* crc,
+                                        struct dfs_sha256* sha) {
+    struct dfs_uring* r = h->flags & DFS_FLAG_LZ4 ? NULL : dfs_uring_mine();
+    if (!r) return dfs_recv_summed(sock, h, fd, offset, crc, sha);
+    if (dfs_uring_files(r, sock, fd) < 0) {
+        dfs_uring_files(r, -1, -1);  // Either slot may have been taken
+        return dfs_recv_summed(sock, h, fd, offset, crc, sha);
+    }
+
+    uint32_t sent;
+    *crc = 0;
+    int read_failed = dfs_sum_file(fd, 0, offset, crc, sha) < 0;
+    int rc = dfs_uring_recv_file(r, fd, offset, dfs_body_len(h), crc, sha);
+    if (r->broken)
+        dfs_uring_retire();  // Its files go with it
+    else
+        dfs_uring_files(r, -1, -1);
+    if (rc == -2) return -2;
+    int have = dfs_recv_csum(sock, h, &sent);
+    if (have < 0) return -2;
+    if (rc < 0 || read_failed) return -1;
+    return have && sent != *crc ? -3 : 0;
+}
+
+#endif // DFS_URING_H
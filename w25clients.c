@@ -1,100 +1,211 @@
+#define _GNU_SOURCE  // splice(), pipe2()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <signal.h>
+#include <glob.h>
+#include <time.h>
+
+#include "dfs_proto.h"
+#include "dfs_delta.h"
 
 #define SERVER_IP "127.0.0.1"    // Server (S1) IP address - local machine
 #define PORT 6500                // S1's listening port
 #define BUFFER_SIZE 2048         // Size of buffer used for communication
+#define MAX_PIPELINE 256         // Most commands -p lets a session have outstanding
+#define MAX_STREAMS 64           // Most connections -j lets a batch open
 
-// Function to upload a local file to the server (S1)
-void upload_file(int sockfd, char* filename, char* destination) {
-    FILE *fp = fopen(filename, "rb");  // Open the file in read-binary mode
-    if (fp == NULL) {
-        printf("Error: Could not open file '%s'\n", filename);
-        return;
-    }
+static uint32_t next_request_id = 1;  // Tags each command frame; replies echo it back
 
-    // Construct the command to send to server: uploadf <filename> <destination>
-    char command[BUFFER_SIZE];
-    snprintf(command, sizeof(command), "uploadf %s %s", filename, destination);
-    send(sockfd, command, strlen(command), 0);  // Send uploadf command to server
+// Commands sent but not answered yet. Replies are read by a separate
+// thread and matched to their command by request id, so with -p N the
+// client keeps up to N commands in flight and S1 may answer them in any
+// order. Without -p the window is 1: each command waits for its reply.
+enum { REQ_UPLOAD, REQ_DOWNLOAD, REQ_TAR, REQ_TEXT };
 
-    // Wait for server to reply with "OK" before sending file
-    char buffer[BUFFER_SIZE];
-    int bytes = recv(sockfd, buffer, sizeof(buffer), 0);  // Read server response
-    buffer[bytes] = '\0';
+struct request {
+    uint32_t id;                 // 0 marks a free slot
+    int kind;                    // REQ_*
+    char name[BUFFER_SIZE];      // File or extension the command names
+    char save_as[256];           // downltar: tarball name
+    char* text;                  // REQ_TEXT under -p: reply gathered for one print
+    size_t text_len;
+};
 
-    // If server doesn't respond with OK, cancel upload
-    if (strncmp(buffer, "OK", 2) != 0) {
-        printf("Server error: %s\n", buffer);
-        fclose(fp);
-        return;
-    }
+static struct request pending[MAX_PIPELINE];
+static int npending;
+static int window = 1;           // Commands allowed in flight
+static int compress;             // -z: move .txt and .c files compressed (see dfs_proto.h)
+static int connection_lost;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_changed = PTHREAD_COND_INITIALIZER;
 
-    // Start sending file content in chunks until EOF
-    while ((bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        send(sockfd, buffer, bytes, 0);
+// Claim a slot for a new command, waiting while the window is full.
+// Returns NULL once the connection is gone.
+struct request* request_begin(int kind, const char* name) {
+    pthread_mutex_lock(&pending_lock);
+    while (npending >= window && !connection_lost)
+        pthread_cond_wait(&pending_changed, &pending_lock);
+    struct request* r = NULL;
+    if (!connection_lost) {
+        for (r = pending; r->id != 0; r++)
+            ;
+        memset(r, 0, sizeof(*r));
+        r->id = next_request_id++;
+        r->kind = kind;
+        snprintf(r->name, sizeof(r->name), "%s", name);
+        npending++;
     }
+    pthread_mutex_unlock(&pending_lock);
+    return r;
+}
+
+void request_end(struct request* r) {
+    pthread_mutex_lock(&pending_lock);
+    free(r->text);
+    r->text = NULL;
+    r->id = 0;
+    npending--;
+    pthread_cond_broadcast(&pending_changed);
+    pthread_mutex_unlock(&pending_lock);
+}
 
-    // Notify server that file transmission is done
-    send(sockfd, "EOF", 3, 0);
-    fclose(fp);  // Close the local file
+// Wait until every command sent so far has been answered
+void wait_idle(void) {
+    pthread_mutex_lock(&pending_lock);
+    while (npending > 0 && !connection_lost)
+        pthread_cond_wait(&pending_changed, &pending_lock);
+    pthread_mutex_unlock(&pending_lock);
+}
 
-    // Receive final confirmation message from server
-    bytes = recv(sockfd, buffer, sizeof(buffer), 0);
-    buffer[bytes] = '\0';
-    printf("%s\n", buffer);  // Print server’s acknowledgment
+// Print a line about a command; under -p it is tagged with the request id
+// since replies no longer arrive in the order the commands were typed
+void report(const struct request* r, const char* fmt, ...) {
+    char line[BUFFER_SIZE * 2];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (window > 1)
+        printf("[#%u] %s", r->id, line);
+    else
+        fputs(line, stdout);
+    fflush(stdout);
 }
 
-// Function to download a specific file from server
-void download_file(int sockfd, char* filename) {
+// Function to upload a local file to the server (S1)
+// Returns -1 if the connection broke while sending
+int upload_file(int sockfd, char* filename, char* destination) {
+    int fd = open(filename, O_RDONLY);  // Open the file for reading
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("Error: Could not open file '%s'\n", filename);
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    struct request* r = request_begin(REQ_UPLOAD, filename);
+    if (!r) {
+        close(fd);
+        return -1;
+    }
+
+    // Send the command frame: uploadf <filename> <destination>, plus the
+    // size when the file goes compressed (its frames do not tell it)
     char command[BUFFER_SIZE];
-    snprintf(command, sizeof(command), "downlf %s", filename);  // Build command
-    send(sockfd, command, strlen(command), 0);  // Send to server
+    uint32_t id = r->id;
+    int lz4 = compress && dfs_lz4_wanted(filename);
+    if (lz4)
+        snprintf(command, sizeof(command), "%s %s 0 %lld", filename, destination, (long long)st.st_size);
+    else
+        snprintf(command, sizeof(command), "%s %s", filename, destination);
 
+    // The file follows immediately as one DATA frame sized up front,
+    // ending with its checksum (or as compressed frames, with -z)
+    if (dfs_send_text(sockfd, DFS_OP_UPLOADF, id, command) < 0 ||
+        (lz4 ? dfs_send_summed_lz4(sockfd, id, fd, 0, st.st_size) : dfs_send_summed(sockfd, id, fd, 0, st.st_size)) < 0) {
+        printf("Error: Upload of '%s' interrupted\n", filename);
+        close(fd);
+        return -1;
+    }
+    close(fd);  // Close the local file
+    return 0;
+}
+
+// Final confirmation message for an upload
+int upload_reply(int sockfd, struct request* r, const struct dfs_hdr* reply) {
     char buffer[BUFFER_SIZE];
-    int bytes = recv(sockfd, buffer, sizeof(buffer), 0);  // Get server response
+    if (dfs_recv_text(sockfd, reply, buffer, sizeof(buffer)) < 0) return -1;
+    if (reply->opcode == DFS_OP_OK)
+        report(r, "%s\n", buffer);  // Print server’s acknowledgment
+    else
+        report(r, "Server error: %s\n", buffer);
+    return 0;
+}
 
-    // If server says NOTFOUND, file doesn’t exist
-    if (bytes == 8 && strncmp(buffer, "NOTFOUND", 8) == 0) {
-        printf("File '%s' not found on server.\n", filename);
-        return;
-    }
+// Function to download a specific file from server
+// With -z a .txt or .c file is asked for compressed
+int download_file(int sockfd, char* filename) {
+    struct request* r = request_begin(REQ_DOWNLOAD, filename);
+    if (!r) return -1;
+    int flags = compress && dfs_lz4_wanted(filename) ? DFS_FLAG_LZ4 : 0;
+    return dfs_send_frame(sockfd, DFS_OP_DOWNLF, flags, r->id, filename, strlen(filename));  // Send to server
+}
 
-    // Open file locally to save contents
-    FILE *fp = fopen(filename, "wb");
-    if (fp == NULL) {
-        printf("Error: Could not create file '%s'\n", filename);
-        return;
-    }
+// Save a downloaded file, or report why there is none
+int download_reply(int sockfd, struct request* r, const struct dfs_hdr* reply) {
+    const char* filename = r->name;
 
-    // Write first received chunk to file
-    fwrite(buffer, 1, bytes, fp);
+    // Anything but DATA means the file doesn’t exist (or can’t be fetched)
+    if (reply->opcode != DFS_OP_DATA) {
+        char buffer[BUFFER_SIZE];
+        if (dfs_recv_text(sockfd, reply, buffer, sizeof(buffer)) < 0) return -1;
+        if (strcmp(buffer, "BUSY") == 0)
+            report(r, "Server is busy; try downloading '%s' again shortly.\n", filename);
+        else
+            report(r, "File '%s' not found on server.\n", filename);
+        return 0;
+    }
 
-    // Keep receiving and writing until "EOF" received
-    while ((bytes = recv(sockfd, buffer, sizeof(buffer), 0)) > 0) {
-        if (bytes == 3 && strncmp(buffer, "EOF", 3) == 0) break;
-        fwrite(buffer, 1, bytes, fp);
+    // Save into the PWD under the file's own name
+    const char* base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    int fd = open(base, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        report(r, "Error: Could not create file '%s'\n", base);
+        return dfs_drain_data(sockfd, reply);
     }
 
-    fclose(fp);  // Close the downloaded file
-    printf("File '%s' downloaded successfully.\n", filename);
+    // Receive exactly the announced number of bytes, checking them against
+    // the checksum the server sends after them (decompressing as they come)
+    uint32_t crc;
+    int rc = dfs_recv_summed(sockfd, reply, fd, 0, &crc, NULL);
+    close(fd);  // Close the downloaded file
+    if (rc == -3) {
+        unlink(base);
+        report(r, "Error: '%s' arrived corrupted (checksum mismatch) and was discarded\n", filename);
+        return 0;
+    }
+    if (rc < 0) {
+        report(r, "Error: Download of '%s' failed\n", filename);
+        return rc == -2 ? -1 : 0;
+    }
+    report(r, "File '%s' downloaded successfully.\n", filename);
+    return 0;
 }
 
-// Function to request and download a tarball based on extension (.c, .pdf, .txt)
-void download_tar(int sockfd, char* extension) {
-    char command[BUFFER_SIZE];
-    snprintf(command, sizeof(command), "downltar %s", extension);  // Form the downltar command
-    send(sockfd, command, strlen(command), 0);  // Send to server
-    printf(" Sent downltar command: %s\n", command);
-
+// Function to request and download a tarball based on extension (.c, .pdf,
+// .txt, or any other extension S1 routes to a storage node)
+int download_tar(int sockfd, char* extension) {
     char save_as[256];
 
     // Choose tar file name based on extension
@@ -104,82 +215,759 @@ void download_tar(int sockfd, char* extension) {
         strcpy(save_as, "pdf.tar");
     else if (strcmp(extension, ".txt") == 0)
         strcpy(save_as, "text.tar");
+    else if (extension[0] == '.' && extension[1] && !strchr(extension, '/'))
+        snprintf(save_as, sizeof(save_as), "%s.tar", extension + 1);  // S1 says whether it has them
     else {
         printf("[ERROR] Unsupported extension: %s\n", extension);
-        return;
+        return 0;
+    }
+
+    struct request* r = request_begin(REQ_TAR, extension);
+    if (!r) return -1;
+    strcpy(r->save_as, save_as);
+    if (dfs_send_text(sockfd, DFS_OP_DOWNLTAR, r->id, extension) < 0) return -1;  // Send to server
+    printf(" Sent downltar command: downltar %s\n", extension);
+    return 0;
+}
+
+// Save a tarball into ~/w25downloads
+int tar_reply(int sockfd, struct request* r, const struct dfs_hdr* reply) {
+    const char* extension = r->name;
+    if (reply->opcode != DFS_OP_DATA) {
+        char buffer[BUFFER_SIZE];
+        if (dfs_recv_text(sockfd, reply, buffer, sizeof(buffer)) < 0) return -1;
+        report(r, "[ERROR] %s\n", buffer);
+        return 0;
     }
 
     // Save to /tmp folder for safety
     char full_path[BUFFER_SIZE];
-    snprintf(full_path, sizeof(full_path), "%s/w25downloads/%s", getenv("HOME"), save_as);  // e.g., /tmp/pdf.tar
+    snprintf(full_path, sizeof(full_path), "%s/w25downloads/%s", getenv("HOME"), r->save_as);  // e.g., /tmp/pdf.tar
 
-    printf(" Writing %s to %s\n", extension, full_path);
+    report(r, " Writing %s to %s\n", extension, full_path);
 
-    FILE* fp = fopen(full_path, "wb");  // Open file in /tmp for writing
-    if (!fp) {
-        perror("[ERROR] fopen failed");
-        return;
+    int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);  // Open file for writing
+    if (fd < 0) {
+        report(r, "[ERROR] open failed: %s\n", strerror(errno));
+        return dfs_drain(sockfd, reply->length);
     }
 
-    printf(" fopen path: %s\n", full_path);
-
-    char buffer[BUFFER_SIZE];
-    int bytes, total_written = 0;
+    report(r, " open path: %s\n", full_path);
 
-    // Receive tarball contents in chunks
-    while ((bytes = recv(sockfd, buffer, sizeof(buffer), 0)) > 0) {
-        if (bytes == 3 && memcmp(buffer, "EOF", 3) == 0) break;  // Stop when EOF received
-        fwrite(buffer, 1, bytes, fp);  // Write to local file
-        total_written += bytes;
+    // Receive exactly the announced tarball size
+    uint64_t total_written = reply->length;
+    int rc = dfs_recv_to_fd(sockfd, fd, reply->length);
+    if (rc < 0) {
+        report(r, "[ERROR] receiving tarball failed: %s\n", strerror(errno));
+        total_written = 0;
     }
 
-    fflush(fp);              // Flush buffer to disk
-    fsync(fileno(fp));       // Ensure it's physically written
-    fclose(fp);              // Close file
-    printf("[DEBUG] File closed successfully at: %s\n", full_path);
+    fsync(fd);               // Ensure it's physically written
+    close(fd);               // Close file
+    report(r, "[DEBUG] File closed successfully at: %s\n", full_path);
+    if (rc == -2) return -1;
 
     // Check if file exists and show its size
     struct stat st;
     if (stat(full_path, &st) == 0) {
-        printf(" Verified file EXISTS after fclose()\n");
-        printf(" File size on disk: %ld bytes\n", st.st_size);
+        report(r, " Verified file EXISTS after close()\n");
+        report(r, " File size on disk: %ld bytes\n", st.st_size);
     } else {
-        perror("[ERROR] stat failed after close()");
+        report(r, "[ERROR] stat failed after close(): %s\n", strerror(errno));
     }
 
-    printf(" Total bytes received: %d\n", total_written);
+    report(r, " Total bytes received: %llu\n", (unsigned long long)total_written);
 
     // Confirm to user if tar was downloaded successfully
     if (stat(full_path, &st) == 0 && st.st_size > 0) {
-        printf("[Client] %s downloaded and saved at /tmp. You may verify with:\n", save_as);
-        printf("         ls -lh %s\n         tar -tf %s\n", full_path, full_path);
+        report(r, "[Client] %s downloaded and saved at /tmp. You may verify with:\n", r->save_as);
+        report(r, "         ls -lh %s\n         tar -tf %s\n", full_path, full_path);
     } else {
-        printf("[ERROR] File %s not found or size = 0 bytes.\n", full_path);
+        report(r, "[ERROR] File %s not found or size = 0 bytes.\n", full_path);
     }
 
-    printf(" Completed download_tar for %s\n", extension);
+    report(r, " Completed download_tar for %s\n", extension);
+    return 0;
+}
+
+// One frame of a text reply (removef, dispfnames). A reply may come in
+// several frames (DFS_FLAG_MORE): interactively each is printed as it
+// arrives; under -p the whole reply is printed at once so replies to
+// different commands do not interleave.
+int text_reply(int sockfd, struct request* r, const struct dfs_hdr* reply) {
+    char* text = dfs_recv_text_alloc(sockfd, reply);
+    if (!text) return -1;
+    int last = !(reply->flags & DFS_FLAG_MORE);
+
+    if (window == 1) {
+        fputs(text, stdout);
+        if (last) printf("\n");
+        fflush(stdout);
+    } else {
+        char* grown = realloc(r->text, r->text_len + reply->length + 1);
+        if (grown) {
+            memcpy(grown + r->text_len, text, reply->length + 1);
+            r->text = grown;
+            r->text_len += reply->length;
+        }
+        if (last) report(r, "%s\n", r->text ? r->text : "");
+    }
+    free(text);
+    return 0;
+}
+
+// Reply thread: read every frame S1 sends and hand it to the command it answers
+void* reply_loop(void* arg) {
+    int sockfd = *(int*)arg;
+    struct dfs_hdr reply;
+
+    while (dfs_recv_hdr(sockfd, &reply) == 0) {
+        struct request* r = NULL;
+        pthread_mutex_lock(&pending_lock);
+        for (int i = 0; i < MAX_PIPELINE && !r; i++)
+            if (pending[i].id != 0 && pending[i].id == reply.request_id) r = &pending[i];
+        pthread_mutex_unlock(&pending_lock);
+
+        // A reply to nothing we asked for is skipped
+        if (!r) {
+            if (dfs_drain(sockfd, reply.length) < 0) break;
+            continue;
+        }
+
+        int rc;
+        if (r->kind == REQ_UPLOAD)
+            rc = upload_reply(sockfd, r, &reply);
+        else if (r->kind == REQ_DOWNLOAD)
+            rc = download_reply(sockfd, r, &reply);
+        else if (r->kind == REQ_TAR)
+            rc = tar_reply(sockfd, r, &reply);
+        else
+            rc = text_reply(sockfd, r, &reply);
+        if (rc < 0) break;  // Stream out of sync
+        if (r->kind != REQ_TEXT || !(reply.flags & DFS_FLAG_MORE))
+            request_end(r);
+    }
+
+    // Whatever is still pending will never be answered
+    pthread_mutex_lock(&pending_lock);
+    if (npending > 0)
+        printf("Error: Lost connection to server\n");
+    connection_lost = 1;
+    pthread_cond_broadcast(&pending_changed);
+    pthread_mutex_unlock(&pending_lock);
+    return NULL;
+}
+
+// ----------------------------
+// Batch transfers
+// `uploadf` with several files (or a glob, or @manifest) and `downlf` with
+// several paths (or @manifest) run as a batch: the files go into one shared
+// queue and `streams` worker threads, each on a connection of its own to S1,
+// take the next file as soon as they finish the last. Only failures are
+// printed per file; the batch ends with one line of totals and throughput.
+//
+// Transfers resume instead of restarting: `-c` continues an earlier,
+// interrupted upload or download of the same files, and a file whose
+// connection breaks mid-batch is retried on a fresh connection from where
+// it stopped. Uploads resume from the last whole chunk S1's side holds
+// (DFS_OP_RESUME); downloads from the end of the local file. `downlf -r
+// first-last` fetches only that byte range (inclusive; "first-" = to the
+// end) and writes it at the same offset of the local file.
+//
+// `downlf -s` stripes each file instead: it is cut into STRIPE_SIZE ranges
+// that all `streams` connections fetch at once, each writing its ranges
+// into place with pwrite(), so one large file is not held to the pace of
+// a single TCP stream.
+//
+// `uploadf -d` sends deltas: for a file the destination already holds, S1's
+// side returns the SHA-256 of each 1 MiB chunk of its copy and only the
+// chunks that differ are sent (see dfs_delta.h). A file without a stored
+// copy, or whose copy changed meanwhile, is uploaded in full.
+// ----------------------------
+#define BATCH_RETRIES 3          // Fresh connections tried per file after a break
+#define STRIPE_SIZE (4 * DFS_CHUNK_SIZE)  // Bytes one range request of a striped download covers
+
+static int streams = 4;          // Connections a batch opens (-j)
+
+struct batch {
+    int op;                      // DFS_OP_UPLOADF or DFS_OP_DOWNLF
+    char** items;                // Local files (upload) or remote paths (download)
+    size_t n;
+    const char* dest;            // Upload destination, e.g. ~S1/reports
+    int resume;                  // -c: continue earlier partial transfers
+    int ranged;                  // -r given: fetch only [offset, offset + length)
+    int striped;                 // -s: fetch each file as parallel ranges
+    int delta;                   // -d: upload only chunks the stored copy lacks
+    uint64_t offset, length;     // length 0 = to the end
+    pthread_mutex_t lock;        // Guards the fields below
+    size_t next;                 // First item not yet taken
+    size_t done, failed;
+    uint64_t bytes;
+    uint64_t unchanged;          // Bytes delta uploads did not have to send
+};
+
+// Open a connection to S1 (-1 on failure)
+int connect_s1(void) {
+    struct sockaddr_in server_addr;
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+    if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    int one = 1;  // Pipelined commands are small frames; don't let Nagle batch them
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sockfd;
+}
+
+// Append a copy of `item` to the batch (returns -1 if out of memory)
+int batch_add(struct batch* b, const char* item) {
+    if ((b->n & (b->n - 1)) == 0) {  // Grow at every power of two
+        char** bigger = realloc(b->items, (b->n ? b->n * 2 : 1) * sizeof(*bigger));
+        if (!bigger) return -1;
+        b->items = bigger;
+    }
+    if (!(b->items[b->n] = strdup(item))) return -1;
+    b->n++;
+    return 0;
+}
+
+// Add one word of the command line: "@file" adds every line of that
+// manifest, anything else is added as it is. Upload words (and manifest
+// lines) are expanded as globs; a pattern matching nothing stays literal
+// so it is reported as a file that cannot be opened.
+int batch_add_word(struct batch* b, const char* word) {
+    if (word[0] == '@') {
+        FILE* fp = fopen(word + 1, "r");
+        if (!fp) {
+            printf("Error: Could not open manifest '%s'\n", word + 1);
+            return -1;
+        }
+        char line[BUFFER_SIZE];
+        int rc = 0;
+        while (rc == 0 && fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0' && line[0] != '#') rc = batch_add_word(b, line);
+        }
+        fclose(fp);
+        return rc;
+    }
+    if (b->op != DFS_OP_UPLOADF) return batch_add(b, word);
+
+    glob_t g;
+    int rc = 0;
+    if (glob(word, GLOB_NOCHECK, NULL, &g) != 0) return batch_add(b, word);
+    for (size_t i = 0; i < g.gl_pathc && rc == 0; i++)
+        rc = batch_add(b, g.gl_pathv[i]);
+    globfree(&g);
+    return rc;
+}
+
+// Ask S1 where an interrupted upload of `filename` to `dest` may resume.
+// Returns the offset (0 to start over), or -2 if the connection broke.
+long long batch_resume_offset(int sockfd, uint32_t id, const char* filename, const char* dest) {
+    char command[BUFFER_SIZE], buffer[BUFFER_SIZE];
+    struct dfs_hdr reply;
+    snprintf(command, sizeof(command), "%s %s", filename, dest);
+    if (dfs_send_text(sockfd, DFS_OP_RESUME, id, command) < 0 || dfs_recv_hdr(sockfd, &reply) < 0 ||
+        reply.request_id != id || dfs_recv_text(sockfd, &reply, buffer, sizeof(buffer)) < 0)
+        return -2;
+    return reply.opcode == DFS_OP_OK ? (long long)strtoull(buffer, NULL, 10) : 0;
+}
+
+// Delta upload of one file: fetch the chunk digests of the stored copy and
+// send only the chunks that differ. Returns the bytes sent, -2 if the
+// connection broke, -3 if the file should be uploaded in full instead
+// (nothing stored to reuse, or the copy changed since its digests were sent).
+long long batch_delta_upload(int sockfd, uint32_t* id, const char* filename, int fd, uint64_t size,
+                             struct batch* b) {
+    char command[BUFFER_SIZE];
+    struct dfs_hdr reply;
+    snprintf(command, sizeof(command), "%s %s", filename, b->dest);
+    if (dfs_send_text(sockfd, DFS_OP_CHUNKS, ++*id, command) < 0 || dfs_recv_hdr(sockfd, &reply) < 0 ||
+        reply.request_id != *id)
+        return -2;
+    if (reply.opcode != DFS_OP_OK || reply.length == 0 || reply.length % DFS_SHA256_SIZE != 0 ||
+        reply.length > DFS_MAX_TEXT)
+        return dfs_drain(sockfd, reply.length) < 0 ? -2 : -3;
+    unsigned char* have = malloc(reply.length);
+    if (!have) return dfs_drain(sockfd, reply.length) < 0 ? -2 : -3;
+    if (dfs_recv_all(sockfd, have, reply.length) < 0) {
+        free(have);
+        return -2;
+    }
+
+    // The UPLOADF names the size, since the frame only holds the changed chunks
+    uint64_t sent;
+    char buffer[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "%s %s 0 %llu", filename, b->dest, (unsigned long long)size);
+    int ok = dfs_send_text(sockfd, DFS_OP_UPLOADF, ++*id, command) == 0 &&
+             dfs_send_delta(sockfd, *id, fd, size, have, reply.length / DFS_SHA256_SIZE, &sent) == 0;
+    free(have);
+    if (!ok || dfs_recv_hdr(sockfd, &reply) < 0 || reply.request_id != *id ||
+        dfs_recv_text(sockfd, &reply, buffer, sizeof(buffer)) < 0) {
+        printf("Error: Upload of '%s' interrupted\n", filename);
+        return -2;
+    }
+    if (reply.opcode != DFS_OP_OK) return -3;
+
+    pthread_mutex_lock(&b->lock);
+    b->unchanged += size - sent;
+    pthread_mutex_unlock(&b->lock);
+    return sent;
+}
+
+// Upload one file on a batch connection and wait for S1's verdict. With
+// `resume` set only the part S1 does not hold yet is sent; with the
+// batch's -d only the chunks S1's side does not hold.
+// Returns the bytes sent, -1 if S1 refused the file, -2 if the connection broke.
+long long batch_upload_one(int sockfd, uint32_t* id, const char* filename, struct batch* b, int resume) {
+    const char* dest = b->dest;
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("Error: Could not open file '%s'\n", filename);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    long long offset = resume ? batch_resume_offset(sockfd, ++*id, filename, dest) : 0;
+    if (offset == -2) {
+        close(fd);
+        return -2;
+    }
+    if (offset > st.st_size) offset = 0;  // What S1 holds is not a prefix of this file
+    if (b->delta && offset == 0 && st.st_size > 0) {
+        long long n = batch_delta_upload(sockfd, id, filename, fd, st.st_size, b);
+        if (n != -3) {
+            close(fd);
+            return n;
+        }
+    }
+
+    // A compressed upload names the file's size, as its frames do not tell it
+    char command[BUFFER_SIZE];
+    uint64_t len = st.st_size - offset;
+    int lz4 = compress && dfs_lz4_wanted(filename);
+    if (lz4)
+        snprintf(command, sizeof(command), "%s %s %lld %lld", filename, dest, offset, (long long)st.st_size);
+    else
+        snprintf(command, sizeof(command), "%s %s %lld", filename, dest, offset);
+    int sent = dfs_send_text(sockfd, DFS_OP_UPLOADF, ++*id, command) == 0 &&
+               (lz4 ? dfs_send_summed_lz4(sockfd, *id, fd, offset, len) : dfs_send_summed(sockfd, *id, fd, offset, len)) == 0;
+    close(fd);
+
+    struct dfs_hdr reply;
+    char buffer[BUFFER_SIZE];
+    if (!sent || dfs_recv_hdr(sockfd, &reply) < 0 || reply.request_id != *id ||
+        dfs_recv_text(sockfd, &reply, buffer, sizeof(buffer)) < 0) {
+        printf("Error: Upload of '%s' interrupted\n", filename);
+        return -2;
+    }
+    if (reply.opcode != DFS_OP_OK) {
+        printf("Server error for '%s': %s\n", filename, buffer);
+        return -1;
+    }
+    return len;
+}
+
+// Download one path on a batch connection into the PWD: the whole file,
+// the rest of it after what is already saved (`resume`), or the batch's
+// byte range. Returns the bytes saved, -1 if there is no such file, -2 if
+// the connection broke.
+long long batch_download_one(int sockfd, uint32_t* id, const char* path, const struct batch* b, int resume) {
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+
+    struct stat st;
+    uint64_t offset = b->offset, length = b->length;
+    int flags = O_RDWR | O_CREAT;  // A resume reads back what is saved to checksum it
+    if (!b->ranged && resume && stat(base, &st) == 0)
+        offset = st.st_size;
+    else if (!b->ranged)
+        flags |= O_TRUNC;
+
+    // Whole files (or their rest) may come compressed under -z; ranges come plain
+    char command[BUFFER_SIZE];
+    struct dfs_hdr reply;
+    int lz4 = compress && !b->ranged && dfs_lz4_wanted(path);
+    snprintf(command, sizeof(command), "%s %llu %llu", path, (unsigned long long)offset, (unsigned long long)length);
+    if (dfs_send_frame(sockfd, DFS_OP_DOWNLF, lz4 ? DFS_FLAG_LZ4 : 0, ++*id, command, strlen(command)) < 0 ||
+        dfs_recv_hdr(sockfd, &reply) < 0 || reply.request_id != *id) {
+        printf("Error: Download of '%s' interrupted\n", path);
+        return -2;
+    }
+    if (reply.opcode != DFS_OP_DATA) {
+        char buffer[BUFFER_SIZE];
+        if (dfs_recv_text(sockfd, &reply, buffer, sizeof(buffer)) < 0) return -2;
+        printf("File '%s' %s\n", path, strcmp(buffer, "BUSY") == 0 ? "skipped: server busy." : "not found on server.");
+        return -1;
+    }
+
+    // The bytes land at the offset they came from
+    int fd = open(base, flags, 0644);
+    if (fd < 0 || lseek(fd, offset, SEEK_SET) < 0) {
+        printf("Error: Could not create file '%s'\n", base);
+        if (fd >= 0) close(fd);
+        return dfs_drain_data(sockfd, &reply) < 0 ? -2 : -1;
+    }
+
+    // A whole file is checked against the server's checksum; a lone range can't be
+    uint32_t crc, sent;
+    uint64_t len = dfs_body_len(&reply);
+    int rc;
+    if (b->ranged) {
+        rc = dfs_recv_to_fd(sockfd, fd, len);
+        if (rc != -2 && dfs_recv_csum(sockfd, &reply, &sent) < 0) rc = -2;
+    } else {
+        rc = dfs_recv_summed(sockfd, &reply, fd, offset, &crc, NULL);
+        if (rc == 0 && (reply.flags & DFS_FLAG_LZ4))
+            len = lseek(fd, 0, SEEK_CUR) - offset;  // The frames only told the compressed size
+        if (rc == 0 && ftruncate(fd, offset + len) < 0) rc = -1;
+    }
+    close(fd);
+    if (rc == -3) {
+        unlink(base);
+        printf("Error: '%s' arrived corrupted (checksum mismatch) and was discarded\n", path);
+        return -1;
+    }
+    if (rc < 0) {
+        printf("Error: Download of '%s' failed\n", path);
+        return rc == -2 ? -2 : -1;
+    }
+    return len;
+}
+
+// Batch worker: take items off the shared queue until it is empty.
+// A broken connection is replaced and the item in hand resumed on the new
+// one, up to BATCH_RETRIES times.
+void* batch_worker(void* arg) {
+    struct batch* b = arg;
+    int sockfd = -1;
+    uint32_t id = 0;
+
+    while (1) {
+        pthread_mutex_lock(&b->lock);
+        size_t i = b->next < b->n ? b->next++ : b->n;
+        pthread_mutex_unlock(&b->lock);
+        if (i == b->n) break;
+
+        long long n = -2;
+        for (int attempt = 0; n == -2 && attempt <= BATCH_RETRIES; attempt++) {
+            if (sockfd < 0 && (sockfd = connect_s1()) < 0) {
+                printf("Error: Cannot connect to S1 for '%s'\n", b->items[i]);
+                break;
+            }
+            int resume = b->resume || attempt > 0;
+            n = b->op == DFS_OP_UPLOADF ? batch_upload_one(sockfd, &id, b->items[i], b, resume)
+                                        : batch_download_one(sockfd, &id, b->items[i], b, resume);
+            if (n == -2) {
+                close(sockfd);
+                sockfd = -1;
+            }
+        }
+
+        pthread_mutex_lock(&b->lock);
+        if (n >= 0) {
+            b->done++;
+            b->bytes += n;
+        } else {
+            b->failed++;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+    if (sockfd >= 0) close(sockfd);
+    return NULL;
+}
+
+// Run a batch to completion and print its totals
+void batch_run(struct batch* b) {
+    int nthreads = (size_t)streams < b->n ? streams : (int)b->n;
+    pthread_t threads[MAX_STREAMS];
+    struct timespec start, end;
+
+    pthread_mutex_init(&b->lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int started = 0;
+    for (; started < nthreads; started++)
+        if (pthread_create(&threads[started], NULL, batch_worker, b) != 0) break;
+    if (started == 0) batch_worker(b);  // No threads to spare: run it here
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_destroy(&b->lock);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+    char unchanged[64] = "";
+    if (b->delta)
+        snprintf(unchanged, sizeof(unchanged), "; %.1f MB unchanged, not sent", b->unchanged / 1e6);
+    printf("%s %zu of %zu files (%.1f MB) in %.2f s over %d connections: %.1f MB/s, %.0f files/s%s%s\n",
+           b->op == DFS_OP_UPLOADF ? "Uploaded" : "Downloaded", b->done, b->n, b->bytes / 1e6, secs,
+           started ? started : 1, b->bytes / 1e6 / secs, b->done / secs, unchanged,
+           b->failed ? "; see errors above" : "");
+}
+
+// One file being fetched by a striped download
+struct stripes {
+    const char* path;
+    int fd;                      // Local file, sized up front
+    uint64_t size;
+    pthread_mutex_t lock;        // Guards the fields below
+    uint64_t next;               // Offset of the first stripe not yet taken
+    uint64_t bytes;
+    int failed;
+    int have_crc;                // A reply carried the file's checksum
+    uint32_t crc;
+};
+
+// Fetch [offset, offset + len) of the file on `sockfd` and pwrite() it in place.
+// Returns 0, -1 if S1 refused it, -2 if the connection broke.
+int stripe_fetch(int sockfd, uint32_t id, struct stripes* s, uint64_t offset, uint64_t len) {
+    char command[BUFFER_SIZE];
+    struct dfs_hdr reply;
+    snprintf(command, sizeof(command), "%s %llu %llu", s->path, (unsigned long long)offset, (unsigned long long)len);
+    if (dfs_send_text(sockfd, DFS_OP_DOWNLF, id, command) < 0 || dfs_recv_hdr(sockfd, &reply) < 0 ||
+        reply.request_id != id)
+        return -2;
+    if (reply.opcode != DFS_OP_DATA || dfs_body_len(&reply) != len)  // Gone, or changed size meanwhile
+        return dfs_drain(sockfd, reply.length) < 0 ? -2 : -1;
+
+    // Every range carries the whole file's checksum, checked once all are in
+    uint32_t crc;
+    int rc = dfs_recv_to_fd_at(sockfd, s->fd, offset, len);
+    int have = rc == -2 ? -1 : dfs_recv_csum(sockfd, &reply, &crc);
+    if (have < 0) return -2;
+    if (have) {
+        pthread_mutex_lock(&s->lock);
+        s->have_crc = 1;
+        s->crc = crc;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return rc;
+}
+
+// Stripe worker: fetch stripes until none are left. A stripe whose
+// connection breaks is fetched again on a fresh connection.
+void* stripe_worker(void* arg) {
+    struct stripes* s = arg;
+    int sockfd = -1;
+    uint32_t id = 0;
+
+    while (1) {
+        pthread_mutex_lock(&s->lock);
+        uint64_t offset = s->next;
+        int stop = s->failed || offset >= s->size;
+        if (!stop) s->next += STRIPE_SIZE;
+        pthread_mutex_unlock(&s->lock);
+        if (stop) break;
+
+        uint64_t len = s->size - offset < STRIPE_SIZE ? s->size - offset : STRIPE_SIZE;
+        int rc = -2;
+        for (int attempt = 0; rc == -2 && attempt <= BATCH_RETRIES; attempt++) {
+            if (sockfd < 0 && (sockfd = connect_s1()) < 0) break;
+            rc = stripe_fetch(sockfd, ++id, s, offset, len);
+            if (rc == -2) {
+                close(sockfd);
+                sockfd = -1;
+            }
+        }
+
+        pthread_mutex_lock(&s->lock);
+        if (rc == 0) s->bytes += len;
+        else s->failed = 1;
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (sockfd >= 0) close(sockfd);
+    return NULL;
+}
+
+// Download one file as parallel ranges over `streams` connections.
+// Returns the bytes saved, or -1.
+long long stripe_download(const char* path) {
+    struct stripes s;
+    struct dfs_hdr reply;
+    char buffer[BUFFER_SIZE];
+    memset(&s, 0, sizeof(s));
+    s.path = path;
+
+    // The size comes from S1's index, so the stripes can be laid out first
+    int sockfd = connect_s1();
+    int ok = sockfd >= 0 && dfs_send_text(sockfd, DFS_OP_STAT, 1, path) == 0 &&
+             dfs_recv_hdr(sockfd, &reply) == 0 && dfs_recv_text(sockfd, &reply, buffer, sizeof(buffer)) == 0;
+    if (sockfd >= 0) close(sockfd);
+    if (!ok || reply.opcode != DFS_OP_OK) {
+        printf("File '%s' not found on server.\n", path);
+        return -1;
+    }
+    s.size = strtoull(buffer, NULL, 10);
+
+    // Size the local file up front; the stripes land in it out of order
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    s.fd = open(base, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (s.fd < 0 || ftruncate(s.fd, s.size) < 0) {
+        printf("Error: Could not create file '%s'\n", base);
+        if (s.fd >= 0) close(s.fd);
+        return -1;
+    }
+
+    uint64_t nstripes = (s.size + STRIPE_SIZE - 1) / STRIPE_SIZE;
+    int nthreads = nstripes < (uint64_t)streams ? (int)nstripes : streams;
+    pthread_t threads[MAX_STREAMS];
+    pthread_mutex_init(&s.lock, NULL);
+    int started = 0;
+    for (; started < nthreads; started++)
+        if (pthread_create(&threads[started], NULL, stripe_worker, &s) != 0) break;
+    if (started == 0 && nstripes > 0) stripe_worker(&s);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&s.lock);
+
+    // The ranges landed out of order, so the file is summed in one pass at the end
+    uint32_t crc = 0;
+    int corrupt = !s.failed && s.have_crc &&
+                  (dfs_crc32c_file(s.fd, 0, s.size, &crc) < 0 || crc != s.crc);
+    close(s.fd);
+
+    if (corrupt) {
+        unlink(base);
+        printf("Error: '%s' arrived corrupted (checksum mismatch) and was discarded\n", path);
+        return -1;
+    }
+    if (s.failed) {
+        printf("Error: Striped download of '%s' failed\n", path);
+        return -1;
+    }
+    return s.bytes;
+}
+
+// Striped downloads run one file at a time, each over every connection
+void stripe_run(struct batch* b) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < b->n; i++) {
+        long long n = stripe_download(b->items[i]);
+        if (n >= 0) {
+            b->done++;
+            b->bytes += n;
+        } else {
+            b->failed++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+    printf("Downloaded %zu of %zu files (%.1f MB) in %.2f s, striped over %d connections: %.1f MB/s%s\n",
+           b->done, b->n, b->bytes / 1e6, secs, streams, b->bytes / 1e6 / secs,
+           b->failed ? "; see errors above" : "");
+}
+
+// Parse the words after uploadf/downlf into a batch and run it.
+// Uploads take the destination as their last word.
+void batch_command(int op, char* args) {
+    struct batch b;
+    char* words[BUFFER_SIZE / 2];
+    int nwords = 0;
+    char* save = NULL;
+
+    memset(&b, 0, sizeof(b));
+    b.op = op;
+    for (char* w = strtok_r(args, " \t", &save); w; w = strtok_r(NULL, " \t", &save)) {
+        // Options: -c (resume); uploads also -d (delta); downloads also
+        // -r first-last and -s (striped)
+        if (strcmp(w, "-c") == 0) {
+            b.resume = 1;
+        } else if (strcmp(w, "-d") == 0 && op == DFS_OP_UPLOADF) {
+            b.delta = 1;
+        } else if (strcmp(w, "-s") == 0 && op == DFS_OP_DOWNLF) {
+            b.striped = 1;
+        } else if (strcmp(w, "-r") == 0 && op == DFS_OP_DOWNLF) {
+            char* range = strtok_r(NULL, " \t", &save);
+            unsigned long long first, last = 0;
+            int n = range ? sscanf(range, "%llu-%llu", &first, &last) : 0;
+            if (n < 1 || !strchr(range, '-') || (n == 2 && last < first)) {
+                printf("Usage: downlf -r <first>-[last] <path>\n");
+                return;
+            }
+            b.ranged = 1;
+            b.offset = first;
+            b.length = n == 2 ? last - first + 1 : 0;
+        } else {
+            words[nwords++] = w;
+        }
+    }
+    if (op == DFS_OP_UPLOADF) {
+        if (nwords < 2) {
+            printf("Usage: uploadf <file|glob|@manifest>... <~S1/path>\n");
+            return;
+        }
+        b.dest = words[--nwords];
+    }
+
+    int rc = 0;
+    for (int i = 0; i < nwords && rc == 0; i++)
+        rc = batch_add_word(&b, words[i]);
+    if (rc == 0 && b.n > 0 && b.striped)
+        stripe_run(&b);
+    else if (rc == 0 && b.n > 0)
+        batch_run(&b);
+    else if (rc == 0)
+        printf("Nothing to transfer\n");
+
+    for (size_t i = 0; i < b.n; i++) free(b.items[i]);
+    free(b.items);
+}
+
+// Does this command line name a batch rather than a single file (or use
+// the batch-only options -c, -d, -r and -s)?
+// `single` is how many words a plain command takes after its name; only
+// uploads expand globs, since they name local files.
+int is_batch(const char* args, int single, int globs) {
+    char copy[BUFFER_SIZE];
+    int nwords = 0;
+    char* save = NULL;
+    snprintf(copy, sizeof(copy), "%s", args);
+    for (char* w = strtok_r(copy, " \t", &save); w; w = strtok_r(NULL, " \t", &save)) {
+        if (w[0] == '@' || w[0] == '-' || (globs && nwords < single - 1 && strpbrk(w, "*?["))) return 1;
+        nwords++;
+    }
+    return nwords > single;
 }
 
 // Entry point of the client program
-int main() {
+// Usage: w25clients [-p depth] [-j streams]
+//   -p  keep up to `depth` commands in flight instead of waiting for each
+//       reply (for scripted bulk jobs, e.g. ./w25clients -p 32 < jobs.txt)
+//   -j  connections a batch uploadf/downlf spreads its files over (default 4)
+int main(int argc, char* argv[]) {
     int sockfd;
-    struct sockaddr_in server_addr;
     char input[BUFFER_SIZE];
 
-    // Create a TCP socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        exit(1);
+    int opt;
+    while ((opt = getopt(argc, argv, "p:j:z")) != -1) {
+        if (opt == 'p' && atoi(optarg) > 0) {
+            window = atoi(optarg) < MAX_PIPELINE ? atoi(optarg) : MAX_PIPELINE;
+        } else if (opt == 'j' && atoi(optarg) > 0) {
+            streams = atoi(optarg) < MAX_STREAMS ? atoi(optarg) : MAX_STREAMS;
+        } else if (opt == 'z') {
+            compress = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-p depth] [-j streams] [-z]\n", argv[0]);
+            return 1;
+        }
     }
 
-    // Prepare server address struct
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);  // Set server port
-    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);  // Convert IP from text to binary
+    signal(SIGPIPE, SIG_IGN);  // Report a dropped server as an error instead of dying
 
     // Connect to the server (S1)
-    if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    sockfd = connect_s1();
+    if (sockfd < 0) {
         perror("Connection failed");
         exit(1);
     }
@@ -190,19 +978,38 @@ int main() {
     printf("Connected to S1 at %s:%d\n", SERVER_IP, PORT);
     printf("[DEBUG] Client running in: %s\n", cwd);
 
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, reply_loop, &sockfd) != 0) {
+        perror("Cannot start reply thread");
+        exit(1);
+    }
+
     // Begin interactive command loop
+    int broken = 0;
     while (1) {
-        printf("w25clients$ ");  // Command-line prompt
-        fflush(stdout);
+        // Without -p, each command's output is complete before the next prompt
+        if (window == 1) {
+            wait_idle();
+            printf("w25clients$ ");  // Command-line prompt
+            fflush(stdout);
+        }
 
         if (fgets(input, sizeof(input), stdin) == NULL) break;  // Exit if input fails
         input[strcspn(input, "\n")] = '\0';  // Remove newline character
 
+        int rc = 0;
+        // Several files, a glob or a @manifest: run as a batch on its own connections
+        if ((strncmp(input, "uploadf ", 8) == 0 && is_batch(input + 8, 2, 1)) ||
+            (strncmp(input, "downlf ", 7) == 0 && is_batch(input + 7, 1, 0))) {
+            int upload = input[0] == 'u';
+            wait_idle();  // Keep its output apart from replies still due on this session
+            batch_command(upload ? DFS_OP_UPLOADF : DFS_OP_DOWNLF, input + (upload ? 8 : 7));
+
         // Handle uploadf command
-        if (strncmp(input, "uploadf", 7) == 0) {
+        } else if (strncmp(input, "uploadf", 7) == 0) {
             char filename[256], path[512];
-            if (sscanf(input, "uploadf %s %s", filename, path) == 2) {
-                upload_file(sockfd, filename, path);
+            if (sscanf(input, "uploadf %255s %511s", filename, path) == 2) {
+                rc = upload_file(sockfd, filename, path);
             } else {
                 printf("Usage: uploadf <filename> <~S1/S2/S3/S4/path>\n");
             }
@@ -210,8 +1017,8 @@ int main() {
         // Handle downlf command
         } else if (strncmp(input, "downlf", 6) == 0) {
             char filename[256];
-            if (sscanf(input, "downlf %s", filename) == 1) {
-                download_file(sockfd, filename);
+            if (sscanf(input, "downlf %255s", filename) == 1) {
+                rc = download_file(sockfd, filename);
             } else {
                 printf("Usage: downlf <filename>\n");
             }
@@ -219,8 +1026,8 @@ int main() {
         // Handle downltar command
         } else if (strncmp(input, "downltar", 8) == 0) {
             char extension[10];
-            if (sscanf(input, "downltar %s", extension) == 1) {
-                download_tar(sockfd, extension);
+            if (sscanf(input, "downltar %9s", extension) == 1) {
+                rc = download_tar(sockfd, extension);
             } else {
                 printf("Usage: downltar <.c/.pdf/.txt>\n");
             }
@@ -229,15 +1036,32 @@ int main() {
         } else if (strcmp(input, "quit") == 0) {
             break;
 
-        // Any other command is sent directly to the server
+        // Any other command (removef, dispfnames) is sent directly to the server
         } else {
-            send(sockfd, input, strlen(input), 0);  // Send command
-            int bytes = recv(sockfd, input, sizeof(input), 0);  // Get response
-            input[bytes] = '\0';
-            printf("%s\n", input);  // Print response
+            char word[32] = "";
+            sscanf(input, "%31s", word);
+            int op = dfs_opcode_for(word);
+            if (op == 0) {
+                printf("Unknown command: %s\n", word);
+                continue;
+            }
+
+            // Payload is everything after the command word
+            const char* args = input + strlen(word);
+            while (*args == ' ') args++;
+            struct request* r = request_begin(REQ_TEXT, word);
+            rc = r ? dfs_send_text(sockfd, op, r->id, args) : -1;  // Send command
+        }
+        if (rc < 0) {  // Connection is gone (or out of step mid-upload)
+            broken = 1;
+            break;
         }
     }
 
+    // Collect the replies still outstanding, then hang up
+    if (!broken) wait_idle();
+    shutdown(sockfd, SHUT_RDWR);
+    pthread_join(reader, NULL);
     close(sockfd);  // Close the socket before exiting
     return 0;
 }